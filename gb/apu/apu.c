@@ -0,0 +1,577 @@
+//
+//  apu.c
+//  CGBA
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "apu.h"
+#include "blip.h"
+#include "../cpu/memorymodule.h"
+#include "../state.h"
+
+///////**** Private ****///////
+
+#define APU_CHANNELS   4
+#define APU_SEQ_CYCLES 8192     // 512 Hz frame sequencer
+#define APU_SCALE      64       // 4 channels * 15 * 8 * 64 stays inside int16
+#define APU_LFSR_LONG  32767    // noise sequence lengths, 15 and 7 bit
+#define APU_LFSR_SHORT 127
+
+// register offsets from NR10
+#define NR10 0x00
+#define NR11 0x01
+#define NR12 0x02
+#define NR13 0x03
+#define NR14 0x04
+#define NR21 0x06
+#define NR22 0x07
+#define NR23 0x08
+#define NR24 0x09
+#define NR30 0x0A
+#define NR31 0x0B
+#define NR32 0x0C
+#define NR33 0x0D
+#define NR34 0x0E
+#define NR41 0x10
+#define NR42 0x11
+#define NR43 0x12
+#define NR44 0x13
+#define NR50 0x14
+#define NR51 0x15
+#define NR52 0x16
+#define WAVE 0x20
+
+#define NRX4_TRIGGER 0x80
+#define NRX4_LENGTH  0x40
+#define NR52_POWER   0x80
+
+enum { CH_SQUARE1, CH_SQUARE2, CH_WAVE, CH_NOISE };
+
+/*
+ *  Bits that read back as 1, write-only fields and unused registers
+ */
+static const uint8_t _apu_read_mask[APU_WAVE_RAM - APU_REG_NR10] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,
+    0x00, 0x00, 0x70,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const uint8_t _apu_duty[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+/*
+ *  One channel. The timer steps at `next` every `period` cycles while the
+ *  channel is on; `level` is the digital output (0-15) and out_l/out_r
+ *  what the mixers currently hold for it.
+ */
+struct _apu_chan {
+    uint8_t  on;
+    uint8_t  base;          // offset of the channel's first register
+    uint16_t length;
+    uint32_t period;
+    uint64_t next;
+    uint8_t  pos;           // duty step or wave sample
+    uint8_t  level;
+    uint8_t  volume;        // envelope
+    uint8_t  env_timer;
+    int32_t  out_l, out_r;
+};
+typedef struct _apu_chan _apu_chan;
+
+/*
+ *  One machine's APU and where its sound goes: the rate, what the mixers
+ *  hold per channel and the sample buffers. The calling thread runs the
+ *  one it was last bound to, see apu_bind.
+ */
+struct apu_context {
+    uint8_t   reg[APU_REG_END - APU_REG_NR10];
+    _apu_chan ch[APU_CHANNELS];
+
+    uint16_t sweep_freq;            // shadow frequency
+    uint8_t  sweep_timer;
+    uint8_t  sweep_on;
+    uint16_t lfsr;
+
+    uint64_t time;                  // master clock the APU has reached
+    uint64_t seq_next;
+    uint8_t  seq_step;
+
+    uint8_t  muted;                 // see apu_set_mute
+    uint32_t rate;                  // 0 makes no samples
+    double   ratio;                 // dynamic rate control, see apu_set_ratio
+    uint64_t frame;                 // master clock of the blip frame start
+    blip     left, right;
+};
+
+static SM_THREAD apu_context *_apu = NULL;
+
+static inline uint16_t _apu_freq(const _apu_chan *ch) {
+    return _apu->reg[ch->base + 3] | ((_apu->reg[ch->base + 4] & 0x07) << 8);
+}
+
+static uint8_t _apu_dac_on(int i) {
+    if (i == CH_WAVE) return _apu->reg[NR30] & 0x80;
+    return _apu->reg[_apu->ch[i].base + 2] & 0xF8;
+}
+
+static uint32_t _apu_period(int i) {
+    const _apu_chan *ch = &_apu->ch[i];
+    if (i == CH_WAVE) return (2048 - _apu_freq(ch)) * 2;
+    if (i == CH_NOISE) {
+        const uint8_t nr43 = _apu->reg[NR43];
+        const uint32_t divisor = (nr43 & 7) ? (nr43 & 7) * 16 : 8;
+        return divisor << (nr43 >> 4);
+    }
+    return (2048 - _apu_freq(ch)) * 4;
+}
+
+static uint8_t _apu_level(int i) {
+    const _apu_chan *ch = &_apu->ch[i];
+    if (!ch->on) return 0;
+    switch (i) {
+        case CH_WAVE: {
+            static const uint8_t shift[4] = { 4, 0, 1, 2 };
+            const uint8_t byte = _apu->reg[WAVE + ch->pos / 2];
+            return ((ch->pos & 1) ? byte & 0x0F : byte >> 4) >> shift[(_apu->reg[NR32] >> 5) & 3];
+        }
+        case CH_NOISE:
+            return (_apu->lfsr & 1) ? 0 : ch->volume;
+        default:
+            return ((_apu_duty[_apu->reg[ch->base + 1] >> 6] >> ch->pos) & 1) ? ch->volume : 0;
+    }
+}
+
+// Sends the channel's change in amplitude to the mixers at master clock t
+static void _apu_mix(int i, uint64_t t) {
+    _apu_chan *ch = &_apu->ch[i];
+    const uint8_t nr50 = _apu->reg[NR50], nr51 = _apu->reg[NR51];
+    const int32_t level = ch->level * APU_SCALE;
+    const int32_t l = (nr51 & (0x10 << i)) ? level * (((nr50 >> 4) & 7) + 1) : 0;
+    const int32_t r = (nr51 & (0x01 << i)) ? level * ((nr50 & 7) + 1) : 0;
+
+    if (!_apu->rate || _apu->muted) return;
+    if (l != ch->out_l) blip_add_delta(&_apu->left, (uint32_t)(t - _apu->frame), l - ch->out_l);
+    if (r != ch->out_r) blip_add_delta(&_apu->right, (uint32_t)(t - _apu->frame), r - ch->out_r);
+    ch->out_l = l;
+    ch->out_r = r;
+}
+
+static void _apu_refresh(int i, uint64_t t) {
+    _apu->ch[i].level = _apu_level(i);
+    _apu_mix(i, t);
+}
+
+static inline void _apu_lfsr_step() {
+    const uint16_t x = (_apu->lfsr ^ (_apu->lfsr >> 1)) & 1;
+    _apu->lfsr = (_apu->lfsr >> 1) | (x << 14);
+    if (_apu->reg[NR43] & 0x08) _apu->lfsr = (_apu->lfsr & ~0x40) | (x << 6);
+}
+
+// Whether the channel's steps can reach the output at all
+static uint8_t _apu_audible(int i) {
+    if (!_apu->rate || _apu->muted || !(_apu->reg[NR51] & (0x11 << i))) return 0;
+    if (i == CH_WAVE) return (_apu->reg[NR32] & 0x60) != 0;
+    return _apu->ch[i].volume != 0;
+}
+
+/*
+ *  Advances a channel nobody can hear to `to` without visiting its edges.
+ *  Duty and wave positions wrap, and the noise LFSR repeats with its
+ *  sequence length once the 7-bit mode has flushed the upper bits.
+ */
+static void _apu_skip_chan(int i, uint64_t to) {
+    _apu_chan *ch = &_apu->ch[i];
+    uint64_t steps = (to - ch->next + ch->period - 1) / ch->period;
+
+    ch->next += steps * ch->period;
+    if (i == CH_NOISE) {
+        const uint64_t len = (_apu->reg[NR43] & 0x08) ? APU_LFSR_SHORT : APU_LFSR_LONG;
+        if (steps > len + 16) steps = 16 + (steps - 16) % len;
+        while (steps--) _apu_lfsr_step();
+    }
+    else {
+        ch->pos = (ch->pos + steps) & (i == CH_WAVE ? 31 : 7);
+    }
+    if (_apu_level(i) != ch->level) _apu_refresh(i, to);
+}
+
+// Steps the channel's timer through every edge before `to`
+static void _apu_run_chan(int i, uint64_t to) {
+    _apu_chan *ch = &_apu->ch[i];
+
+    if (!ch->on || ch->next >= to) return;
+    if (!_apu_audible(i)) {
+        _apu_skip_chan(i, to);
+        return;
+    }
+    while (ch->next < to) {
+        if (i == CH_NOISE) _apu_lfsr_step();
+        else ch->pos = (ch->pos + 1) & (i == CH_WAVE ? 31 : 7);
+        if (_apu_level(i) != ch->level) _apu_refresh(i, ch->next);
+        ch->next += ch->period;
+    }
+}
+
+static uint16_t _apu_sweep_calc() {
+    const uint8_t nr10 = _apu->reg[NR10];
+    const uint16_t delta = _apu->sweep_freq >> (nr10 & 7);
+    const uint16_t freq = (nr10 & 0x08) ? _apu->sweep_freq - delta : _apu->sweep_freq + delta;
+    // overflowing 11 bits silences the channel
+    if (freq > 2047) _apu->ch[CH_SQUARE1].on = 0;
+    return freq;
+}
+
+static void _apu_sweep_tick() {
+    const uint8_t nr10 = _apu->reg[NR10];
+    const uint8_t period = (nr10 >> 4) & 7;
+    uint16_t freq;
+
+    // a silenced channel keeps its shadow frequency until retriggered
+    if (!_apu->ch[CH_SQUARE1].on || --_apu->sweep_timer) return;
+    _apu->sweep_timer = period ? period : 8;
+    if (!_apu->sweep_on || !period) return;
+
+    freq = _apu_sweep_calc();
+    if (freq <= 2047 && (nr10 & 7)) {
+        _apu->sweep_freq = freq;
+        _apu->reg[NR13] = freq & 0xFF;
+        _apu->reg[NR14] = (_apu->reg[NR14] & ~0x07) | (freq >> 8);
+        _apu->ch[CH_SQUARE1].period = _apu_period(CH_SQUARE1);
+        _apu_sweep_calc();
+    }
+}
+
+static void _apu_length_tick(int i) {
+    _apu_chan *ch = &_apu->ch[i];
+    if (!(_apu->reg[ch->base + 4] & NRX4_LENGTH) || !ch->length) return;
+    if (--ch->length == 0) ch->on = 0;
+}
+
+static void _apu_env_tick(int i) {
+    _apu_chan *ch = &_apu->ch[i];
+    const uint8_t nrx2 = _apu->reg[ch->base + 2];
+    const uint8_t period = nrx2 & 7;
+
+    if (!period || --ch->env_timer) return;
+    ch->env_timer = period;
+    if ((nrx2 & 0x08) && ch->volume < 15) ch->volume++;
+    else if (!(nrx2 & 0x08) && ch->volume > 0) ch->volume--;
+}
+
+// One 512 Hz step: length on even steps, sweep on 2 and 6, envelope on 7
+static void _apu_sequencer(uint64_t t) {
+    int i;
+
+    if (!(_apu->reg[NR52] & NR52_POWER)) return;
+    for (i = 0; i < APU_CHANNELS; i++) {
+        if (!(_apu->seq_step & 1)) _apu_length_tick(i);
+    }
+    if (_apu->seq_step == 2 || _apu->seq_step == 6) _apu_sweep_tick();
+    if (_apu->seq_step == 7) {
+        _apu_env_tick(CH_SQUARE1);
+        _apu_env_tick(CH_SQUARE2);
+        _apu_env_tick(CH_NOISE);
+    }
+    _apu->seq_step = (_apu->seq_step + 1) & 7;
+
+    for (i = 0; i < APU_CHANNELS; i++) {
+        if (_apu_level(i) != _apu->ch[i].level) _apu_refresh(i, t);
+    }
+}
+
+// Nothing is playing, so of the steps up to `to` only length counters matter
+static void _apu_seq_skip(uint64_t to) {
+    const uint64_t steps = (to - _apu->seq_next) / APU_SEQ_CYCLES + 1;
+    const uint64_t even = (steps + !(_apu->seq_step & 1)) / 2;
+    int i;
+
+    _apu->seq_next += steps * APU_SEQ_CYCLES;
+    if (!(_apu->reg[NR52] & NR52_POWER)) return;
+    for (i = 0; i < APU_CHANNELS; i++) {
+        _apu_chan *ch = &_apu->ch[i];
+        if (!(_apu->reg[ch->base + 4] & NRX4_LENGTH)) continue;
+        ch->length = ch->length > even ? ch->length - even : 0;
+    }
+    _apu->seq_step = (_apu->seq_step + steps) & 7;
+}
+
+static void _apu_trigger(int i) {
+    _apu_chan *ch = &_apu->ch[i];
+    const uint8_t nrx2 = _apu->reg[ch->base + 2];
+
+    ch->on = _apu_dac_on(i) != 0;
+    if (!ch->length) ch->length = i == CH_WAVE ? 256 : 64;
+    ch->period = _apu_period(i);
+    ch->next = _apu->time + ch->period;
+    ch->volume = nrx2 >> 4;
+    ch->env_timer = nrx2 & 7;
+
+    if (i == CH_WAVE) ch->pos = 0;
+    if (i == CH_NOISE) _apu->lfsr = 0x7FFF;
+    if (i == CH_SQUARE1) {
+        const uint8_t nr10 = _apu->reg[NR10];
+        _apu->sweep_freq = _apu_freq(ch);
+        _apu->sweep_timer = ((nr10 >> 4) & 7) ? (nr10 >> 4) & 7 : 8;
+        _apu->sweep_on = (nr10 & 0x77) != 0;
+        if (nr10 & 7) _apu_sweep_calc();
+    }
+}
+
+static void _apu_power_off() {
+    int i;
+    memset(_apu->reg, 0, WAVE);
+    for (i = 0; i < APU_CHANNELS; i++) {
+        _apu->ch[i].on = 0;
+        _apu->ch[i].length = 0;
+        _apu_refresh(i, _apu->time);
+    }
+}
+
+static uint8_t _apu_read(uint16_t addr) {
+    const uint8_t off = addr - APU_REG_NR10;
+    uint8_t status = 0;
+    int i;
+
+    apu_run_to(sm_get_cycles());
+    if (addr >= APU_WAVE_RAM) return _apu->reg[off];
+    if (off == NR52) {
+        for (i = 0; i < APU_CHANNELS; i++) status |= _apu->ch[i].on << i;
+        return (_apu->reg[NR52] & NR52_POWER) | _apu_read_mask[NR52] | status;
+    }
+    return _apu->reg[off] | _apu_read_mask[off];
+}
+
+static void _apu_write(uint16_t addr, uint8_t data) {
+    const uint8_t off = addr - APU_REG_NR10;
+    int i = off / 5;
+
+    apu_run_to(sm_get_cycles());
+    if (addr >= APU_WAVE_RAM) {
+        _apu->reg[off] = data;
+        return;
+    }
+    if (off == NR52) {
+        if (!(data & NR52_POWER) && (_apu->reg[NR52] & NR52_POWER)) _apu_power_off();
+        if ((data & NR52_POWER) && !(_apu->reg[NR52] & NR52_POWER)) _apu->seq_step = 0;
+        _apu->reg[NR52] = data & NR52_POWER;
+        return;
+    }
+    // registers are read only while powered off
+    if (!(_apu->reg[NR52] & NR52_POWER)) return;
+    _apu->reg[off] = data;
+
+    if (off >= NR50) {
+        // the mix changes for every channel
+        for (i = 0; i < APU_CHANNELS; i++) _apu_mix(i, _apu->time);
+        return;
+    }
+    if (i >= APU_CHANNELS) return;
+
+    switch (off - _apu->ch[i].base) {
+        case 1:
+            if (i == CH_WAVE) _apu->ch[i].length = 256 - data;
+            else _apu->ch[i].length = 64 - (data & 0x3F);
+            break;
+        case 3:
+            _apu->ch[i].period = _apu_period(i);
+            break;
+        case 4:
+            _apu->ch[i].period = _apu_period(i);
+            if (data & NRX4_TRIGGER) _apu_trigger(i);
+            break;
+    }
+    if (!_apu_dac_on(i)) _apu->ch[i].on = 0;
+    _apu_refresh(i, _apu->time);
+}
+
+///////**** Public ****///////
+
+// A copy makes no sound until it is given a rate of its own
+apu_context *apu_context_new(const apu_context *from) {
+    apu_context *c = malloc(sizeof(apu_context));
+
+    if (!c) return NULL;
+    if (from) {
+        memcpy(c, from, sizeof(apu_context));
+        c->rate = 0;
+    }
+    else {
+        memset(c, 0, sizeof(apu_context));
+    }
+    return c;
+}
+
+void apu_context_free(apu_context *c) {
+    free(c);
+}
+
+void apu_bind(apu_context *c) {
+    _apu = c;
+}
+
+// Post-boot state, sound on with every channel silent
+void apu_reset() {
+    static const uint8_t base[APU_CHANNELS] = { NR10, NR21 - 1, NR30, NR41 - 1 };
+    int i;
+
+    memset(_apu->reg, 0, sizeof(_apu->reg));
+    memset(_apu->ch, 0, sizeof(_apu->ch));
+    for (i = 0; i < APU_CHANNELS; i++) _apu->ch[i].base = base[i];
+    _apu->lfsr = 0x7FFF;
+    _apu->sweep_on = 0;
+    _apu->time = _apu->frame = sm_get_cycles();
+    _apu->seq_next = _apu->time + APU_SEQ_CYCLES;
+    _apu->seq_step = 0;
+    _apu->reg[NR52] = NR52_POWER;
+    _apu->reg[NR50] = 0x77;
+    _apu->reg[NR51] = 0xF3;
+    if (_apu->rate) {
+        blip_clear(&_apu->left);
+        blip_clear(&_apu->right);
+    }
+    sm_map_io(APU_REG_NR10, APU_REG_END - 1, _apu_read, _apu_write);
+}
+
+void apu_set_rate(uint32_t hz) {
+    _apu->rate = hz;
+    _apu->ratio = 1;
+    if (hz) {
+        blip_init(&_apu->left, APU_CLOCK_HZ, hz);
+        blip_init(&_apu->right, APU_CLOCK_HZ, hz);
+    }
+    _apu->frame = _apu->time;
+}
+
+uint32_t apu_get_rate() {
+    return _apu->rate;
+}
+
+// Scales the output rate, samples before now keep the old ratio
+void apu_set_ratio(double ratio) {
+    if (!_apu->rate || ratio == _apu->ratio) return;
+    apu_run_to(sm_get_cycles());
+    _apu->ratio = ratio;
+    blip_set_rates(&_apu->left, APU_CLOCK_HZ, _apu->rate * ratio);
+    blip_set_rates(&_apu->right, APU_CLOCK_HZ, _apu->rate * ratio);
+}
+
+/*
+ *  Muted time adds nothing to the sample buffers, not even silence: the
+ *  mixers keep the levels from before and pick up the current ones when
+ *  sound comes back. Loading the snapshot taken as muting began therefore
+ *  joins the sound up as if the muted frames never ran.
+ */
+void apu_set_mute(uint8_t mute) {
+    int i;
+
+    if (mute == _apu->muted) return;
+    if (mute) apu_run_to(sm_get_cycles());
+    _apu->muted = mute;
+    if (!mute) {
+        _apu->frame = _apu->time;
+        for (i = 0; i < APU_CHANNELS; i++) _apu_mix(i, _apu->time);
+    }
+}
+
+/*
+ *  Runs every channel and the frame sequencer up to master clock `cycles`.
+ *  Nothing calls this per instruction: register accesses catch up first
+ *  and the frontend catches up when it drains samples.
+ */
+void apu_run_to(uint64_t cycles) {
+    int i;
+
+    if (cycles <= _apu->time) return;
+    while (_apu->time < cycles) {
+        const uint64_t end = _apu->seq_next < cycles ? _apu->seq_next : cycles;
+        if (!(_apu->ch[0].on | _apu->ch[1].on | _apu->ch[2].on | _apu->ch[3].on) && end == _apu->seq_next) {
+            _apu_seq_skip(cycles);
+            _apu->time = cycles;
+            break;
+        }
+        for (i = 0; i < APU_CHANNELS; i++) _apu_run_chan(i, end);
+        _apu->time = end;
+        if (end == _apu->seq_next) {
+            _apu_sequencer(end);
+            _apu->seq_next += APU_SEQ_CYCLES;
+        }
+    }
+    if (_apu->rate && !_apu->muted) {
+        blip_end_frame(&_apu->left, (uint32_t)(_apu->time - _apu->frame));
+        blip_end_frame(&_apu->right, (uint32_t)(_apu->time - _apu->frame));
+    }
+    _apu->frame = _apu->time;
+}
+
+// Caught up first, so the same machine saves the same however long ago
+// its sound was last drained
+void apu_save(uint8_t *out) {
+    int i;
+
+    apu_run_to(sm_get_cycles());
+
+    memcpy(out, _apu->reg, sizeof(_apu->reg));
+    out += sizeof(_apu->reg);
+    for (i = 0; i < APU_CHANNELS; i++) {
+        const _apu_chan *ch = &_apu->ch[i];
+        st_put8(&out, ch->on);
+        st_put16(&out, ch->length);
+        st_put32(&out, ch->period);
+        st_put64(&out, ch->next);
+        st_put8(&out, ch->pos);
+        st_put8(&out, ch->level);
+        st_put8(&out, ch->volume);
+        st_put8(&out, ch->env_timer);
+    }
+    st_put16(&out, _apu->sweep_freq);
+    st_put8(&out, _apu->sweep_timer);
+    st_put8(&out, _apu->sweep_on);
+    st_put16(&out, _apu->lfsr);
+    st_put64(&out, _apu->time);
+    st_put64(&out, _apu->seq_next);
+    st_put8(&out, _apu->seq_step);
+}
+
+// The mixers step from what they held to the loaded channels
+void apu_load(const uint8_t *in) {
+    int i;
+
+    memcpy(_apu->reg, in, sizeof(_apu->reg));
+    in += sizeof(_apu->reg);
+    for (i = 0; i < APU_CHANNELS; i++) {
+        _apu_chan *ch = &_apu->ch[i];
+        ch->on = st_get8(&in);
+        ch->length = st_get16(&in);
+        ch->period = st_get32(&in);
+        ch->next = st_get64(&in);
+        ch->pos = st_get8(&in);
+        ch->level = st_get8(&in);
+        ch->volume = st_get8(&in);
+        ch->env_timer = st_get8(&in);
+    }
+    _apu->sweep_freq = st_get16(&in);
+    _apu->sweep_timer = st_get8(&in);
+    _apu->sweep_on = st_get8(&in);
+    _apu->lfsr = st_get16(&in);
+    _apu->time = st_get64(&in);
+    _apu->seq_next = st_get64(&in);
+    _apu->seq_step = st_get8(&in);
+
+    _apu->frame = _apu->time;
+    for (i = 0; i < APU_CHANNELS; i++) _apu_mix(i, _apu->time);
+}
+
+size_t apu_avail() {
+    return _apu->rate ? blip_avail(&_apu->left) : 0;
+}
+
+// Interleaved stereo, returns the frames written
+size_t apu_read(int16_t *out, size_t frames) {
+    if (!_apu->rate) return 0;
+    frames = blip_read(&_apu->left, out, frames, 2);
+    blip_read(&_apu->right, out + 1, frames, 2);
+    return frames;
+}
@@ -0,0 +1,61 @@
+//
+//  apu.h
+//  CGBA
+//
+
+/*
+ * DMG audio processing unit
+ * - two square channels (the first with frequency sweep), a wave channel
+ *   and a noise channel, clocked by the 512 Hz frame sequencer for
+ *   length, envelope and sweep
+ * - channels are event driven: each timer jumps straight to its next
+ *   step and only amplitude changes reach the mixer, as deltas into
+ *   band-limited step buffers (blip.h) per stereo side
+ * - output is interleaved signed 16-bit stereo at the host's rate
+ * - registers 0xFF10-0xFF3F are claimed through sm_map_io
+ * - lazy: the APU only runs forward when a sound register is accessed or
+ *   the frontend drains samples, and channels nobody can hear (synthesis
+ *   off, muted or unrouted) advance their timers in closed form
+ */
+
+#ifndef __CGBA__apu__
+#define __CGBA__apu__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define APU_CLOCK_HZ 4194304
+
+// Sound registers
+#define APU_REG_NR10 0xFF10
+#define APU_REG_NR50 0xFF24
+#define APU_REG_NR51 0xFF25
+#define APU_REG_NR52 0xFF26
+#define APU_WAVE_RAM 0xFF30
+#define APU_REG_END  0xFF40
+
+/*
+ *  A machine's APU with its sound output. The calls below act on the
+ *  context the calling thread was bound to last.
+ */
+typedef struct apu_context apu_context;
+apu_context *apu_context_new(const apu_context *from);  // a copy of from, or blank for apu_reset
+void apu_context_free(apu_context *c);
+void apu_bind(apu_context *c);
+
+void apu_reset();
+void apu_set_rate(uint32_t hz);     // 0 turns synthesis off
+uint32_t apu_get_rate();
+void apu_set_ratio(double ratio);   // fine adjustment of the rate, around 1
+void apu_set_mute(uint8_t mute);    // keeps time but makes no samples, e.g. for run-ahead
+
+void apu_run_to(uint64_t cycles);   // master clock, see sm_get_cycles
+size_t apu_avail();
+size_t apu_read(int16_t *out, size_t frames);
+
+// Snapshot payload, see gb/state.h; samples not yet read are kept
+#define APU_STATE_SIZE 147
+void apu_save(uint8_t *out);
+void apu_load(const uint8_t *in);
+
+#endif /* defined(__CGBA__apu__) */
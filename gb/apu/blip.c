@@ -0,0 +1,111 @@
+//
+//  blip.c
+//  CGBA
+//
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include "blip.h"
+
+///////**** Private ****///////
+
+#define BLIP_FRAC        32
+#define BLIP_KERNEL_BITS 12     // every kernel row sums to 1 << BLIP_KERNEL_BITS
+#define BLIP_BASS_SHIFT  9      // DC blocker, about 15 Hz at 48 kHz
+#define BLIP_CUTOFF      0.9    // of the output Nyquist frequency
+
+/*
+ *  Step kernels, one row per fractional position. Outputs lag the input
+ *  by BLIP_TAPS / 2 samples so the kernel never reaches back in time.
+ */
+static int16_t _blip_kernel[BLIP_PHASES][BLIP_TAPS];
+static pthread_once_t _blip_kernel_once = PTHREAD_ONCE_INIT;     // shared by every machine's APU
+
+static void _blip_make_kernel() {
+    const double pi = 3.14159265358979323846;
+    int p, i;
+
+    for (p = 0; p < BLIP_PHASES; p++) {
+        double row[BLIP_TAPS], sum = 0;
+        int total = 0;
+        for (i = 0; i < BLIP_TAPS; i++) {
+            const double x = i - (BLIP_TAPS / 2 - 1) - (double)p / BLIP_PHASES;
+            const double w = 0.42 + 0.5 * cos(pi * x / (BLIP_TAPS / 2)) +
+                             0.08 * cos(2 * pi * x / (BLIP_TAPS / 2));
+            const double s = x == 0 ? 1.0 : sin(pi * BLIP_CUTOFF * x) / (pi * BLIP_CUTOFF * x);
+            row[i] = s * (fabs(x) < BLIP_TAPS / 2 ? w : 0);
+            sum += row[i];
+        }
+        for (i = 0; i < BLIP_TAPS; i++) {
+            _blip_kernel[p][i] = (int16_t)floor(row[i] / sum * (1 << BLIP_KERNEL_BITS) + 0.5);
+            total += _blip_kernel[p][i];
+        }
+        // rounding error goes to the center tap so every step is exact
+        _blip_kernel[p][BLIP_TAPS / 2 - 1] += (1 << BLIP_KERNEL_BITS) - total;
+    }
+}
+
+///////**** Public ****///////
+
+void blip_init(blip *b, double clock_hz, double sample_hz) {
+    pthread_once(&_blip_kernel_once, _blip_make_kernel);
+    blip_set_rates(b, clock_hz, sample_hz);
+    blip_clear(b);
+}
+
+void blip_set_rates(blip *b, double clock_hz, double sample_hz) {
+    b->factor = (uint64_t)(sample_hz / clock_hz * 4294967296.0 + 0.5);
+}
+
+void blip_clear(blip *b) {
+    b->offset = 0;
+    b->integrator = 0;
+    memset(b->buf, 0, sizeof(b->buf));
+}
+
+// clock is relative to the start of the current frame
+void blip_add_delta(blip *b, uint32_t clock, int32_t delta) {
+    const uint64_t pos = clock * b->factor + b->offset;
+    const size_t index = pos >> BLIP_FRAC;
+    const int16_t *k = _blip_kernel[(pos >> (BLIP_FRAC - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    int32_t *out = &b->buf[index];
+    int i;
+
+    if (!delta || index >= BLIP_MAX_SAMPLES) return;
+    for (i = 0; i < BLIP_TAPS; i++) out[i] += delta * k[i];
+}
+
+// Ends the frame after clocks, its samples become readable
+void blip_end_frame(blip *b, uint32_t clocks) {
+    b->offset += clocks * b->factor;
+    if ((b->offset >> BLIP_FRAC) > BLIP_MAX_SAMPLES) {
+        b->offset = (uint64_t)BLIP_MAX_SAMPLES << BLIP_FRAC;
+    }
+}
+
+size_t blip_avail(const blip *b) {
+    return b->offset >> BLIP_FRAC;
+}
+
+// Reads up to count samples, every stride-th int16 of out
+size_t blip_read(blip *b, int16_t *out, size_t count, int stride) {
+    const size_t avail = blip_avail(b);
+    int32_t sum = b->integrator;
+    size_t i;
+
+    if (count > avail) count = avail;
+    for (i = 0; i < count; i++) {
+        int32_t s;
+        sum += b->buf[i];
+        s = sum >> BLIP_KERNEL_BITS;
+        out[i * stride] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+        sum -= s * (1 << (BLIP_KERNEL_BITS - BLIP_BASS_SHIFT));
+    }
+    b->integrator = sum;
+
+    memmove(b->buf, b->buf + count, (BLIP_MAX_SAMPLES + BLIP_TAPS - count) * sizeof(int32_t));
+    memset(b->buf + BLIP_MAX_SAMPLES + BLIP_TAPS - count, 0, count * sizeof(int32_t));
+    b->offset -= (uint64_t)count << BLIP_FRAC;
+    return count;
+}
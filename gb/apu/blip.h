@@ -0,0 +1,44 @@
+//
+//  blip.h
+//  CGBA
+//
+
+/*
+ * Band-limited step synthesis
+ * - a sound source only reports amplitude changes (deltas) with the clock
+ *   time they happen at, each delta adds a windowed-sinc step kernel
+ *   into the output buffer at its fractional sample position
+ * - reading integrates the deltas back into samples, so the work scales
+ *   with the number of changes and output samples, not with clock rate
+ * - clock to sample rate conversion is a 32.32 fixed point ratio
+ */
+
+#ifndef __CGBA__blip__
+#define __CGBA__blip__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define BLIP_TAPS        16
+#define BLIP_PHASE_BITS  5
+#define BLIP_PHASES      (1 << BLIP_PHASE_BITS)
+#define BLIP_MAX_SAMPLES 4096   // unread samples a buffer can hold
+
+struct blip {
+    uint64_t factor;        // samples per clock, 32.32
+    uint64_t offset;        // position of clock 0 of the current frame, 32.32
+    int32_t  integrator;
+    int32_t  buf[BLIP_MAX_SAMPLES + BLIP_TAPS];
+};
+typedef struct blip blip;
+
+void blip_init(blip *b, double clock_hz, double sample_hz);
+void blip_set_rates(blip *b, double clock_hz, double sample_hz);
+void blip_clear(blip *b);
+
+void blip_add_delta(blip *b, uint32_t clock, int32_t delta);
+void blip_end_frame(blip *b, uint32_t clocks);
+size_t blip_avail(const blip *b);
+size_t blip_read(blip *b, int16_t *out, size_t count, int stride);
+
+#endif /* defined(__CGBA__blip__) */
@@ -5,7 +5,6 @@
 
 #include "interpreter.h"
 #include "memorymodule.h"
-#include <execinfo.h>
 
 ///////**** Private ****///////
 
@@ -739,19 +738,10 @@ void _ip_RRC_A() {
 
 // 0x10 // undefined
 void _ip_STOP() {
+    // idle until a key is pressed, see sys_step; undefined opcodes land
+    // here too, rather than blocking the host thread
     sm_set_reg_stop(TRUE);
-    // pause program
-    printf("STOP or UNDEFINED command called");
-    
-    #ifdef __GNUC__
-    {
-        const uint8_t btsize = 10;
-        void * backtrace_stack[btsize] = {NULL};
-        backtrace(&backtrace_stack[0], btsize);
-    }
-    #endif
-    
-    getchar();
+    sm_inc_clock(1);
 }
 
 // 0x11
@@ -1285,10 +1275,9 @@ void _ip_LD_dHL_L() {
 
 // 0x76
 void _ip_HALT() {
-    // HALT!
-    sm_set_reg_stop(1);
+    // idle until an interrupt is pending, see sys_step
+    sm_set_reg_halt(TRUE);
     sm_inc_clock(1);
-    getchar();
 }
 
 // 0x77
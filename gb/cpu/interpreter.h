@@ -32,6 +32,7 @@
 #define FALSE 0
 
 #include <stdio.h>
+#include <inttypes.h>
 
 void ip_execute(uint8_t opcode);
 
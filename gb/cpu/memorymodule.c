@@ -4,47 +4,163 @@
 //
 
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 #include "memorymodule.h"
+#include "../state.h"
 
 ///////**** Private ****///////
 
-/* 
- *  Main memory pool
- */
-static uint8_t _sm_mem[0x0000FFFF] = {0};
+#define SM_PAGE_MASK (SM_PAGE_SIZE - 1)
 
 /*
- *  Z80 clocks
+ *  Page table of the address space. Pages point into flat memory (the
+ *  own pool, or a mapped snapshot given to sm_use_memory), or at shared
+ *  pages once the machine has been forked. A shared page is copied on
+ *  the first write to it, cow marks the pages that still need that.
+ *  The table belongs to the machine's context; shared pages are counted
+ *  atomically, since forks can be entered on any thread.
  */
-static uint16_t _sm_clock_m = 0;
-static uint16_t _sm_clock_t = 0;
+struct sm_page {
+    _Atomic uint32_t refs;      // a page may be held by forks on other threads
+    uint8_t  data[SM_PAGE_SIZE];
+};
+typedef struct sm_page sm_page;
+
+struct sm_space {
+    sm_page *page[SM_PAGES];
+};
 
 /*
- *  Z80 8-bit Registers
+ *  Undo log, see sm_journal_begin. Every page is flagged cow meanwhile,
+ *  so its first write lands in _sm_unshare, which keeps what the page
+ *  held; the stores themselves take no extra step.
  */
-static uint8_t  _sm_reg_a = 0, \
-                _sm_reg_b = 0, \
-                _sm_reg_c = 0, \
-                _sm_reg_d = 0, \
-                _sm_reg_e = 0, \
-                _sm_reg_h = 0, \
-                _sm_reg_l = 0, \
-                _sm_reg_f = 0;
+struct sm_journal {
+    uint8_t  cow[SM_PAGES];             // flags from before, for forks' pages
+    uint64_t dirty[SM_DIRTY_WORDS];     // the caller's dirty pages
+    uint8_t  data[SM_MEM_SIZE];         // each page as first written, at its own offset
+};
+typedef struct sm_journal sm_journal;
 
 /*
- *  Z80 16-bit Registers
+ *  One machine's CPU and address space. The calling thread runs the one
+ *  it was last bound to, so switching machines is a pointer store.
  */
+struct sm_context {
+    uint8_t *page[SM_PAGES];        // set up by sm_init
+    uint8_t *base;                  // flat memory under every page, NULL once forked
+    uint8_t  cow[SM_PAGES];
+    sm_page *shared[SM_PAGES];      // NULL on flat memory
+    sm_journal *journal;            // allocated on first use
+    uint8_t  journaling;            // between sm_journal_begin and rollback
+    uint32_t oam_writes;
 
-static uint16_t _sm_reg_pc = 0, \
-                _sm_reg_sp = 0;
+    // pages written since the last checkpoint, every store sets its bit
+    uint64_t dirty[SM_DIRTY_WORDS];
 
-/*
- *  Z80 Special Registers
- */
+    // devices behind I/O registers, indexed from SM_IO_BASE
+    sm_io_read  io_read [SM_IO_END - SM_IO_BASE];
+    sm_io_write io_write[SM_IO_END - SM_IO_BASE];
+
+    // Z80 clocks
+    uint16_t clock_m, clock_t;
+    uint64_t cycles;
+
+    // Z80 registers
+    uint8_t  reg_a, reg_b, reg_c, reg_d, reg_e, reg_h, reg_l, reg_f;
+    uint16_t reg_pc, reg_sp;
+    uint8_t  reg_halt, reg_stop, reg_intr;
+
+    uint8_t  own_mem[SM_MEM_SIZE];
+};
+
+static SM_THREAD sm_context *_sm = NULL;    // see sm_bind
+static _Atomic size_t _sm_live_pages = 0;
 
-static uint8_t  _sm_reg_halt = 0, \
-                _sm_reg_stop = 0,
-                _sm_reg_intr = 0;
+static inline void _sm_mark(uint16_t addr) {
+    _sm->dirty[addr >> (SM_PAGE_SHIFT + 6)] |= (uint64_t)1 << ((addr >> SM_PAGE_SHIFT) & 63);
+}
+
+static void _sm_mark_all() {
+    memset(_sm->dirty, 0xFF, sizeof(_sm->dirty));
+}
+
+static inline uint8_t *_sm_data(uint16_t addr) {
+    return &_sm->page[addr >> SM_PAGE_SHIFT][addr & SM_PAGE_MASK];
+}
+
+static inline void _sm_hold(sm_page *p) {
+    atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+}
+
+static void _sm_release(sm_page *p) {
+    if (p && atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) == 1) {
+        free(p);
+        _sm_live_pages--;
+    }
+}
+
+static sm_page *_sm_new_page(const uint8_t *data) {
+    sm_page *p = malloc(sizeof(sm_page));
+    if (!p) abort();
+    atomic_init(&p->refs, 1);
+    memcpy(p->data, data, SM_PAGE_SIZE);
+    _sm_live_pages++;
+    return p;
+}
+
+// First write to a shared or journaled page, takes a private copy unless
+// nobody else holds it
+static void _sm_unshare(unsigned int i) {
+    sm_page *p = _sm->shared[i];
+    if (_sm->journaling) memcpy(_sm->journal->data + i * SM_PAGE_SIZE, _sm->page[i], SM_PAGE_SIZE);
+    if (p && atomic_load_explicit(&p->refs, memory_order_acquire) > 1) {
+        _sm->shared[i] = _sm_new_page(p->data);
+        _sm->page[i] = _sm->shared[i]->data;
+        _sm_release(p);
+    }
+    _sm->cow[i] = 0;
+}
+
+static inline uint8_t *_sm_writable(uint16_t addr) {
+    if (_sm->cow[addr >> SM_PAGE_SHIFT]) _sm_unshare(addr >> SM_PAGE_SHIFT);
+    return _sm_data(addr);
+}
+
+// Points every page of c into flat memory, dropping shared ones
+static void _sm_flat(sm_context *c, uint8_t *mem) {
+    unsigned int i;
+    for (i = 0; i < SM_PAGES; i++) {
+        _sm_release(c->shared[i]);
+        c->shared[i] = NULL;
+        c->page[i] = mem + i * SM_PAGE_SIZE;
+        c->cow[i] = 0;
+    }
+    c->base = mem;
+}
+
+// Copies pages that live elsewhere into c's own memory, then runs c on it
+static void _sm_home(sm_context *c) {
+    uint8_t *mem = c->own_mem;
+    unsigned int i;
+    for (i = 0; i < SM_PAGES; i++) {
+        if (c->page[i] != mem + i * SM_PAGE_SIZE) memcpy(mem + i * SM_PAGE_SIZE, c->page[i], SM_PAGE_SIZE);
+    }
+    _sm_flat(c, mem);
+}
+
+// Moves flat pages onto shared ones, which a fork can then hold too
+static void _sm_share() {
+    unsigned int i;
+    if (!_sm->base) return;
+    for (i = 0; i < SM_PAGES; i++) {
+        _sm->shared[i] = _sm_new_page(_sm->page[i]);
+        _sm->page[i] = _sm->shared[i]->data;
+    }
+    _sm->base = NULL;
+}
 
 ///////**** Public ****///////
 
@@ -52,19 +168,70 @@ static uint8_t  _sm_reg_halt = 0, \
  *  Memory interfaces
  */
 uint8_t sm_getmemaddr8(uint16_t addr) {
-    return (uint8_t)_sm_mem[(uint16_t)addr];
+    if ((uint16_t)(addr - SM_IO_BASE) < SM_IO_END - SM_IO_BASE && _sm->io_read[addr - SM_IO_BASE]) {
+        return _sm->io_read[addr - SM_IO_BASE](addr);
+    }
+    return *_sm_data(addr);
 }
 
 uint16_t sm_getmemaddr16(uint16_t addr) {
-    return (uint16_t)_sm_mem[(uint16_t)addr];
+    return (uint16_t)*_sm_data(addr);
+}
+
+// A byte store, mark is constant so each caller gets its own copy
+static inline void _sm_store8(uint16_t addr, uint8_t data, int mark) {
+    if (addr < SM_ROM_END) return;  // MBC bank switches, no mapper to take them
+    if (mark) _sm_mark(addr);
+    if (addr >= SM_OAM_BASE && addr < SM_OAM_END) _sm->oam_writes++;
+    if ((uint16_t)(addr - SM_IO_BASE) < SM_IO_END - SM_IO_BASE && _sm->io_write[addr - SM_IO_BASE]) {
+        _sm->io_write[addr - SM_IO_BASE](addr, data);
+        return;
+    }
+    *_sm_writable(addr) = data;
 }
 
 void sm_setmemaddr8 (uint16_t addr, uint8_t  data) {
-    *(uint8_t*)(&_sm_mem[addr]) = data;
+    _sm_store8(addr, data, 1);
+}
+
+void sm_setmemaddr8_unmarked(uint16_t addr, uint8_t data) {
+    _sm_store8(addr, data, 0);
 }
 
 void sm_setmemaddr16(uint16_t addr, uint16_t data) {
-    *(uint16_t*)(&_sm_mem[addr]) = data;
+    // devices only take bytes, and a word across pages (or at IE, wrapping
+    // around to 0x0000) goes a byte at a time
+    if ((addr >= SM_IO_BASE - 1 && addr < SM_IO_END) || (addr & SM_PAGE_MASK) == SM_PAGE_MASK) {
+        sm_setmemaddr8(addr, data & 0xFF);
+        sm_setmemaddr8(addr + 1, data >> 8);
+        return;
+    }
+    // ROM; a word at 0x7FFF straddles pages and went bytewise above
+    if (addr < SM_ROM_END) return;
+    if (addr >= SM_OAM_BASE - 1 && addr < SM_OAM_END) _sm->oam_writes++;
+    _sm_mark(addr);
+    *(uint16_t*)_sm_writable(addr) = data;
+}
+
+uint32_t sm_oam_writes() {
+    return _sm->oam_writes;
+}
+
+const uint64_t *sm_dirty_pages() {
+    return _sm->dirty;
+}
+
+void sm_clear_dirty() {
+    memset(_sm->dirty, 0, sizeof(_sm->dirty));
+}
+
+void sm_map_io(uint16_t first, uint16_t last, sm_io_read rd, sm_io_write wr) {
+    uint16_t addr;
+    for (addr = first; addr <= last && addr < SM_IO_END; addr++) {
+        if (addr < SM_IO_BASE) continue;
+        _sm->io_read [addr - SM_IO_BASE] = rd;
+        _sm->io_write[addr - SM_IO_BASE] = wr;
+    }
 }
 
 /*
@@ -72,24 +239,254 @@ void sm_setmemaddr16(uint16_t addr, uint16_t data) {
  */
 // calc clock t automatically (in most cases)
 void sm_inc_clock(uint16_t val) {
-    _sm_clock_m += val;
-    _sm_clock_t += val * 4;
+    _sm->clock_m += val;
+    _sm->clock_t += val * 4;
+    _sm->cycles += val * 4;
 }
 
 void sm_inc_mclock(uint16_t val) {
-    _sm_clock_m += val;
+    _sm->clock_m += val;
 }
 
 uint16_t sm_get_mclock() {
-    return _sm_clock_m;
+    return _sm->clock_m;
 }
 
 void sm_inc_tclock(uint16_t val) {
-    _sm_clock_t += val;
+    _sm->clock_t += val;
+    _sm->cycles += val;
 }
 
 uint16_t sm_get_tclock() {
-    return _sm_clock_t;
+    return _sm->clock_t;
+}
+
+uint64_t sm_get_cycles() {
+    return _sm->cycles;
+}
+
+/*
+ *  snapshot interfaces
+ */
+void sm_save_cpu(uint8_t *out) {
+    st_put8(&out, _sm->reg_a);
+    st_put8(&out, _sm->reg_b);
+    st_put8(&out, _sm->reg_c);
+    st_put8(&out, _sm->reg_d);
+    st_put8(&out, _sm->reg_e);
+    st_put8(&out, _sm->reg_h);
+    st_put8(&out, _sm->reg_l);
+    st_put8(&out, _sm->reg_f);
+    st_put16(&out, _sm->reg_pc);
+    st_put16(&out, _sm->reg_sp);
+    st_put8(&out, _sm->reg_halt);
+    st_put8(&out, _sm->reg_stop);
+    st_put8(&out, _sm->reg_intr);
+}
+
+void sm_load_cpu(const uint8_t *in) {
+    _sm->reg_a = st_get8(&in);
+    _sm->reg_b = st_get8(&in);
+    _sm->reg_c = st_get8(&in);
+    _sm->reg_d = st_get8(&in);
+    _sm->reg_e = st_get8(&in);
+    _sm->reg_h = st_get8(&in);
+    _sm->reg_l = st_get8(&in);
+    _sm->reg_f = st_get8(&in);
+    _sm->reg_pc = st_get16(&in);
+    _sm->reg_sp = st_get16(&in);
+    _sm->reg_halt = st_get8(&in);
+    _sm->reg_stop = st_get8(&in);
+    _sm->reg_intr = st_get8(&in);
+}
+
+void sm_save_time(uint8_t *out) {
+    st_put16(&out, _sm->clock_m);
+    st_put16(&out, _sm->clock_t);
+    st_put64(&out, _sm->cycles);
+}
+
+void sm_load_time(const uint8_t *in) {
+    _sm->clock_m = st_get16(&in);
+    _sm->clock_t = st_get16(&in);
+    _sm->cycles = st_get64(&in);
+}
+
+void sm_init() {
+    memset(_sm->own_mem, 0, SM_MEM_SIZE);
+    _sm_flat(_sm, _sm->own_mem);
+    _sm_mark_all();
+}
+
+void sm_use_memory(uint8_t *mem) {
+    if (mem) _sm_flat(_sm, mem);
+    else _sm_home(_sm);
+    _sm->oam_writes++;
+    _sm_mark_all();
+}
+
+uint8_t *sm_memory() {
+    return _sm->base;
+}
+
+/*
+ *  Contexts. A copy gets the other's address space in its own memory,
+ *  whatever the other runs on, and nothing shared with it.
+ */
+sm_context *sm_context_new(const sm_context *from) {
+    sm_context *c = malloc(sizeof(sm_context));
+    unsigned int i;
+
+    if (!c) return NULL;
+    if (from) {
+        memcpy(c, from, sizeof(sm_context));
+        for (i = 0; i < SM_PAGES; i++) {
+            memcpy(c->own_mem + i * SM_PAGE_SIZE, from->page[i], SM_PAGE_SIZE);
+            c->shared[i] = NULL;
+        }
+        c->journal = NULL;
+        c->journaling = 0;
+    }
+    else {
+        memset(c, 0, sizeof(sm_context));
+    }
+    _sm_flat(c, c->own_mem);
+    return c;
+}
+
+void sm_context_free(sm_context *c) {
+    unsigned int i;
+    if (!c) return;
+    for (i = 0; i < SM_PAGES; i++) _sm_release(c->shared[i]);
+    free(c->journal);
+    free(c);
+}
+
+void sm_bind(sm_context *c) {
+    _sm = c;
+}
+
+uint8_t *sm_context_memory(sm_context *c) {
+    if (!c->base) _sm_home(c);
+    return c->base;
+}
+
+/*
+ *  Bytes from at up to len that sit contiguously behind the page table,
+ *  so flat memory copies in one piece; len may run to the end of the
+ *  address space
+ */
+static size_t _sm_span(size_t at, size_t len, uint8_t writing) {
+    const uint8_t *start = _sm_data(at);
+    size_t n = SM_PAGE_SIZE - (at & SM_PAGE_MASK);
+
+    while (n < len && _sm->page[(at + n) >> SM_PAGE_SHIFT] == start + n &&
+           !(writing && _sm->cow[(at + n) >> SM_PAGE_SHIFT])) {
+        n += SM_PAGE_SIZE;
+    }
+    return n < len ? n : len;
+}
+
+void sm_read_block(uint16_t addr, uint8_t *out, size_t len) {
+    size_t at = addr;
+    while (len) {
+        const size_t n = _sm_span(at, len, 0);
+        memcpy(out, _sm_data(at), n);
+        out += n;
+        at += n;
+        len -= n;
+    }
+}
+
+void sm_write_block(uint16_t addr, const uint8_t *in, size_t len) {
+    size_t at = addr, page;
+    if (addr < SM_OAM_END && addr + len > SM_OAM_BASE) _sm->oam_writes++;
+    while (len) {
+        uint8_t *dst = _sm_writable(at);
+        const size_t n = _sm_span(at, len, 1);
+        memcpy(dst, in, n);
+        for (page = at >> SM_PAGE_SHIFT; page <= (at + n - 1) >> SM_PAGE_SHIFT; page++) {
+            _sm_mark(page << SM_PAGE_SHIFT);
+        }
+        in += n;
+        at += n;
+        len -= n;
+    }
+}
+
+/*
+ *  Forks. The first one moves the machine from flat memory onto shared
+ *  pages (one copy of the address space); after that a fork only takes a
+ *  reference on every page, and whichever side writes a page first
+ *  copies it.
+ */
+sm_space *sm_space_fork() {
+    sm_space *s = malloc(sizeof(sm_space));
+    unsigned int i;
+    if (!s) return NULL;
+    _sm_share();
+    for (i = 0; i < SM_PAGES; i++) {
+        s->page[i] = _sm->shared[i];
+        _sm_hold(s->page[i]);
+        _sm->cow[i] = 1;
+    }
+    return s;
+}
+
+void sm_space_enter(const sm_space *s) {
+    unsigned int i;
+    for (i = 0; i < SM_PAGES; i++) {
+        _sm_hold(s->page[i]);
+        _sm_release(_sm->shared[i]);
+        _sm->shared[i] = s->page[i];
+        _sm->page[i] = s->page[i]->data;
+        _sm->cow[i] = 1;
+    }
+    _sm->base = NULL;
+    _sm->oam_writes++;
+    _sm_mark_all();
+}
+
+void sm_space_free(sm_space *s) {
+    unsigned int i;
+    if (!s) return;
+    for (i = 0; i < SM_PAGES; i++) _sm_release(s->page[i]);
+    free(s);
+}
+
+/*
+ *  Journal. Speculative runs (sys_run_ahead) write to a few pages a
+ *  frame; only those are kept and put back, whether the machine runs on
+ *  flat memory, a mapped snapshot or forked pages.
+ */
+int sm_journal_begin() {
+    unsigned int i;
+    if (!_sm->journal) _sm->journal = malloc(sizeof(sm_journal));
+    if (!_sm->journal) return -1;
+    memcpy(_sm->journal->cow, _sm->cow, sizeof(_sm->cow));
+    memcpy(_sm->journal->dirty, _sm->dirty, sizeof(_sm->dirty));
+    for (i = 0; i < SM_PAGES; i++) _sm->cow[i] = 1;
+    sm_clear_dirty();
+    _sm->journaling = 1;
+    return 0;
+}
+
+void sm_journal_rollback() {
+    const sm_journal *j = _sm->journal;
+    unsigned int i;
+    if (!_sm->journaling) return;
+    for (i = 0; i < SM_PAGES; i++) {
+        // written since sm_journal_begin, the page is private by now
+        if (!_sm->cow[i]) memcpy(_sm->page[i], j->data + i * SM_PAGE_SIZE, SM_PAGE_SIZE);
+        else _sm->cow[i] = j->cow[i];
+    }
+    memcpy(_sm->dirty, j->dirty, sizeof(_sm->dirty));
+    _sm->journaling = 0;
+    _sm->oam_writes++;
+}
+
+size_t sm_live_pages() {
+    return _sm_live_pages;
 }
 
 /*
@@ -98,27 +495,27 @@ uint16_t sm_get_tclock() {
 
 void sm_set_reg(sm_regs e, uint8_t data) {
     switch (e) {
-        case REG_A: _sm_reg_a = data; break;
-        case REG_B: _sm_reg_b = data; break;
-        case REG_C: _sm_reg_c = data; break;
-        case REG_D: _sm_reg_d = data; break;
-        case REG_E: _sm_reg_e = data; break;
-        case REG_H: _sm_reg_h = data; break;
-        case REG_L: _sm_reg_l = data; break;
-        case REG_F: _sm_reg_f = data; break;
+        case REG_A: _sm->reg_a = data; break;
+        case REG_B: _sm->reg_b = data; break;
+        case REG_C: _sm->reg_c = data; break;
+        case REG_D: _sm->reg_d = data; break;
+        case REG_E: _sm->reg_e = data; break;
+        case REG_H: _sm->reg_h = data; break;
+        case REG_L: _sm->reg_l = data; break;
+        case REG_F: _sm->reg_f = data; break;
     }
 }
 
 uint8_t sm_get_reg(sm_regs e) {
     switch (e) {
-        case REG_A: return _sm_reg_a;
-        case REG_B: return _sm_reg_b;
-        case REG_C: return _sm_reg_c;
-        case REG_D: return _sm_reg_d;
-        case REG_E: return _sm_reg_e;
-        case REG_H: return _sm_reg_h;
-        case REG_L: return _sm_reg_l;
-        case REG_F: return _sm_reg_f;
+        case REG_A: return _sm->reg_a;
+        case REG_B: return _sm->reg_b;
+        case REG_C: return _sm->reg_c;
+        case REG_D: return _sm->reg_d;
+        case REG_E: return _sm->reg_e;
+        case REG_H: return _sm->reg_h;
+        case REG_L: return _sm->reg_l;
+        case REG_F: return _sm->reg_f;
     }
 }
 
@@ -131,14 +528,18 @@ void sm_set_reg16(sm_regs e1, sm_regs e2, uint16_t val) {
     sm_set_reg(e2, val & 0xFF);
 }
 
-void sm_set_reg_pc(uint16_t data) { _sm_reg_pc = data; }
-void sm_inc_reg_pc(uint16_t inc ) { _sm_reg_pc += inc; }
-void sm_set_reg_sp(uint16_t data) { _sm_reg_sp = data; }
-void sm_inc_reg_sp(uint16_t inc ) { _sm_reg_sp += inc; }
+void sm_set_reg_pc(uint16_t data) { _sm->reg_pc = data; }
+void sm_inc_reg_pc(uint16_t inc ) { _sm->reg_pc += inc; }
+void sm_set_reg_sp(uint16_t data) { _sm->reg_sp = data; }
+void sm_inc_reg_sp(uint16_t inc ) { _sm->reg_sp += inc; }
+
+uint16_t sm_get_reg_pc() { return _sm->reg_pc; }
+uint16_t sm_get_reg_sp() { return _sm->reg_sp; }
 
-uint16_t sm_get_reg_pc() { return _sm_reg_pc; }
-uint16_t sm_get_reg_sp() { return _sm_reg_sp; }
+void sm_set_reg_halt(uint8_t b) { _sm->reg_halt = b; }
+void sm_set_reg_stop(uint8_t b) { _sm->reg_stop = b; }
+void sm_set_reg_intr(uint8_t b) { _sm->reg_intr = b; }
 
-void sm_set_reg_halt(uint8_t b) { _sm_reg_halt = b; }
-void sm_set_reg_stop(uint8_t b) { _sm_reg_stop = b; }
-void sm_set_reg_intr(uint8_t b) { _sm_reg_intr = b; }
+uint8_t sm_get_reg_halt() { return _sm->reg_halt; }
+uint8_t sm_get_reg_stop() { return _sm->reg_stop; }
+uint8_t sm_get_reg_intr() { return _sm->reg_intr; }
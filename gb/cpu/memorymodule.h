@@ -6,6 +6,9 @@
 #ifndef __CGBA__statemachine__
 #define __CGBA__statemachine__
 
+#include <inttypes.h>
+#include <stddef.h>
+
 //General Internal Memory
 //00000000-00003FFF   BIOS - System ROM         (16 KBytes)
 //00004000-01FFFFFF   Not used
@@ -31,16 +34,108 @@
 //Unused Memory Area
 //10000000-FFFFFFFF   Not used (upper 4bits of address bus unused)
 
+#define SM_MEM_SIZE 0x10000
+
+// Each thread points at the machine it runs, see sm_bind. Those few
+// pointers fit the static TLS reserve, even in a dlopen()ed library
+#if defined(__GNUC__)
+#define SM_THREAD _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define SM_THREAD _Thread_local
+#endif
+
+// Dirty pages, one bit per SM_PAGE_SIZE bytes of the address space
+#define SM_PAGE_SHIFT 8
+#define SM_PAGE_SIZE  (1 << SM_PAGE_SHIFT)
+#define SM_PAGES      (SM_MEM_SIZE >> SM_PAGE_SHIFT)
+#define SM_DIRTY_WORDS (SM_PAGES / 64)
+
+// Interrupt registers and request bits
+#define SM_ADDR_IF 0xFF0F
+#define SM_ADDR_IE 0xFFFF
+
+#define INT_VBLANK 0x01
+#define INT_STAT   0x02
+#define INT_TIMER  0x04
+#define INT_SERIAL 0x08
+#define INT_JOYPAD 0x10
+
+// Cartridge ROM, read only to the CPU; with no MBC yet, bank writes are dropped
+#define SM_ROM_END 0x8000
+
+// Sprite attribute table
+#define SM_OAM_BASE 0xFE00
+#define SM_OAM_END  0xFEA0
+
+// I/O registers, a device may claim a range with sm_map_io
+#define SM_IO_BASE 0xFF00
+#define SM_IO_END  0xFF80
+
+typedef uint8_t (*sm_io_read)(uint16_t addr);
+typedef void (*sm_io_write)(uint16_t addr, uint8_t data);
+
+/*
+ *  A machine's registers, clocks, I/O hooks and address space. The
+ *  calls below act on the context the calling thread was bound to last;
+ *  a thread needs one bound before any of them.
+ */
+typedef struct sm_context sm_context;
+sm_context *sm_context_new(const sm_context *from);    // a copy of from, or blank for sm_init
+void sm_context_free(sm_context *c);
+void sm_bind(sm_context *c);
+// c's address space (SM_MEM_SIZE bytes), pages shared with forks are copied home first
+uint8_t *sm_context_memory(sm_context *c);
+
+// Clears the address space onto the context's own memory, before any access
+void sm_init();
 uint8_t  sm_getmemaddr8 (uint16_t addr);
 uint16_t sm_getmemaddr16(uint16_t addr);
 void sm_setmemaddr8 (uint16_t addr, uint8_t  data);
 void sm_setmemaddr16(uint16_t addr, uint16_t data);
+// sm_setmemaddr8 without the dirty bit, only to time what the bit costs
+// (headless -b); the page is not saved incrementally
+void sm_setmemaddr8_unmarked(uint16_t addr, uint8_t data);
+// Counts writes to OAM, a change means cached sprite lists are stale
+uint32_t sm_oam_writes();
+// Pages written since sm_clear_dirty, bit (page & 63) of word (page >> 6)
+const uint64_t *sm_dirty_pages();
+void sm_clear_dirty();
+// Routes CPU accesses to [first, last] through rd/wr, NULL keeps plain memory
+void sm_map_io(uint16_t first, uint16_t last, sm_io_read rd, sm_io_write wr);
 
 void sm_inc_clock(uint16_t);
 void sm_inc_mclock(uint16_t val);
 uint16_t sm_get_mclock();
 void sm_inc_tclock(uint16_t val);
 uint16_t sm_get_tclock();
+// T-cycles since power on, never wraps
+uint64_t sm_get_cycles();
+
+// Snapshot payloads, see gb/state.h
+#define SM_CPU_STATE_SIZE  15
+#define SM_TIME_STATE_SIZE 12
+void sm_save_cpu(uint8_t *out);
+void sm_load_cpu(const uint8_t *in);
+void sm_save_time(uint8_t *out);
+void sm_load_time(const uint8_t *in);
+// Moves the address space to mem (SM_MEM_SIZE bytes, taken as is), NULL copies it back home
+void sm_use_memory(uint8_t *mem);
+// Flat memory the machine runs on, NULL while it runs on shared pages
+uint8_t *sm_memory();
+// Forks of the address space, pages are shared until written (copy on write)
+typedef struct sm_space sm_space;
+sm_space *sm_space_fork();
+void sm_space_enter(const sm_space *s);
+void sm_space_free(sm_space *s);
+size_t sm_live_pages();     // shared pages allocated, by every fork and the machine
+// Undo log of the address space: rollback puts back the pages written
+// since begin and the dirty pages as they were; -1 if it is not allocated
+int  sm_journal_begin();
+void sm_journal_rollback();
+// Raw copies that bypass device hooks and the ROM guard, for snapshots
+// (which only write from 0x8000 up) and the cartridge loader
+void sm_read_block(uint16_t addr, uint8_t *out, size_t len);
+void sm_write_block(uint16_t addr, const uint8_t *in, size_t len);
 
 enum sm_regs {
     REG_A,
@@ -67,5 +162,8 @@ uint16_t sm_get_reg_sp();
 void sm_set_reg_halt(uint8_t b);
 void sm_set_reg_stop(uint8_t b);
 void sm_set_reg_intr(uint8_t b);
+uint8_t sm_get_reg_halt();
+uint8_t sm_get_reg_stop();
+uint8_t sm_get_reg_intr();
 
 #endif /* defined(__CGBA__statemachine__) */
@@ -0,0 +1,765 @@
+//
+//  ppu.c
+//  CGBA
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ppu.h"
+#include "../cpu/memorymodule.h"
+#include "../state.h"
+
+///////**** Private ****///////
+
+#define PPU_OAM_BASE     0xFE00
+#define PPU_OAM_ENTRIES  40
+#define PPU_LINE_OBJS    10
+#define PPU_LINE_TILES   21     // 160px + fine scroll spans 21 tiles
+
+// LCDC bits
+#define LCDC_BG_ON    0x01
+#define LCDC_OBJ_ON   0x02
+#define LCDC_OBJ_TALL 0x04
+#define LCDC_BG_MAP   0x08
+#define LCDC_TILES_LO 0x10
+#define LCDC_WIN_ON   0x20
+#define LCDC_WIN_MAP  0x40
+#define LCDC_LCD_ON   0x80
+
+// OBJ attribute bits
+#define OBJ_PALETTE 0x10
+#define OBJ_XFLIP   0x20
+#define OBJ_YFLIP   0x40
+#define OBJ_BEHIND  0x80
+
+/*
+ *  DMG shades in BGR555, white to black
+ */
+static const uint16_t _ppu_shade[4] = { 0x7FFF, 0x56B5, 0x294A, 0x0000 };
+
+/*
+ *  Everything a visible line depends on. Gathered from memory once per
+ *  line; the line is rendered from this copy and keyed by its hash.
+ *  Unused fields stay zeroed so equal inputs always hash equal.
+ */
+struct _ppu_line_in {
+    uint8_t lcdc, bgp, obp0, obp1;
+    uint8_t fine_x;                         // SCX & 7
+    uint8_t win_on;
+    uint8_t win_x;                          // WX, window starts at WX-7
+    uint8_t obj_count;
+    uint8_t bg [2 * PPU_LINE_TILES];        // lo/hi plane byte per tile
+    uint8_t win[2 * PPU_LINE_TILES];
+    uint8_t obj[PPU_LINE_OBJS][4];          // x, attr, lo, hi by priority
+    uint8_t pad[4];
+};
+typedef struct _ppu_line_in _ppu_line_in;
+
+/*
+ *  Dot tier state for the line in mode 3. The background fetcher reads
+ *  a tile row over 6 dots and refills the FIFO once it runs empty; a
+ *  sprite at the output X stalls output while it is fetched and mixed
+ *  into the sprite FIFO. Registers are read when used, so writes made
+ *  during mode 3 land on the right pixel.
+ */
+struct _ppu_fifo {
+    uint8_t bg[8];                  // color indices, bg[bg_head] goes out next
+    uint8_t bg_head, bg_count;
+    uint8_t obj[8];                 // obj[0] goes out next, 0 is transparent
+    uint8_t fetch_dot;              // 0-5 reading, 6+ waiting to push
+    uint8_t fetch_x;                // tile column within the BG or window row
+    uint8_t tile, lo, hi;
+    uint8_t discard;                // SCX & 7, dropped from the first tile
+    uint8_t delay;                  // dummy first fetch
+    uint8_t x;                      // pixels output
+    uint8_t win;                    // fetching window tiles
+    uint8_t obj_next;               // next entry in the line's sprite list
+    uint8_t obj_wait;               // dots left on a sprite fetch
+};
+typedef struct _ppu_fifo _ppu_fifo;
+
+#define PPU_FIFO_FETCH_DOTS 6
+
+// sprite FIFO entry: color in bits 0-1, then palette and priority
+#define FIFO_OBJ_PAL    0x04
+#define FIFO_OBJ_BEHIND 0x08
+
+/*
+ *  One machine's PPU. The calling thread runs the one it was last bound
+ *  to, see ppu_bind.
+ */
+struct ppu_context {
+    uint16_t dot;
+    uint8_t  ly;
+    uint8_t  win_line;
+    uint8_t  line_drawn;
+    uint8_t  stat_line;
+    uint8_t  tier, tier_next;
+
+    // frames started while skip is set draw nothing, latched at line 0
+    uint8_t  skip, skipping;
+
+    /*
+     *  Frames go to the caller's buffer when one is set (e.g. a shared
+     *  memory slot). The target is latched at line 0; skipped lines are
+     *  copied over from the previous frame's buffer when the target moved.
+     */
+    uint16_t *fb;                   // all on own_fb from ppu_context_new
+    uint16_t *last;
+    uint16_t *next;
+    uint64_t line_key[PPU_HEIGHT];
+    uint8_t  line_valid[PPU_HEIGHT];
+
+    /*
+     *  Sprites on each line as OAM indices, at most 10, sorted by X then
+     *  OAM order. Built lazily and only rebuilt after OAM writes or an OBJ
+     *  size change; lines before obj_from are stale.
+     */
+    uint8_t  obj_line[PPU_HEIGHT][PPU_LINE_OBJS];
+    uint8_t  obj_count[PPU_HEIGHT];
+    uint32_t obj_gen;
+    uint8_t  obj_tall;
+    uint8_t  obj_from;
+
+    _ppu_fifo fifo_state;
+
+    ppu_stats stats;
+    uint8_t   profiling;
+
+    uint16_t own_fb[PPU_WIDTH * PPU_HEIGHT];
+};
+
+static SM_THREAD ppu_context *_ppu = NULL;
+
+static inline uint64_t _ppu_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint16_t _ppu_tile_row(uint8_t lcdc, uint8_t tile, uint8_t row) {
+    if (lcdc & LCDC_TILES_LO) {
+        return 0x8000 + tile * 16 + row * 2;
+    }
+    return 0x9000 + (int8_t)tile * 16 + row * 2;
+}
+
+// Buckets every sprite into the lines it covers, from line `from` down
+static void _ppu_build_objs(uint8_t from, uint8_t height) {
+    uint8_t i;
+    int ly;
+
+    memset(&_ppu->obj_count[from], 0, PPU_HEIGHT - from);
+    // OAM order, so the first 10 per line win as on hardware
+    for (i = 0; i < PPU_OAM_ENTRIES; i++) {
+        const int top = sm_getmemaddr8(PPU_OAM_BASE + i * 4) - 16;
+        const uint8_t x = sm_getmemaddr8(PPU_OAM_BASE + i * 4 + 1);
+        const int end = top + height > PPU_HEIGHT ? PPU_HEIGHT : top + height;
+        for (ly = top < from ? from : top; ly < end; ly++) {
+            uint8_t *line = _ppu->obj_line[ly];
+            uint8_t slot;
+            if (_ppu->obj_count[ly] == PPU_LINE_OBJS) continue;
+            // lower X wins, OAM order breaks ties
+            for (slot = _ppu->obj_count[ly];
+                 slot > 0 && sm_getmemaddr8(PPU_OAM_BASE + line[slot - 1] * 4 + 1) > x; slot--) {
+                line[slot] = line[slot - 1];
+            }
+            line[slot] = i;
+            _ppu->obj_count[ly]++;
+        }
+    }
+    _ppu->obj_from = from;
+}
+
+// Brings the sprite list of line ly up to date
+static void _ppu_sync_objs(uint8_t ly, uint8_t height) {
+    const uint32_t gen = sm_oam_writes();
+
+    // OAM changed: lines already drawn this frame don't need the new lists
+    if (gen != _ppu->obj_gen || height != _ppu->obj_tall) {
+        _ppu_build_objs(ly, height);
+        _ppu->obj_gen = gen;
+        _ppu->obj_tall = height;
+    }
+    else if (ly < _ppu->obj_from) {
+        _ppu_build_objs(0, height);
+    }
+}
+
+// Address of the tile row of sprite entry on line ly
+static uint16_t _ppu_obj_row(uint16_t entry, uint8_t ly, uint8_t height) {
+    uint8_t tile = sm_getmemaddr8(entry + 2);
+    uint8_t row = (uint8_t)(ly + 16 - sm_getmemaddr8(entry));
+
+    if (sm_getmemaddr8(entry + 3) & OBJ_YFLIP) row = height - 1 - row;
+    if (height == 16) tile &= 0xFE;
+    return 0x8000 + tile * 16 + (row & (height - 1)) * 2;
+}
+
+static void _ppu_gather_objs(uint8_t ly, uint8_t lcdc, _ppu_line_in *in) {
+    const uint8_t height = (lcdc & LCDC_OBJ_TALL) ? 16 : 8;
+    uint8_t i;
+
+    _ppu_sync_objs(ly, height);
+    for (i = 0; i < _ppu->obj_count[ly]; i++) {
+        const uint16_t entry = PPU_OAM_BASE + _ppu->obj_line[ly][i] * 4;
+        const uint16_t addr = _ppu_obj_row(entry, ly, height);
+
+        in->obj[i][0] = sm_getmemaddr8(entry + 1);
+        in->obj[i][1] = sm_getmemaddr8(entry + 3);
+        in->obj[i][2] = sm_getmemaddr8(addr);
+        in->obj[i][3] = sm_getmemaddr8(addr + 1);
+    }
+    in->obj_count = _ppu->obj_count[ly];
+}
+
+static void _ppu_gather(uint8_t ly, _ppu_line_in *in) {
+    const uint8_t lcdc = sm_getmemaddr8(PPU_REG_LCDC);
+    memset(in, 0, sizeof(*in));
+    in->lcdc = lcdc;
+    if (!(lcdc & LCDC_LCD_ON)) return;
+
+    in->bgp  = sm_getmemaddr8(PPU_REG_BGP);
+    in->obp0 = sm_getmemaddr8(PPU_REG_OBP0);
+    in->obp1 = sm_getmemaddr8(PPU_REG_OBP1);
+
+    if (lcdc & LCDC_BG_ON) {
+        const uint8_t scx = sm_getmemaddr8(PPU_REG_SCX);
+        const uint8_t y = sm_getmemaddr8(PPU_REG_SCY) + ly;
+        const uint16_t map = ((lcdc & LCDC_BG_MAP) ? 0x9C00 : 0x9800) + (y >> 3) * 32;
+        uint8_t i;
+        in->fine_x = scx & 7;
+        for (i = 0; i < PPU_LINE_TILES; i++) {
+            const uint8_t tile = sm_getmemaddr8(map + (((scx >> 3) + i) & 31));
+            const uint16_t addr = _ppu_tile_row(lcdc, tile, y & 7);
+            in->bg[2 * i]     = sm_getmemaddr8(addr);
+            in->bg[2 * i + 1] = sm_getmemaddr8(addr + 1);
+        }
+
+        const uint8_t wx = sm_getmemaddr8(PPU_REG_WX);
+        if ((lcdc & LCDC_WIN_ON) && sm_getmemaddr8(PPU_REG_WY) <= ly && wx <= 166) {
+            const uint16_t wmap = ((lcdc & LCDC_WIN_MAP) ? 0x9C00 : 0x9800) + (_ppu->win_line >> 3) * 32;
+            const uint8_t tiles = ((159 - (wx - 7)) >> 3) + 1;
+            in->win_on = 1;
+            in->win_x = wx;
+            for (i = 0; i < tiles; i++) {
+                const uint8_t tile = sm_getmemaddr8(wmap + i);
+                const uint16_t addr = _ppu_tile_row(lcdc, tile, _ppu->win_line & 7);
+                in->win[2 * i]     = sm_getmemaddr8(addr);
+                in->win[2 * i + 1] = sm_getmemaddr8(addr + 1);
+            }
+        }
+    }
+
+    if (lcdc & LCDC_OBJ_ON) {
+        _ppu_gather_objs(ly, lcdc, in);
+    }
+}
+
+// size is a multiple of 8
+static uint64_t _ppu_hash(const void *data, size_t size) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    uint64_t w;
+    size_t i;
+    for (i = 0; i < size; i += sizeof(w)) {
+        memcpy(&w, (const uint8_t *)data + i, sizeof(w));
+        h = (h ^ w) * 0x100000001B3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static inline uint8_t _ppu_pixel(uint8_t lo, uint8_t hi, uint8_t bit) {
+    return ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+}
+
+static void _ppu_render(uint8_t ly, const _ppu_line_in *in) {
+    uint16_t *dst = _ppu->fb + ly * PPU_WIDTH;
+    uint8_t bg[PPU_LINE_TILES * 8];
+    uint8_t idx[PPU_WIDTH] = {0};
+    uint8_t taken[PPU_WIDTH] = {0};     // by an object's opaque pixel
+    int x, i;
+
+    if (!(in->lcdc & LCDC_LCD_ON)) {
+        for (x = 0; x < PPU_WIDTH; x++) dst[x] = _ppu_shade[0];
+        return;
+    }
+
+    if (in->lcdc & LCDC_BG_ON) {
+        for (i = 0; i < PPU_LINE_TILES * 8; i++) {
+            bg[i] = _ppu_pixel(in->bg[2 * (i >> 3)], in->bg[2 * (i >> 3) + 1], 7 - (i & 7));
+        }
+        memcpy(idx, bg + in->fine_x, PPU_WIDTH);
+
+        if (in->win_on) {
+            const int wx0 = in->win_x - 7;
+            for (x = wx0 < 0 ? 0 : wx0; x < PPU_WIDTH; x++) {
+                const int col = x - wx0;
+                idx[x] = _ppu_pixel(in->win[2 * (col >> 3)], in->win[2 * (col >> 3) + 1], 7 - (col & 7));
+            }
+        }
+    }
+
+    for (x = 0; x < PPU_WIDTH; x++) {
+        dst[x] = _ppu_shade[(in->bgp >> (idx[x] * 2)) & 3];
+    }
+
+    // highest priority first: its first opaque pixel takes the x, and only
+    // that object's BG priority decides whether it shows over the BG
+    for (i = 0; i < in->obj_count; i++) {
+        const uint8_t *o = in->obj[i];
+        const uint8_t pal = (o[1] & OBJ_PALETTE) ? in->obp1 : in->obp0;
+        int b;
+        for (b = 0; b < 8; b++) {
+            const int sx = o[0] - 8 + b;
+            uint8_t c;
+            if (sx < 0 || sx >= PPU_WIDTH || taken[sx]) continue;
+            c = _ppu_pixel(o[2], o[3], (o[1] & OBJ_XFLIP) ? b : 7 - b);
+            if (!c) continue;
+            taken[sx] = 1;
+            if ((o[1] & OBJ_BEHIND) && idx[sx]) continue;
+            dst[sx] = _ppu_shade[(pal >> (c * 2)) & 3];
+        }
+    }
+}
+
+static void _ppu_draw_line(uint8_t ly) {
+    const uint64_t start = _ppu->profiling ? _ppu_now_ns() : 0;
+    _ppu_line_in in;
+    uint64_t key;
+
+    if (ly == 0) {
+        _ppu->last = _ppu->fb;
+        _ppu->fb = _ppu->next;
+    }
+
+    _ppu_gather(ly, &in);
+    if (in.win_on) _ppu->win_line++;
+
+    key = _ppu_hash(&in, sizeof(in));
+    if (_ppu->line_valid[ly] && _ppu->line_key[ly] == key) {
+        if (_ppu->fb != _ppu->last) {
+            memcpy(_ppu->fb + ly * PPU_WIDTH, _ppu->last + ly * PPU_WIDTH, PPU_WIDTH * sizeof(uint16_t));
+        }
+        _ppu->stats.lines_skipped++;
+    }
+    else {
+        _ppu_render(ly, &in);
+        _ppu->line_key[ly] = key;
+        _ppu->line_valid[ly] = 1;
+        _ppu->stats.lines_rendered++;
+    }
+
+    if (_ppu->profiling) {
+        _ppu->stats.render_ns += _ppu_now_ns() - start;
+    }
+}
+
+// Moves on to the next line once the current one's dots are spent
+static uint8_t _ppu_next_line(uint8_t lcd_on) {
+    uint8_t vblank = 0;
+
+    _ppu->dot -= PPU_LINE_CYCLES;
+    _ppu->line_drawn = 0;
+    _ppu->ly++;
+    if (_ppu->ly == PPU_HEIGHT) {
+        vblank = 1;
+        _ppu->stats.frames++;
+        if (lcd_on) {
+            sm_setmemaddr8(SM_ADDR_IF, sm_getmemaddr8(SM_ADDR_IF) | INT_VBLANK);
+        }
+    }
+    else if (_ppu->ly == PPU_LINES) {
+        _ppu->ly = 0;
+        _ppu->win_line = 0;
+        _ppu->skipping = _ppu->skip;
+        if (_ppu->skipping) _ppu->stats.frames_skipped++;
+    }
+    // tier changes apply from a line boundary
+    _ppu->tier = _ppu->tier_next;
+    return vblank;
+}
+
+/*
+ *  Dot tier
+ */
+static void _ppu_fifo_start(uint8_t ly) {
+    _ppu_fifo *f = &_ppu->fifo_state;
+    const uint8_t lcdc = sm_getmemaddr8(PPU_REG_LCDC);
+
+    if (ly == 0) {
+        _ppu->last = _ppu->fb;
+        _ppu->fb = _ppu->next;
+    }
+    memset(f, 0, sizeof(*f));
+    f->discard = sm_getmemaddr8(PPU_REG_SCX) & 7;
+    f->delay = PPU_FIFO_FETCH_DOTS;
+    _ppu_sync_objs(ly, (lcdc & LCDC_OBJ_TALL) ? 16 : 8);
+}
+
+// One fetcher dot: tile number, low plane, high plane, then push when empty
+static void _ppu_fifo_fetch(_ppu_fifo *f, uint8_t ly, uint8_t lcdc) {
+    const uint8_t row = f->win ? _ppu->win_line : sm_getmemaddr8(PPU_REG_SCY) + ly;
+    uint8_t i;
+
+    if (f->fetch_dot < PPU_FIFO_FETCH_DOTS) {
+        switch (f->fetch_dot++) {
+            case 1:
+                if (f->win) {
+                    f->tile = sm_getmemaddr8(((lcdc & LCDC_WIN_MAP) ? 0x9C00 : 0x9800) +
+                                           (row >> 3) * 32 + (f->fetch_x & 31));
+                }
+                else {
+                    const uint8_t scx = sm_getmemaddr8(PPU_REG_SCX);
+                    f->tile = sm_getmemaddr8(((lcdc & LCDC_BG_MAP) ? 0x9C00 : 0x9800) +
+                                           (row >> 3) * 32 + (((scx >> 3) + f->fetch_x) & 31));
+                }
+                break;
+            case 3:
+                f->lo = sm_getmemaddr8(_ppu_tile_row(lcdc, f->tile, row & 7));
+                break;
+            case 5:
+                f->hi = sm_getmemaddr8(_ppu_tile_row(lcdc, f->tile, row & 7) + 1);
+                break;
+        }
+        return;
+    }
+    if (f->bg_count) return;
+
+    for (i = 0; i < 8; i++) f->bg[i] = _ppu_pixel(f->lo, f->hi, 7 - i);
+    f->bg_head = 0;
+    f->bg_count = 8;
+    f->fetch_x++;
+    f->fetch_dot = 0;
+}
+
+// Mixes the next sprite into the sprite FIFO, pixels already there win
+static void _ppu_fifo_mix_obj(_ppu_fifo *f, uint8_t ly, uint8_t lcdc) {
+    const uint16_t entry = PPU_OAM_BASE + _ppu->obj_line[ly][f->obj_next++] * 4;
+    const uint16_t addr = _ppu_obj_row(entry, ly, (lcdc & LCDC_OBJ_TALL) ? 16 : 8);
+    const uint8_t lo = sm_getmemaddr8(addr), hi = sm_getmemaddr8(addr + 1);
+    const uint8_t attr = sm_getmemaddr8(entry + 3);
+    const int left = sm_getmemaddr8(entry + 1) - 8 - f->x;
+    int b;
+
+    for (b = 0; b < 8; b++) {
+        const int slot = left + b;
+        uint8_t c;
+        if (slot < 0 || slot >= 8 || f->obj[slot]) continue;
+        c = _ppu_pixel(lo, hi, (attr & OBJ_XFLIP) ? b : 7 - b);
+        if (!c) continue;
+        f->obj[slot] = c | ((attr & OBJ_PALETTE) ? FIFO_OBJ_PAL : 0) |
+                           ((attr & OBJ_BEHIND) ? FIFO_OBJ_BEHIND : 0);
+    }
+}
+
+// Runs one dot of mode 3, returns TRUE once the line's last pixel is out
+static uint8_t _ppu_fifo_dot(uint8_t ly) {
+    _ppu_fifo *f = &_ppu->fifo_state;
+    const uint8_t lcdc = sm_getmemaddr8(PPU_REG_LCDC);
+    const uint8_t wx = sm_getmemaddr8(PPU_REG_WX);
+    uint8_t bg, obj, pal, c;
+
+    if (f->delay) {
+        f->delay--;
+        return 0;
+    }
+    if (f->obj_wait) {
+        if (--f->obj_wait == 0) _ppu_fifo_mix_obj(f, ly, lcdc);
+        return 0;
+    }
+
+    // a sprite at this X holds output until the BG fetch in flight is pushed
+    if ((lcdc & LCDC_OBJ_ON) && f->obj_next < _ppu->obj_count[ly] &&
+        sm_getmemaddr8(PPU_OAM_BASE + _ppu->obj_line[ly][f->obj_next] * 4 + 1) <= f->x + 8) {
+        _ppu_fifo_fetch(f, ly, lcdc);
+        if (f->fetch_dot >= PPU_FIFO_FETCH_DOTS && f->bg_count) {
+            f->obj_wait = PPU_FIFO_FETCH_DOTS;
+        }
+        return 0;
+    }
+
+    // window start restarts the fetcher on the window's first tile
+    if (!f->win && (lcdc & LCDC_BG_ON) && (lcdc & LCDC_WIN_ON) && wx <= 166 &&
+        wx <= f->x + 7 && sm_getmemaddr8(PPU_REG_WY) <= ly) {
+        f->win = 1;
+        f->bg_count = 0;
+        f->fetch_x = 0;
+        f->fetch_dot = 0;
+        f->discard = f->x + 7 - wx;
+        return 0;
+    }
+
+    _ppu_fifo_fetch(f, ly, lcdc);
+    if (!f->bg_count) return 0;
+    bg = f->bg[f->bg_head];
+    f->bg_head = (f->bg_head + 1) & 7;
+    f->bg_count--;
+    if (f->discard) {
+        f->discard--;
+        return 0;
+    }
+
+    obj = f->obj[0];
+    memmove(f->obj, f->obj + 1, sizeof(f->obj) - 1);
+    f->obj[7] = 0;
+    if (!(lcdc & LCDC_BG_ON)) bg = 0;
+
+    if (obj && (lcdc & LCDC_OBJ_ON) && !((obj & FIFO_OBJ_BEHIND) && bg)) {
+        pal = sm_getmemaddr8((obj & FIFO_OBJ_PAL) ? PPU_REG_OBP1 : PPU_REG_OBP0);
+        c = obj & 3;
+    }
+    else {
+        pal = sm_getmemaddr8(PPU_REG_BGP);
+        c = bg;
+    }
+    _ppu->fb[ly * PPU_WIDTH + f->x] = _ppu_shade[(pal >> (c * 2)) & 3];
+    return ++f->x == PPU_WIDTH;
+}
+
+// Keys the finished line by its pixels, the fast tier must not skip it
+static void _ppu_fifo_finish(uint8_t ly) {
+    if (_ppu->fifo_state.win) _ppu->win_line++;
+    _ppu->line_key[ly] = _ppu_hash(_ppu->fb + ly * PPU_WIDTH, PPU_WIDTH * sizeof(uint16_t));
+    _ppu->line_valid[ly] = 0;
+    _ppu->stats.lines_rendered++;
+}
+
+// Runs the dot tier one dot at a time, returns TRUE when VBlank starts
+static uint8_t _ppu_step_dots(uint16_t cycles, uint8_t lcd_on) {
+    const uint64_t start = _ppu->profiling ? _ppu_now_ns() : 0;
+    uint8_t vblank = 0;
+
+    while (cycles--) {
+        if (_ppu->ly < PPU_HEIGHT && !_ppu->line_drawn && _ppu->dot >= PPU_MODE2_CYCLES) {
+            if (!lcd_on) {
+                _ppu_draw_line(_ppu->ly);
+                _ppu->line_drawn = 1;
+            }
+            else {
+                if (_ppu->dot == PPU_MODE2_CYCLES) _ppu_fifo_start(_ppu->ly);
+                if (_ppu_fifo_dot(_ppu->ly)) {
+                    _ppu_fifo_finish(_ppu->ly);
+                    _ppu->line_drawn = 1;
+                }
+            }
+        }
+        if (++_ppu->dot == PPU_LINE_CYCLES) vblank |= _ppu_next_line(lcd_on);
+    }
+
+    if (_ppu->profiling) {
+        _ppu->stats.render_ns += _ppu_now_ns() - start;
+    }
+    return vblank;
+}
+
+static void _ppu_update_stat() {
+    const uint8_t stat = sm_getmemaddr8(PPU_REG_STAT);
+    const uint8_t lyc = sm_getmemaddr8(PPU_REG_LYC) == _ppu->ly;
+    uint8_t mode, line;
+
+    // mode 3 lasts until the line is out, a fixed length in the fast tier
+    if (_ppu->ly >= PPU_HEIGHT) mode = 1;
+    else if (_ppu->dot < PPU_MODE2_CYCLES) mode = 2;
+    else if (!_ppu->line_drawn) mode = 3;
+    else mode = 0;
+
+    sm_setmemaddr8(PPU_REG_STAT, (stat & 0x78) | 0x80 | (lyc << 2) | mode);
+
+    // STAT interrupt fires on the rising edge of any enabled source
+    line = ((stat & 0x08) && mode == 0) ||
+           ((stat & 0x10) && mode == 1) ||
+           ((stat & 0x20) && mode == 2) ||
+           ((stat & 0x40) && lyc);
+    if (line && !_ppu->stat_line) {
+        sm_setmemaddr8(SM_ADDR_IF, sm_getmemaddr8(SM_ADDR_IF) | INT_STAT);
+    }
+    _ppu->stat_line = line;
+}
+
+///////**** Public ****///////
+
+ppu_context *ppu_context_new(const ppu_context *from) {
+    ppu_context *c = malloc(sizeof(ppu_context));
+
+    if (!c) return NULL;
+    if (from) {
+        memcpy(c, from, sizeof(ppu_context));
+        memcpy(c->own_fb, from->fb, sizeof(c->own_fb));
+        memset(c->line_valid, 0, sizeof(c->line_valid));
+    }
+    else {
+        memset(c, 0, sizeof(ppu_context));
+    }
+    c->fb = c->last = c->next = c->own_fb;
+    return c;
+}
+
+void ppu_context_free(ppu_context *c) {
+    free(c);
+}
+
+void ppu_bind(ppu_context *c) {
+    _ppu = c;
+}
+
+void ppu_reset() {
+    memset(_ppu->next, 0xFF, PPU_WIDTH * PPU_HEIGHT * sizeof(uint16_t));
+    _ppu->fb = _ppu->last = _ppu->next;
+    _ppu->dot = 0;
+    _ppu->ly = 0;
+    _ppu->win_line = 0;
+    _ppu->line_drawn = 0;
+    _ppu->stat_line = 0;
+    _ppu->obj_from = PPU_HEIGHT;
+    _ppu->tier = _ppu->tier_next;
+    _ppu->skipping = _ppu->skip;
+    ppu_invalidate();
+    sm_setmemaddr8(PPU_REG_LY, 0);
+}
+
+uint8_t ppu_step(uint16_t cycles) {
+    const uint8_t lcd_on = sm_getmemaddr8(PPU_REG_LCDC) & LCDC_LCD_ON;
+    uint8_t vblank = 0;
+
+    if (_ppu->tier == PPU_TIER_DOT) {
+        vblank = _ppu_step_dots(cycles, lcd_on);
+    }
+    else {
+        _ppu->dot += cycles;
+        for (;;) {
+            if (_ppu->ly < PPU_HEIGHT && !_ppu->line_drawn &&
+                _ppu->dot >= PPU_MODE2_CYCLES + PPU_MODE3_CYCLES) {
+                if (!_ppu->skipping) _ppu_draw_line(_ppu->ly);
+                _ppu->line_drawn = 1;
+            }
+            if (_ppu->dot < PPU_LINE_CYCLES) break;
+            vblank |= _ppu_next_line(lcd_on);
+        }
+    }
+
+    // LY reads 0 while the LCD is off, frames still pace the system
+    sm_setmemaddr8(PPU_REG_LY, lcd_on ? _ppu->ly : 0);
+    if (lcd_on) _ppu_update_stat();
+    return vblank;
+}
+
+const uint16_t *ppu_get_framebuffer() {
+    return _ppu->fb;
+}
+
+// Renders following frames into fb (PPU_WIDTH * PPU_HEIGHT), NULL for the PPU's own
+void ppu_set_framebuffer(uint16_t *fb) {
+    _ppu->next = fb ? fb : _ppu->own_fb;
+}
+
+// A machine moved onto this thread, possibly mid-frame
+void ppu_target(uint16_t *fb) {
+    uint16_t *to = fb ? fb : _ppu->own_fb;
+    if (!fb || to != _ppu->fb) ppu_invalidate();
+    _ppu->fb = _ppu->last = _ppu->next = to;
+    _ppu->skip = _ppu->skipping = !fb;
+}
+
+// Takes effect at the next line boundary (or reset)
+void ppu_set_tier(uint8_t tier) {
+    _ppu->tier_next = tier;
+}
+
+uint8_t ppu_get_tier() {
+    return _ppu->tier_next;
+}
+
+/*
+ *  Frames starting while skip is set keep timing, STAT and interrupts but
+ *  draw nothing; the framebuffer and line keys keep the last drawn frame.
+ *  The dot tier ignores it, its mode 3 length is visible to games.
+ */
+void ppu_set_skip(uint8_t skip) {
+    _ppu->skip = skip;
+}
+
+const uint64_t *ppu_get_line_keys() {
+    return _ppu->line_key;
+}
+
+void ppu_invalidate() {
+    memset(_ppu->line_valid, 0, sizeof(_ppu->line_valid));
+}
+
+void ppu_save(uint8_t *out) {
+    const _ppu_fifo *f = &_ppu->fifo_state;
+
+    st_put16(&out, _ppu->dot);
+    st_put8(&out, _ppu->ly);
+    st_put8(&out, _ppu->win_line);
+    st_put8(&out, _ppu->line_drawn);
+    st_put8(&out, _ppu->stat_line);
+    memcpy(out, f->bg, 8);
+    out += 8;
+    st_put8(&out, f->bg_head);
+    st_put8(&out, f->bg_count);
+    memcpy(out, f->obj, 8);
+    out += 8;
+    st_put8(&out, f->fetch_dot);
+    st_put8(&out, f->fetch_x);
+    st_put8(&out, f->tile);
+    st_put8(&out, f->lo);
+    st_put8(&out, f->hi);
+    st_put8(&out, f->discard);
+    st_put8(&out, f->delay);
+    st_put8(&out, f->x);
+    st_put8(&out, f->win);
+    st_put8(&out, f->obj_next);
+    st_put8(&out, f->obj_wait);
+}
+
+// Sprite lists rebuild for the loaded memory; line keys are kept, see below
+void ppu_load(const uint8_t *in) {
+    _ppu_fifo *f = &_ppu->fifo_state;
+
+    _ppu->dot = st_get16(&in);
+    _ppu->ly = st_get8(&in);
+    _ppu->win_line = st_get8(&in);
+    _ppu->line_drawn = st_get8(&in);
+    _ppu->stat_line = st_get8(&in);
+    memcpy(f->bg, in, 8);
+    in += 8;
+    f->bg_head = st_get8(&in);
+    f->bg_count = st_get8(&in);
+    memcpy(f->obj, in, 8);
+    in += 8;
+    f->fetch_dot = st_get8(&in);
+    f->fetch_x = st_get8(&in);
+    f->tile = st_get8(&in);
+    f->lo = st_get8(&in);
+    f->hi = st_get8(&in);
+    f->discard = st_get8(&in);
+    f->delay = st_get8(&in);
+    f->x = st_get8(&in);
+    f->win = st_get8(&in);
+    f->obj_next = st_get8(&in);
+    f->obj_wait = st_get8(&in);
+
+    _ppu->obj_from = PPU_HEIGHT;
+    _ppu->obj_tall = 0;
+    if (_ppu->ly < PPU_HEIGHT && _ppu->dot >= PPU_MODE2_CYCLES && !_ppu->line_drawn) {
+        // a dot tier line in flight walks the current sprite list
+        _ppu_sync_objs(_ppu->ly, (sm_getmemaddr8(PPU_REG_LCDC) & LCDC_OBJ_TALL) ? 16 : 8);
+    }
+    // line keys describe what the framebuffer holds, so they stay valid
+    // and run-ahead keeps skipping unchanged lines across its loads
+}
+
+void ppu_set_profiling(uint8_t on) {
+    _ppu->profiling = on;
+}
+
+void ppu_get_stats(ppu_stats *out) {
+    *out = _ppu->stats;
+}
+
+void ppu_reset_stats() {
+    memset(&_ppu->stats, 0, sizeof(_ppu->stats));
+}
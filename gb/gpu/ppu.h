@@ -0,0 +1,94 @@
+//
+//  ppu.h
+//  CGBA
+//
+
+/*
+ * DMG picture processing unit
+ * - scanline renderer, each visible line is drawn when it enters HBlank
+ * - output is a 160x144 BGR555 framebuffer (same format as the GBA screen)
+ * - every line gathers the bytes it depends on (LCDC, scroll, palettes,
+ *   tile rows, sprites on the line) and keys them with a 64-bit hash;
+ *   a line whose key matches the previous frame is not redrawn
+ * - two accuracy tiers behind the same calls: the fast tier above, and a
+ *   dot tier running the pixel FIFO and fetcher every dot, so register
+ *   writes made during mode 3 take effect mid-line and mode 3 stretches
+ *   with scrolling, the window and sprites. The fast tier only pays a
+ *   branch per ppu_step for the dot tier's existence.
+ */
+
+#ifndef __CGBA__ppu__
+#define __CGBA__ppu__
+
+#include <inttypes.h>
+
+#define PPU_WIDTH  160
+#define PPU_HEIGHT 144
+#define PPU_LINES  154
+
+// timing in T-cycles (dots)
+#define PPU_MODE2_CYCLES 80
+#define PPU_MODE3_CYCLES 172
+#define PPU_LINE_CYCLES  456
+#define PPU_FRAME_CYCLES (PPU_LINE_CYCLES * PPU_LINES)
+
+// LCD registers
+#define PPU_REG_LCDC 0xFF40
+#define PPU_REG_STAT 0xFF41
+#define PPU_REG_SCY  0xFF42
+#define PPU_REG_SCX  0xFF43
+#define PPU_REG_LY   0xFF44
+#define PPU_REG_LYC  0xFF45
+#define PPU_REG_BGP  0xFF47
+#define PPU_REG_OBP0 0xFF48
+#define PPU_REG_OBP1 0xFF49
+#define PPU_REG_WY   0xFF4A
+#define PPU_REG_WX   0xFF4B
+
+// Accuracy tiers
+#define PPU_TIER_FAST 0     // whole lines at HBlank, unchanged lines skipped
+#define PPU_TIER_DOT  1     // pixel FIFO stepped per dot
+
+struct ppu_stats {
+    uint64_t frames;
+    uint64_t lines_rendered;
+    uint64_t lines_skipped;    // key matched the previous frame
+    uint64_t frames_skipped;   // not drawn at all, see ppu_set_skip
+    uint64_t render_ns;        // line work, only counted while profiling
+};
+typedef struct ppu_stats ppu_stats;
+
+/*
+ *  A machine's PPU: its timing, line keys, sprite lists and host settings.
+ *  The calls below act on the context the calling thread was bound to last.
+ */
+typedef struct ppu_context ppu_context;
+ppu_context *ppu_context_new(const ppu_context *from);  // a copy of from drawing into its own buffer, or blank for ppu_reset
+void ppu_context_free(ppu_context *c);
+void ppu_bind(ppu_context *c);
+
+void ppu_reset();
+uint8_t ppu_step(uint16_t cycles);   // returns TRUE when VBlank starts
+
+void ppu_set_tier(uint8_t tier);
+uint8_t ppu_get_tier();
+void ppu_set_skip(uint8_t skip);
+
+const uint16_t *ppu_get_framebuffer();
+void ppu_set_framebuffer(uint16_t *fb);
+// Draws into fb from now on, the current frame included, NULL draws nothing;
+// the buffer drawn into last keeps its line keys, sparing what it already shows
+void ppu_target(uint16_t *fb);
+const uint64_t *ppu_get_line_keys();
+void ppu_invalidate();
+
+// Snapshot payload, see gb/state.h; the framebuffer and host settings are not part of it
+#define PPU_STATE_SIZE 35
+void ppu_save(uint8_t *out);
+void ppu_load(const uint8_t *in);
+
+void ppu_set_profiling(uint8_t on);
+void ppu_get_stats(ppu_stats *out);
+void ppu_reset_stats();
+
+#endif /* defined(__CGBA__ppu__) */
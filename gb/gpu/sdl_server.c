@@ -7,8 +7,22 @@
 //
 
 #include "sdl_server.h"
+#include "ppu.h"
+#include "../system.h"
+#include "../cpu/memorymodule.h"
+#include "../apu/apu.h"
+#include "../input/joypad.h"
+#include "../../host/triplebuffer.h"
+#include "../../host/pacer.h"
+#include "../../host/overlay.h"
+#include "../../host/scaler.h"
+#include "../../host/frameskip.h"
+#include "../../host/audioring.h"
+#include "../../host/ratecontrol.h"
+#include "../../host/rewind.h"
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
-#include <SDL2_ttf/SDL_ttf.h>
 
 // GBA screen ratio 3:2
 #define VP_WIDTH 536
@@ -18,69 +32,333 @@
 #define false 0
 typedef unsigned int bool;
 
-#define GBA_V_WIDTH   240
-#define GBA_V_HEIGHT  160
-#define GBA_V_FWIDTH  240.f
-#define GBA_V_FHEIGHT 160.f
-
 #define GBA_C_WHITE 0x7FFF
 
-// GBA 15-bit color scheme
-// BBBBBGGGGGRRRRR
-#define COLOR_MAP 255.f/31.f
-
-// GBA pixel array 240x160
-void gb_plot_pixel(SDL_Renderer *renderer, Uint32 x, Uint32 y, Uint16 color) {
-    const Uint8 red =   ((color >> 0 ) & 0b11111)* COLOR_MAP;
-    const Uint8 green = ((color >> 5 ) & 0b11111)* COLOR_MAP;
-    const Uint8 blue =  ((color >> 10) & 0b11111)* COLOR_MAP;
-    const float w_ratio = ((float)VP_WIDTH / GBA_V_FWIDTH);
-    const float h_ratio = ((float)VP_HEIGHT / GBA_V_FHEIGHT);
-    const Uint32 adjx = h_ratio*x;
-    const Uint32 adjy = w_ratio*y;
-    SDL_Rect r = {adjx,adjy,h_ratio,h_ratio};
-    SDL_SetRenderDrawColor(renderer, red, green, blue, 255);
-    SDL_RenderFillRect(renderer, &r);
-}
+// frames between frame-time percentile updates
+#define GB_REPORT_FRAMES 30
+
+#define GB_OVERLAY_PT 12
+
+// host audio, the ring holds about 170 ms and is kept near 32 ms
+#define GB_AUDIO_HZ      48000
+#define GB_AUDIO_FRAMES  512
+#define GB_AUDIO_RING    8192
+#define GB_AUDIO_LATENCY 1536
+
+// vsync paces emulation when the display is this close to the DMG's rate
+#define GB_VSYNC_TOLERANCE 0.01
+#define GB_VSYNC_TIMEOUT_MS 100
+
+// rewind history, CGBA_REWIND=seconds[:MiB] overrides, 0 seconds turns it off
+#define GB_REWIND_SECONDS 60
+#define GB_REWIND_MIB     32
+
+// CGBA_RUNAHEAD=N shows the frame N ahead, hiding that much of a game's input lag
+#define GB_RUNAHEAD_MAX 4
 
 void gb_screen_boilerplate(SDL_Renderer *renderer) {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
     SDL_RenderClear(renderer);
 }
 
-void gb_fps_render(SDL_Renderer *renderer, Uint32 proctimestart, SDL_Surface *m_surface, TTF_Font *sans) {
-    SDL_Color white = {255,255,255,255};
-    const Uint32 proctime = SDL_GetTicks() - proctimestart;
-    float delay = 16.666 - proctime;
-    if (delay < 0) {
-        delay = 0;
-    }
-    SDL_Delay(delay);
-    float fps = 1000/delay;
-    char displaystring[50];
-    snprintf(displaystring, 50, "%f FPS", fps);
-    m_surface = TTF_RenderText_Solid(sans, displaystring, white);
-    SDL_Texture *m = SDL_CreateTextureFromSurface(renderer, m_surface);
-    SDL_Rect m_r = {0,0,100,20};
-    SDL_RenderCopy(renderer, m, NULL, &m_r);
-    SDL_FreeSurface(m_surface);
-    SDL_DestroyTexture(m);
+/*
+ *  Emulation costs, per-frame averages over the report window
+ */
+struct gb_perf {
+    pacer_report timing;
+    float cpu_ms;
+    float ppu_ms;
+    unsigned int every;     // fast-forward shows one frame in this many, 0 when off
+    bool  vsync;            // paced by presentation rather than the timer
+    float ratio;            // audio resampling adjustment
+    unsigned int fill;      // audio ring, in frames
+    bool  rewinding;
+    float history_s;        // rewind history held, in seconds
+    unsigned int ahead;     // run-ahead frames, 0 when off
+};
+typedef struct gb_perf gb_perf;
+
+/*
+ *  One published frame. Lines carry their PPU keys so both the copy into
+ *  a slot and the texture upload only touch lines that changed.
+ */
+struct gb_frame {
+    uint16_t pixels[PPU_WIDTH * PPU_HEIGHT];
+    uint64_t keys[PPU_HEIGHT];
+    bool     valid[PPU_HEIGHT];
+    gb_perf  perf;
+};
+typedef struct gb_frame gb_frame;
+
+/*
+ *  State shared by the SDL thread and the emulation thread
+ */
+struct gb_emu {
+    triplebuffer frames;
+    audioring audio;
+    ratecontrol rate;       // emulation thread only
+    rewinder history;       // emulation thread only, no capacity when off
+    SDL_sem *presented;     // one post per present while vsync paces
+    atomic_int vsync;
+    atomic_int done;
+    atomic_int fast;        // fast-forward while set
+    atomic_int rewind;      // step back through the history while set
+    atomic_int keys;        // joypad keys held, JP_ bits
+    unsigned int ahead;
+    sys_machine *machine;   // loaded here, run by the emulation thread
+    uint8_t  tier;          // PPU tier
+    uint32_t audio_hz;      // 0 without a device
+};
+typedef struct gb_emu gb_emu;
+
+// Audio thread, never waits: an empty ring plays silence
+void gb_audio_callback(void *data, Uint8 *stream, int len) {
+    gb_emu *emu = data;
+    const size_t frames = len / (2 * sizeof(int16_t));
+    const size_t got = ar_read(&emu->audio, (int16_t *)stream, frames);
+    memset(stream + got * 2 * sizeof(int16_t), 0, (frames - got) * 2 * sizeof(int16_t));
+}
+
+/*
+ *  Brings the APU up to now and moves its samples into the ring, dropping
+ *  what does not fit. Fast-forward only tops the ring up to the target so
+ *  normal speed resumes at low latency.
+ */
+void gb_audio_push(gb_emu *emu, bool fast) {
+    int16_t buf[GB_AUDIO_FRAMES * 2];
+    size_t n;
+    apu_run_to(sm_get_cycles());
+    while ((n = apu_read(buf, GB_AUDIO_FRAMES)) > 0) {
+        if (fast) {
+            const size_t fill = ar_fill(&emu->audio);
+            n = fill < GB_AUDIO_LATENCY ? (GB_AUDIO_LATENCY - fill < n ? GB_AUDIO_LATENCY - fill : n) : 0;
+        }
+        ar_write(&emu->audio, buf, n);
+    }
+}
+
+// Arrows, Z (A), X (B), Return (Start) and right Shift (Select)
+uint8_t gb_key_button(SDL_Keycode sym) {
+    switch (sym) {
+        case SDLK_RIGHT:  return JP_RIGHT;
+        case SDLK_LEFT:   return JP_LEFT;
+        case SDLK_UP:     return JP_UP;
+        case SDLK_DOWN:   return JP_DOWN;
+        case SDLK_z:      return JP_A;
+        case SDLK_x:      return JP_B;
+        case SDLK_RSHIFT: return JP_SELECT;
+        case SDLK_RETURN: return JP_START;
+    }
+    return 0;
+}
+
+// Rewound frames are silent, their samples are thrown away
+void gb_audio_drop() {
+    int16_t buf[GB_AUDIO_FRAMES * 2];
+    apu_run_to(sm_get_cycles());
+    while (apu_read(buf, GB_AUDIO_FRAMES) > 0);
+}
+
+/*
+ *  Screen texture at the scaler's output size. It is drawn 1:1 in the
+ *  middle of the viewport, so the renderer never resamples pixels.
+ */
+struct gb_view {
+    scaler scale;
+    int fit;
+    SDL_Texture *screen;
+    SDL_Rect rect;
+    uint16_t scaled[PPU_WIDTH * PPU_HEIGHT * SC_MAX_FACTOR * SC_MAX_FACTOR];
+    uint64_t keys[PPU_HEIGHT];
+    bool valid[PPU_HEIGHT];
+};
+typedef struct gb_view gb_view;
+
+// Copies the lines that differ from what the slot already holds
+void gb_publish_frame(triplebuffer *frames, const gb_perf *perf) {
+    gb_frame *slot = tb_back(frames);
+    const uint16_t *fb = ppu_get_framebuffer();
+    const uint64_t *cur = ppu_get_line_keys();
+    int y;
+    for (y = 0; y < PPU_HEIGHT; y++) {
+        if (slot->valid[y] && slot->keys[y] == cur[y]) continue;
+        memcpy(&slot->pixels[y * PPU_WIDTH], &fb[y * PPU_WIDTH], PPU_WIDTH * sizeof(uint16_t));
+        slot->keys[y] = cur[y];
+        slot->valid[y] = true;
+    }
+    slot->perf = *perf;
+    tb_publish(frames);
+}
+
+// (Re)creates the screen texture for the view's scaler, everything uploads again
+int gb_view_apply(gb_view *view, SDL_Renderer *renderer) {
+    const int w = PPU_WIDTH * view->scale.factor, h = PPU_HEIGHT * view->scale.factor;
+    int y;
+    if (view->screen) SDL_DestroyTexture(view->screen);
+    view->screen = SDL_CreateTexture(renderer,
+                                     SDL_PIXELFORMAT_BGR555,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     w,
+                                     h);
+    view->rect.x = (VP_WIDTH - w) / 2;
+    view->rect.y = (VP_HEIGHT - h) / 2;
+    view->rect.w = w;
+    view->rect.h = h;
+    for (y = 0; y < PPU_HEIGHT; y++) view->valid[y] = false;
+    return view->screen ? 0 : -1;
+}
+
+// Scales and copies lines whose key changed since their last upload, in contiguous runs
+void gb_upload_frame(gb_view *view, const gb_frame *frame) {
+    const int f = view->scale.factor, halo = sc_halo(&view->scale), pitch = PPU_WIDTH * f;
+    int y = 0;
+    while (y < PPU_HEIGHT) {
+        int end = y, y0, y1;
+        if (!frame->valid[y] || (view->valid[y] && view->keys[y] == frame->keys[y])) {
+            y++;
+            continue;
+        }
+        while (end < PPU_HEIGHT && frame->valid[end] &&
+               !(view->valid[end] && view->keys[end] == frame->keys[end])) {
+            view->keys[end] = frame->keys[end];
+            view->valid[end] = true;
+            end++;
+        }
+        // edge-aware scalers also change the neighbouring lines
+        y0 = y - halo < 0 ? 0 : y - halo;
+        y1 = end + halo > PPU_HEIGHT ? PPU_HEIGHT : end + halo;
+        sc_run(&view->scale, frame->pixels, PPU_WIDTH, PPU_HEIGHT, view->scaled, y0, y1);
+        SDL_Rect r = {0, y0 * f, pitch, (y1 - y0) * f};
+        SDL_UpdateTexture(view->screen, &r, &view->scaled[y0 * f * pitch], pitch * sizeof(Uint16));
+        y = end;
+    }
+}
+
+void gb_fps_render(SDL_Renderer *renderer, const overlay *ov, const gb_frame *frame,
+                   const gb_view *view, float upload_ms) {
+    const pacer_report *t = &frame->perf.timing;
+    char displaystring[256], ff[32] = "";
+    if (frame->perf.rewinding) snprintf(ff, sizeof(ff), "\nrewind %.1f s", frame->perf.history_s);
+    else if (frame->perf.every) snprintf(ff, sizeof(ff), "\nfast-forward 1/%u", frame->perf.every);
+    else if (frame->perf.ahead) snprintf(ff, sizeof(ff), "\nrun-ahead %u", frame->perf.ahead);
+    snprintf(displaystring, sizeof(displaystring),
+             "%.2f FPS %.0f%%\nframe %.2f p99 %.2f ms\ncpu %.2f ppu %.2f upload %.2f ms\n%s %s\n"
+             "%s audio x%.4f %.1f ms%s",
+             t->fps, t->fps * 100 / PACER_DMG_HZ, t->p50_ms, t->p99_ms,
+             frame->perf.cpu_ms, frame->perf.ppu_ms, upload_ms,
+             sc_name(&view->scale), sc_isa(),
+             frame->perf.vsync ? "vsync" : "timer", frame->perf.ratio,
+             frame->perf.fill * 1000.0 / GB_AUDIO_HZ, ff);
+    ov_text(ov, renderer, 4, 4, displaystring);
+}
+
+/*
+ *  Emulation runs here, never waiting on the renderer's work. It is paced
+ *  by the timer or, when the display runs close enough to 59.73 Hz, by
+ *  presentation: one frame per vsync, with the audio ratio taking up the
+ *  difference. Either way the audio ring's fill steers the resampling
+ *  ratio, so the device clock never drifts away from emulation.
+ *  Fast-forward drops the frame cap and only draws and publishes the
+ *  frames the frame skipper picks, about one per refresh. Every frame
+ *  run forward is recorded in the rewind history; while rewinding, each
+ *  frame instead steps the history back one and runs from there silently
+ *  to show it. With run-ahead, the machine's own frame is only heard and
+ *  the one shown is drawn that many frames ahead and then undone.
+ */
+int gb_emu_thread(void *data) {
+    gb_emu *emu = data;
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    pacer pace;
+    frameskip skip;
+    bool fast = false;
+    gb_perf perf = {{0}};
+    ppu_stats ppu;
+    Uint64 emu_ticks = 0;
+    uint64_t render_ns = 0;
+    unsigned int frame = 0;
+    
+    // the machine lives on the thread running it
+    sys_machine_enter(emu->machine, NULL);
+    ppu_set_tier(emu->tier);
+    if (emu->audio_hz) apu_set_rate(emu->audio_hz);
+    ppu_set_profiling(true);
+    ppu_get_stats(&ppu);
+    render_ns = ppu.render_ns;
+    pacer_init(&pace, PACER_DMG_HZ);
+    while (!atomic_load(&emu->done)) {
+        const Uint64 start = SDL_GetPerformanceCounter();
+        bool show, rewinding;
+        unsigned int ahead;
+        
+        perf.vsync = atomic_load(&emu->vsync);
+        if (atomic_load(&emu->fast) != (int)fast) {
+            fast = !fast;
+            fs_init(&skip, PACER_DMG_HZ);
+            if (!fast) pacer_resync(&pace);
+        }
+        rewinding = emu->history.capacity && atomic_load(&emu->rewind) &&
+                    rw_step_back(&emu->history) == 0;
+        show = rewinding || !fast || fs_show_next(&skip);
+        ahead = rewinding || fast ? 0 : emu->ahead;
+        jp_set_keys(atomic_load(&emu->keys));
+        
+        /* Emulate up to VBlank */
+        ppu_set_skip(!show || ahead);
+        sys_run_frame();
+        if (rewinding) gb_audio_drop();
+        else gb_audio_push(emu, fast);
+        perf.fill = (unsigned int)ar_fill(&emu->audio);
+        perf.ratio = fast || rewinding ? emu->rate.base : rc_update(&emu->rate, perf.fill);
+        apu_set_ratio(perf.ratio);
+        if (emu->history.capacity && !rewinding) rw_record(&emu->history);
+        if (ahead) sys_run_ahead(ahead);
+        perf.ahead = ahead;
+        perf.rewinding = rewinding;
+        perf.history_s = emu->history.count / PACER_DMG_HZ;
+        
+        const Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        emu_ticks += ticks;
+        if (show) {
+            perf.every = fast ? skip.every : 0;
+            gb_publish_frame(&emu->frames, &perf);
+        }
+        
+        if (fast) {
+            fs_frame_done(&skip, ticks * ms);
+            pacer_mark(&pace);
+        }
+        else if (perf.vsync) {
+            SDL_SemWaitTimeout(emu->presented, GB_VSYNC_TIMEOUT_MS);
+            pacer_mark(&pace);
+        }
+        else {
+            pacer_wait(&pace);
+        }
+        if (++frame % GB_REPORT_FRAMES == 0) {
+            ppu_get_stats(&ppu);
+            pacer_report_get(&pace, &perf.timing);
+            // presents that do not block mean the driver ignores vsync
+            if (perf.vsync && !fast && perf.timing.fps > PACER_DMG_HZ * (1 + 4 * GB_VSYNC_TOLERANCE)) {
+                printf("Presentation is not throttled, pacing on the timer\n");
+                atomic_store(&emu->vsync, false);
+                rc_init(&emu->rate, GB_AUDIO_LATENCY, 1);
+                pacer_resync(&pace);
+            }
+            perf.ppu_ms = (ppu.render_ns - render_ns) / 1e6 / GB_REPORT_FRAMES;
+            perf.cpu_ms = emu_ticks * ms / GB_REPORT_FRAMES - perf.ppu_ms;
+            render_ns = ppu.render_ns;
+            emu_ticks = 0;
+        }
+    }
+    return 0;
 }
 
 void gb_srv_initialize() {
     // Init var decl
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
-    TTF_Init();
-    TTF_Font *sans = TTF_OpenFont("/Library/Fonts/Osaka.ttf", 24);
-    if (!sans) {
-        printf("TTF_OpenFont: %s\n", TTF_GetError());
-        return;
-    }
-    SDL_Surface *fps_surface;
-    
     // Init vars
-    SDL_Init(SDL_INIT_VIDEO);
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
     window = SDL_CreateWindow(
                               "GBA",
                               SDL_WINDOWPOS_UNDEFINED,
@@ -92,28 +370,141 @@ void gb_srv_initialize() {
     
     printf("%i, %i", VP_HEIGHT, VP_WIDTH);
     
-    renderer = SDL_CreateRenderer(window, 0, 0);
+    // presents block on vsync, never on emulation
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
     
     if (window == NULL) {
         printf("SDL Renderer not created");
         return;
     }
     
-    // main loop
-    bool done = false;
+    overlay ov;
+    ov_init(&ov, renderer, GB_OVERLAY_PT);
+    
+    // integer scaling in software, largest that fits unless CGBA_SCALER says otherwise
+    gb_view *view = calloc(1, sizeof(gb_view));
+    if (view == NULL) {
+        printf("Screen buffer not allocated");
+        return;
+    }
+    const char *scaler_env = getenv("CGBA_SCALER");
+    view->fit = sc_fit(PPU_WIDTH, PPU_HEIGHT, VP_WIDTH, VP_HEIGHT);
+    view->scale.kind = SC_NEAREST;
+    view->scale.factor = view->fit;
+    if (scaler_env && sc_parse(&view->scale, scaler_env) == 0 && view->scale.factor > view->fit) {
+        view->scale.kind = SC_NEAREST;
+        view->scale.factor = view->fit;
+    }
+    if (gb_view_apply(view, renderer)) {
+        printf("Screen texture not created");
+        return;
+    }
+    
+    gb_emu emu;
+    if (tb_init(&emu.frames, sizeof(gb_frame))) {
+        printf("Frame buffers not allocated");
+        return;
+    }
+    emu.machine = sys_machine_copy();
+    if (!emu.machine) {
+        printf("Machine not allocated");
+        tb_free(&emu.frames);
+        return;
+    }
+    
+    // CGBA_PPU=dot picks the dot-accurate PPU
+    const char *ppu_env = getenv("CGBA_PPU");
+    emu.tier = ppu_env && !strcmp(ppu_env, "dot") ? PPU_TIER_DOT : PPU_TIER_FAST;
+    atomic_init(&emu.done, false);
+    atomic_init(&emu.fast, false);
+    atomic_init(&emu.rewind, false);
+    atomic_init(&emu.keys, 0);
+    const char *ahead_env = getenv("CGBA_RUNAHEAD");
+    emu.ahead = ahead_env ? (unsigned int)strtoul(ahead_env, NULL, 10) : 0;
+    if (emu.ahead > GB_RUNAHEAD_MAX) emu.ahead = GB_RUNAHEAD_MAX;
+    
+    // holding Backspace rewinds, a bounded history of recent frames
+    const char *rewind_env = getenv("CGBA_REWIND");
+    unsigned int rewind_s = GB_REWIND_SECONDS, rewind_mib = GB_REWIND_MIB;
+    if (rewind_env) sscanf(rewind_env, "%u:%u", &rewind_s, &rewind_mib);
+    memset(&emu.history, 0, sizeof(emu.history));
+    if (rewind_s && rewind_mib &&
+        rw_init(&emu.history, (unsigned int)(rewind_s * PACER_DMG_HZ), (size_t)rewind_mib << 20, RW_KEYFRAME)) {
+        printf("Rewind turned off\n");
+    }
+    
+    // CGBA_SYNC=timer keeps timer pacing on a ~60 Hz display
+    const char *sync_env = getenv("CGBA_SYNC");
+    SDL_DisplayMode mode;
+    double base = 1;
+    atomic_init(&emu.vsync, false);
+    emu.presented = SDL_CreateSemaphore(0);
+    if (emu.presented && !(sync_env && !strcmp(sync_env, "timer")) &&
+        SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate) {
+        const double off = mode.refresh_rate / PACER_DMG_HZ - 1;
+        if (off < GB_VSYNC_TOLERANCE && off > -GB_VSYNC_TOLERANCE) {
+            atomic_store(&emu.vsync, true);
+            base = PACER_DMG_HZ / mode.refresh_rate;
+        }
+    }
+    rc_init(&emu.rate, GB_AUDIO_LATENCY, base);
+    
+    // sound is optional, the APU stays silent without a device
+    SDL_AudioSpec want = {0}, have;
+    SDL_AudioDeviceID audio = 0;
+    emu.audio_hz = 0;
+    if (ar_init(&emu.audio, GB_AUDIO_RING) == 0) {
+        want.freq = GB_AUDIO_HZ;
+        want.format = AUDIO_S16SYS;
+        want.channels = 2;
+        want.samples = GB_AUDIO_FRAMES;
+        want.callback = gb_audio_callback;
+        want.userdata = &emu;
+        audio = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    }
+    if (audio) {
+        // start at the target fill, an empty ring would underrun at once
+        static const int16_t silence[GB_AUDIO_LATENCY * 2];
+        ar_write(&emu.audio, silence, GB_AUDIO_LATENCY);
+        emu.audio_hz = have.freq;
+        SDL_PauseAudioDevice(audio, 0);
+    }
+    else {
+        printf("No audio device: %s\n", SDL_GetError());
+    }
+    SDL_Thread *emu_thread = SDL_CreateThread(gb_emu_thread, "emulation", &emu);
+    
+    // main loop, presents the newest frame and handles input
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    float upload_ms = 0;
+    bool done = false, rescaled = false;
     while (!done) {
-        const Uint32 proctimestart = SDL_GetTicks();
+        const gb_frame *frame = tb_front(&emu.frames);
+        
+        /* Pick up the newest frame */
+        if (tb_acquire(&emu.frames) || rescaled) {
+            const Uint64 start = SDL_GetPerformanceCounter();
+            frame = tb_front(&emu.frames);
+            gb_upload_frame(view, frame);
+            rescaled = false;
+            upload_ms += ((SDL_GetPerformanceCounter() - start) * ms - upload_ms) / GB_REPORT_FRAMES;
+        }
+        else {
+            // without vsync, do not spin while waiting on emulation
+            SDL_Delay(1);
+        }
         
         /* Render VBlank */
         gb_screen_boilerplate(renderer);
         
         /* Render space */
-        
+        SDL_RenderCopy(renderer, view->screen, NULL, &view->rect);
         
         /* FPS overlay */
-        gb_fps_render(renderer, proctimestart, fps_surface, sans);
+        gb_fps_render(renderer, &ov, frame, view, upload_ms);
         
         SDL_RenderPresent(renderer);
+        if (atomic_load(&emu.vsync) && SDL_SemValue(emu.presented) < 2) SDL_SemPost(emu.presented);
         
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
@@ -121,15 +512,54 @@ void gb_srv_initialize() {
                 case SDL_QUIT:
                     done = true;
                     break;
+                case SDL_KEYDOWN:
+                    // Tab cycles the scalers, holding Space fast-forwards, holding Backspace rewinds
+                    if (event.key.keysym.sym == SDLK_TAB) {
+                        sc_next(&view->scale, view->fit);
+                        if (gb_view_apply(view, renderer)) done = true;
+                        rescaled = true;
+                    }
+                    else if (event.key.keysym.sym == SDLK_SPACE) {
+                        atomic_store(&emu.fast, true);
+                    }
+                    else if (event.key.keysym.sym == SDLK_BACKSPACE) {
+                        atomic_store(&emu.rewind, true);
+                    }
+                    else {
+                        atomic_fetch_or(&emu.keys, gb_key_button(event.key.keysym.sym));
+                    }
+                    break;
+                case SDL_KEYUP:
+                    if (event.key.keysym.sym == SDLK_SPACE) {
+                        atomic_store(&emu.fast, false);
+                    }
+                    else if (event.key.keysym.sym == SDLK_BACKSPACE) {
+                        atomic_store(&emu.rewind, false);
+                    }
+                    else {
+                        atomic_fetch_and(&emu.keys, ~gb_key_button(event.key.keysym.sym));
+                    }
+                    break;
                 default:
                     break;
             }
         }
     }
     
-    free(sans);
+    atomic_store(&emu.done, true);
+    SDL_WaitThread(emu_thread, NULL);
+    if (audio) SDL_CloseAudioDevice(audio);
+    sys_machine_free(emu.machine);
+    ar_free(&emu.audio);
+    rw_free(&emu.history);
+    if (emu.presented) SDL_DestroySemaphore(emu.presented);
+    tb_free(&emu.frames);
+    
+    ov_free(&ov);
+    SDL_DestroyTexture(view->screen);
+    free(view);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     
     SDL_Quit();
-}
\ No newline at end of file
+}
@@ -6,11 +6,11 @@
 //  Copyright (c) 2017 AAR. All rights reserved.
 //
 
-#ifndef __CGBA__sdl_server__
-#define __CGBA__sdl_server__
+#ifndef __CGBA__gb_sdl_server__
+#define __CGBA__gb_sdl_server__
 
 #include <stdio.h>
 
 void gb_srv_initialize();
 
-#endif /* defined(__CGBA__sdl_server__) */
+#endif /* defined(__CGBA__gb_sdl_server__) */
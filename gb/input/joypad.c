@@ -0,0 +1,74 @@
+//
+//  joypad.c
+//  CGBA
+//
+
+#include <stdlib.h>
+#include "joypad.h"
+#include "../cpu/memorymodule.h"
+
+///////**** Private ****///////
+
+#define JP_SELECT_DIRS 0x10
+#define JP_SELECT_KEYS 0x20
+
+// One machine's joypad, see jp_bind
+struct jp_context {
+    uint8_t keys;
+};
+
+static SM_THREAD jp_context *_jp = NULL;
+
+static uint8_t _jp_select() {
+    uint8_t p1;
+    sm_read_block(JP_REG_P1, &p1, 1);
+    return p1 & (JP_SELECT_DIRS | JP_SELECT_KEYS);
+}
+
+// Keys on the selected rows, pressed high
+static uint8_t _jp_rows(uint8_t keys, uint8_t select) {
+    uint8_t rows = 0;
+    if (!(select & JP_SELECT_DIRS)) rows |= keys & 0x0F;
+    if (!(select & JP_SELECT_KEYS)) rows |= keys >> 4;
+    return rows;
+}
+
+static uint8_t _jp_read(uint16_t addr) {
+    const uint8_t select = _jp_select();
+    (void)addr;
+    return 0xC0 | select | (~_jp_rows(_jp->keys, select) & 0x0F);
+}
+
+///////**** Public ****///////
+
+jp_context *jp_context_new(const jp_context *from) {
+    jp_context *c = malloc(sizeof(jp_context));
+    if (!c) return NULL;
+    c->keys = from ? from->keys : 0;
+    return c;
+}
+
+void jp_context_free(jp_context *c) {
+    free(c);
+}
+
+void jp_bind(jp_context *c) {
+    _jp = c;
+}
+
+void jp_reset() {
+    _jp->keys = 0;
+    sm_setmemaddr8(JP_REG_P1, 0xCF);
+    sm_map_io(JP_REG_P1, JP_REG_P1, _jp_read, NULL);
+}
+
+void jp_set_keys(uint8_t keys) {
+    const uint8_t select = _jp_select();
+    const uint8_t down = _jp_rows(keys, select) & ~_jp_rows(_jp->keys, select);
+    _jp->keys = keys;
+    if (down) sm_setmemaddr8(SM_ADDR_IF, sm_getmemaddr8(SM_ADDR_IF) | INT_JOYPAD);
+}
+
+uint8_t jp_get_keys() {
+    return _jp->keys;
+}
@@ -0,0 +1,43 @@
+//
+//  joypad.h
+//  CGBA
+//
+
+/*
+ * DMG joypad, register P1 (0xFF00)
+ * - a game writes bits 4 (directions) and 5 (buttons) low to select a
+ *   row, reads then return that row's keys in bits 0-3, pressed low
+ * - the select bits live in plain memory, so snapshots carry them; only
+ *   reads are claimed through sm_map_io
+ * - the host sets the held keys between frames, a key going down on a
+ *   selected row requests the joypad interrupt
+ */
+
+#ifndef __CGBA__joypad__
+#define __CGBA__joypad__
+
+#include <inttypes.h>
+
+#define JP_REG_P1 0xFF00
+
+// Keys, as the host passes them
+#define JP_RIGHT  0x01
+#define JP_LEFT   0x02
+#define JP_UP     0x04
+#define JP_DOWN   0x08
+#define JP_A      0x10
+#define JP_B      0x20
+#define JP_SELECT 0x40
+#define JP_START  0x80
+
+// A machine's held keys, the calls below act on the one bound last
+typedef struct jp_context jp_context;
+jp_context *jp_context_new(const jp_context *from);    // a copy of from, or no keys held
+void jp_context_free(jp_context *c);
+void jp_bind(jp_context *c);
+
+void jp_reset();
+void jp_set_keys(uint8_t keys);
+uint8_t jp_get_keys();
+
+#endif /* defined(__CGBA__joypad__) */
@@ -0,0 +1,316 @@
+//
+//  state.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "state.h"
+#include "cpu/memorymodule.h"
+#include "gpu/ppu.h"
+#include "apu/apu.h"
+
+///////**** Private ****///////
+
+#define ST_MAGIC          0x53424743    // "CGBS"
+#define ST_HEADER_SIZE    8             // magic, version, section count
+#define ST_SECTION_HEADER 10            // tag, version, payload length
+
+// Saved address ranges, ROM is identified in CART rather than stored
+#define ST_VRAM      0x8000
+#define ST_VRAM_SIZE 0x2000
+#define ST_HIGH      0xC000             // WRAM up to IE, with OAM and I/O
+#define ST_HIGH_SIZE 0x4000
+#define ST_CART_RAM  0xA000
+#define ST_CART_RAM_SIZE 0x2000
+#define ST_CART_ID   0x0134             // title through the global checksum
+#define ST_CART_ID_SIZE  0x1C
+
+#define ST_MEM_SIZE  (ST_VRAM_SIZE + ST_HIGH_SIZE)
+#define ST_CART_SIZE (ST_CART_ID_SIZE + ST_CART_RAM_SIZE)
+
+// Dirty pages from VRAM up, a bitmap followed by the set pages in order
+#define ST_PAGE_FIRST (ST_VRAM >> SM_PAGE_SHIFT)
+#define ST_PAGE_COUNT (SM_PAGES - ST_PAGE_FIRST)
+#define ST_PAGE_MAP   (ST_PAGE_COUNT / 8)
+#define ST_PAGES_SIZE (ST_PAGE_MAP + ST_PAGE_COUNT * SM_PAGE_SIZE)
+
+struct st_fork {
+    sm_space *space;
+    size_t    size;
+    uint8_t   state[];      // snapshot with ST_NO_MEMORY
+};
+
+// Where a section's data lives
+#define ST_DEVICE 0
+#define ST_MEMORY 1     // the address space, see ST_NO_MEMORY
+#define ST_PAGES  2     // dirty pages of it, see ST_INCREMENTAL
+
+static inline int _st_page_dirty(const uint64_t *dirty, unsigned page) {
+    return (dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+static inline int _st_page_bits(const uint8_t *map, unsigned page) {
+    return (map[page >> 3] >> (page & 7)) & 1;
+}
+
+static uint32_t _st_pages_length() {
+    const uint64_t *dirty = sm_dirty_pages();
+    uint32_t length = ST_PAGE_MAP;
+    unsigned i;
+    for (i = 0; i < ST_PAGE_COUNT; i++) {
+        if (_st_page_dirty(dirty, ST_PAGE_FIRST + i)) length += SM_PAGE_SIZE;
+    }
+    return length;
+}
+
+static void _st_save_pages(uint8_t *out) {
+    const uint64_t *dirty = sm_dirty_pages();
+    uint8_t *page = out + ST_PAGE_MAP;
+    unsigned i;
+
+    memset(out, 0, ST_PAGE_MAP);
+    for (i = 0; i < ST_PAGE_COUNT; i++) {
+        if (!_st_page_dirty(dirty, ST_PAGE_FIRST + i)) continue;
+        out[i >> 3] |= 1 << (i & 7);
+        sm_read_block((ST_PAGE_FIRST + i) << SM_PAGE_SHIFT, page, SM_PAGE_SIZE);
+        page += SM_PAGE_SIZE;
+    }
+}
+
+static void _st_load_pages(const uint8_t *in) {
+    const uint8_t *page = in + ST_PAGE_MAP;
+    unsigned i;
+    for (i = 0; i < ST_PAGE_COUNT; i++) {
+        if (!_st_page_bits(in, i)) continue;
+        sm_write_block((ST_PAGE_FIRST + i) << SM_PAGE_SHIFT, page, SM_PAGE_SIZE);
+        page += SM_PAGE_SIZE;
+    }
+}
+
+// The bitmap has to account for the whole payload
+static int _st_check_pages(const uint8_t *in, uint32_t length) {
+    uint32_t expect = ST_PAGE_MAP;
+    unsigned i;
+    if (length < ST_PAGE_MAP) {
+        fprintf(stderr, "Snapshot page section is too short\n");
+        return -1;
+    }
+    for (i = 0; i < ST_PAGE_COUNT; i++) {
+        if (_st_page_bits(in, i)) expect += SM_PAGE_SIZE;
+    }
+    if (length != expect) {
+        fprintf(stderr, "Snapshot pages do not match their map\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void _st_save_mem(uint8_t *out) {
+    sm_read_block(ST_VRAM, out, ST_VRAM_SIZE);
+    sm_read_block(ST_HIGH, out + ST_VRAM_SIZE, ST_HIGH_SIZE);
+}
+
+static void _st_load_mem(const uint8_t *in) {
+    sm_write_block(ST_VRAM, in, ST_VRAM_SIZE);
+    sm_write_block(ST_HIGH, in + ST_VRAM_SIZE, ST_HIGH_SIZE);
+}
+
+static void _st_save_cart(uint8_t *out) {
+    sm_read_block(ST_CART_ID, out, ST_CART_ID_SIZE);
+    sm_read_block(ST_CART_RAM, out + ST_CART_ID_SIZE, ST_CART_RAM_SIZE);
+}
+
+static void _st_load_cart(const uint8_t *in) {
+    sm_write_block(ST_CART_RAM, in + ST_CART_ID_SIZE, ST_CART_RAM_SIZE);
+}
+
+// A snapshot only loads over the cartridge it was taken from
+static int _st_check_cart(const uint8_t *in, uint32_t length) {
+    uint8_t id[ST_CART_ID_SIZE];
+    if (length < ST_CART_ID_SIZE) {
+        fprintf(stderr, "Snapshot cartridge section is too short\n");
+        return -1;
+    }
+    sm_read_block(ST_CART_ID, id, ST_CART_ID_SIZE);
+    if (memcmp(id, in, ST_CART_ID_SIZE)) {
+        fprintf(stderr, "Snapshot is for another cartridge\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Sections in load order: memory before the devices reading it
+ */
+struct _st_section {
+    char     tag[4];
+    uint16_t version;
+    uint32_t size;          // payload size, the most when it varies
+    uint8_t  memory;        // ST_DEVICE, ST_MEMORY or ST_PAGES
+    void (*save)(uint8_t *out);
+    void (*load)(const uint8_t *in);
+    int  (*check)(const uint8_t *in, uint32_t length);
+    uint32_t (*length)();   // payload size of a varying section
+};
+typedef struct _st_section _st_section;
+
+static const _st_section _st_sections[] = {
+    { {'C','P','U',' '}, 1, SM_CPU_STATE_SIZE,  ST_DEVICE, sm_save_cpu,    sm_load_cpu,    NULL,            NULL },
+    { {'T','I','M','E'}, 1, SM_TIME_STATE_SIZE, ST_DEVICE, sm_save_time,   sm_load_time,   NULL,            NULL },
+    { {'C','A','R','T'}, 1, ST_CART_SIZE,       ST_MEMORY, _st_save_cart,  _st_load_cart,  _st_check_cart,  NULL },
+    { {'M','E','M',' '}, 1, ST_MEM_SIZE,        ST_MEMORY, _st_save_mem,   _st_load_mem,   NULL,            NULL },
+    { {'P','A','G','E'}, 1, ST_PAGES_SIZE,      ST_PAGES,  _st_save_pages, _st_load_pages, _st_check_pages, _st_pages_length },
+    { {'P','P','U',' '}, 1, PPU_STATE_SIZE,     ST_DEVICE, ppu_save,       ppu_load,       NULL,            NULL },
+    { {'A','P','U',' '}, 1, APU_STATE_SIZE,     ST_DEVICE, apu_save,       apu_load,       NULL,            NULL },
+};
+
+#define ST_SECTIONS (sizeof(_st_sections) / sizeof(_st_sections[0]))
+
+static inline int _st_wanted(const _st_section *s, unsigned flags) {
+    switch (s->memory) {
+        case ST_MEMORY: return !(flags & (ST_NO_MEMORY | ST_INCREMENTAL));
+        case ST_PAGES:  return (flags & ST_INCREMENTAL) && !(flags & ST_NO_MEMORY);
+    }
+    return 1;
+}
+
+/*
+ *  Unknown sections are skipped; a known section must have a version and
+ *  size this build reads, and every wanted section must be present
+ */
+static int _st_parse(const uint8_t *buf, size_t size, unsigned flags, const uint8_t **found) {
+    const uint8_t *p = buf, *end = buf + size;
+    uint16_t version, count, n;
+    size_t i;
+
+    for (i = 0; i < ST_SECTIONS; i++) found[i] = NULL;
+    if (size < ST_HEADER_SIZE || st_get32(&p) != ST_MAGIC) {
+        fprintf(stderr, "Not a snapshot\n");
+        return -1;
+    }
+    version = st_get16(&p);
+    count = st_get16(&p);
+    if (version > ST_VERSION) {
+        fprintf(stderr, "Snapshot version %u is newer than %u\n", version, ST_VERSION);
+        return -1;
+    }
+
+    for (n = 0; n < count; n++) {
+        const uint8_t *tag = p;
+        uint16_t section_version;
+        uint32_t length;
+
+        if (end - p < ST_SECTION_HEADER) break;
+        p += 4;
+        section_version = st_get16(&p);
+        length = st_get32(&p);
+        if ((size_t)(end - p) < length) break;
+        for (i = 0; i < ST_SECTIONS; i++) {
+            const _st_section *s = &_st_sections[i];
+            if (memcmp(tag, s->tag, 4) || !_st_wanted(s, flags)) continue;
+            if (section_version > s->version || (s->length ? length > s->size : length != s->size)) {
+                fprintf(stderr, "Snapshot section %.4s cannot be read\n", s->tag);
+                return -1;
+            }
+            if (s->check && s->check(p, length)) return -1;
+            found[i] = p;
+        }
+        p += length;
+    }
+    if (n < count) {
+        fprintf(stderr, "Snapshot is truncated\n");
+        return -1;
+    }
+    for (i = 0; i < ST_SECTIONS; i++) {
+        if (!found[i] && _st_wanted(&_st_sections[i], flags)) {
+            fprintf(stderr, "Snapshot is missing section %.4s\n", _st_sections[i].tag);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+///////**** Public ****///////
+
+size_t st_size(unsigned flags) {
+    size_t size = ST_HEADER_SIZE;
+    size_t i;
+    for (i = 0; i < ST_SECTIONS; i++) {
+        if (_st_wanted(&_st_sections[i], flags)) size += ST_SECTION_HEADER + _st_sections[i].size;
+    }
+    return size;
+}
+
+size_t st_save(uint8_t *buf, size_t size, unsigned flags) {
+    uint8_t *p = buf, *count;
+    uint16_t n = 0;
+    size_t i;
+
+    if (size < st_size(flags)) return 0;
+    st_put32(&p, ST_MAGIC);
+    st_put16(&p, ST_VERSION);
+    count = p;
+    p += 2;
+    for (i = 0; i < ST_SECTIONS; i++) {
+        const _st_section *s = &_st_sections[i];
+        uint32_t length;
+        if (!_st_wanted(s, flags)) continue;
+        length = s->length ? s->length() : s->size;
+        memcpy(p, s->tag, 4);
+        p += 4;
+        st_put16(&p, s->version);
+        st_put32(&p, length);
+        s->save(p);
+        p += length;
+        n++;
+    }
+    st_put16(&count, n);
+    return p - buf;
+}
+
+int st_check(const uint8_t *buf, size_t size, unsigned flags) {
+    const uint8_t *found[ST_SECTIONS];
+    return _st_parse(buf, size, flags, found);
+}
+
+int st_load(const uint8_t *buf, size_t size, unsigned flags) {
+    const uint8_t *found[ST_SECTIONS];
+    size_t i;
+
+    if (_st_parse(buf, size, flags, found)) return -1;
+    for (i = 0; i < ST_SECTIONS; i++) {
+        if (found[i]) _st_sections[i].load(found[i]);
+    }
+    return 0;
+}
+
+void st_checkpoint() {
+    sm_clear_dirty();
+}
+
+st_fork *st_fork_new() {
+    const size_t size = st_size(ST_NO_MEMORY);
+    st_fork *f = malloc(sizeof(st_fork) + size);
+
+    if (!f) return NULL;
+    f->space = sm_space_fork();
+    if (!f->space) {
+        free(f);
+        return NULL;
+    }
+    f->size = st_save(f->state, size, ST_NO_MEMORY);
+    return f;
+}
+
+void st_fork_enter(const st_fork *f) {
+    sm_space_enter(f->space);
+    st_load(f->state, f->size, ST_NO_MEMORY);
+}
+
+void st_fork_free(st_fork *f) {
+    if (!f) return;
+    sm_space_free(f->space);
+    free(f);
+}
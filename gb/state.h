@@ -0,0 +1,94 @@
+//
+//  state.h
+//  CGBA
+//
+
+/*
+ * Machine snapshots
+ * - a header (magic, format version, section count) followed by sections,
+ *   each a 4-character tag, its own version and its payload length, so a
+ *   reader skips sections it does not know and rejects ones it cannot read
+ * - sections: CPU registers and flags, TIME (clocks), MEM (VRAM, WRAM,
+ *   OAM, I/O and HRAM), PPU, APU and CART (ROM identity and cartridge RAM)
+ * - written into the caller's buffer, no allocation; all fields little
+ *   endian, each module packs its own payload with the helpers below
+ * - a load is checked in full before anything is applied, so a rejected
+ *   snapshot leaves the machine as it was
+ * - ST_NO_MEMORY leaves out the sections stored in the address space, for
+ *   callers that save and restore it whole (see host/statefile.h)
+ * - ST_INCREMENTAL stores memory as the pages written since st_checkpoint
+ *   instead (PAGE), such a snapshot loads over the one taken at that
+ *   checkpoint and is usually a few KiB
+ * - forks keep the memory as pages shared copy-on-write with the machine
+ *   and other forks (sm_space_fork), only the rest is a snapshot, so one
+ *   state can branch into thousands that each pay for the pages they
+ *   change
+ */
+
+#ifndef __CGBA__state__
+#define __CGBA__state__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define ST_VERSION 1
+
+// Flags
+#define ST_ALL       0x00
+#define ST_NO_MEMORY 0x01   // no MEM or CART, the caller provides the whole address space
+#define ST_INCREMENTAL 0x02 // PAGE instead of MEM and CART, pages dirtied since st_checkpoint
+
+size_t st_size(unsigned flags);     // most bytes st_save writes
+size_t st_save(uint8_t *buf, size_t size, unsigned flags);     // bytes written, 0 if it does not fit
+int    st_load(const uint8_t *buf, size_t size, unsigned flags);
+int    st_check(const uint8_t *buf, size_t size, unsigned flags);   // st_load without loading
+// Starts a new set of dirty pages, call it right after the base snapshot
+void   st_checkpoint();
+
+typedef struct st_fork st_fork;
+st_fork *st_fork_new();                     // forks the running machine
+void     st_fork_enter(const st_fork *f);   // the running machine becomes the fork, which stays
+void     st_fork_free(st_fork *f);
+
+/*
+ *  Payload packing, each call advances the cursor
+ */
+static inline void st_put8(uint8_t **p, uint8_t v) {
+    *(*p)++ = v;
+}
+
+static inline void st_put16(uint8_t **p, uint16_t v) {
+    st_put8(p, v & 0xFF);
+    st_put8(p, v >> 8);
+}
+
+static inline void st_put32(uint8_t **p, uint32_t v) {
+    st_put16(p, v & 0xFFFF);
+    st_put16(p, v >> 16);
+}
+
+static inline void st_put64(uint8_t **p, uint64_t v) {
+    st_put32(p, v & 0xFFFFFFFF);
+    st_put32(p, v >> 32);
+}
+
+static inline uint8_t st_get8(const uint8_t **p) {
+    return *(*p)++;
+}
+
+static inline uint16_t st_get16(const uint8_t **p) {
+    const uint16_t lo = st_get8(p);
+    return lo | (st_get8(p) << 8);
+}
+
+static inline uint32_t st_get32(const uint8_t **p) {
+    const uint32_t lo = st_get16(p);
+    return lo | ((uint32_t)st_get16(p) << 16);
+}
+
+static inline uint64_t st_get64(const uint8_t **p) {
+    const uint64_t lo = st_get32(p);
+    return lo | ((uint64_t)st_get32(p) << 32);
+}
+
+#endif /* defined(__CGBA__state__) */
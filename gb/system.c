@@ -0,0 +1,254 @@
+//
+//  system.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "system.h"
+#include "state.h"
+#include "cpu/memorymodule.h"
+#include "cpu/interpreter.h"
+#include "gpu/ppu.h"
+#include "apu/apu.h"
+#include "input/joypad.h"
+
+///////**** Private ****///////
+
+#define SYS_ROM_SIZE 0x8000
+
+struct sys_machine {
+    sm_context  *cpu;
+    ppu_context *ppu;
+    apu_context *apu;
+    jp_context  *pad;
+    // devices to return to after running ahead (memory is journaled),
+    // allocated on first use
+    uint8_t *ahead;
+    size_t   ahead_size;
+};
+
+static SM_THREAD sys_machine *_sys_machine = NULL;  // the one the thread runs
+static SM_THREAD sys_machine *_sys_own = NULL;      // from sys_init, see sys_machine_leave
+
+static sys_machine *_sys_new(const sys_machine *from) {
+    sys_machine *m = calloc(1, sizeof(sys_machine));
+
+    if (!m) return NULL;
+    m->cpu = sm_context_new(from ? from->cpu : NULL);
+    m->ppu = ppu_context_new(from ? from->ppu : NULL);
+    m->apu = apu_context_new(from ? from->apu : NULL);
+    m->pad = jp_context_new(from ? from->pad : NULL);
+    if (!m->cpu || !m->ppu || !m->apu || !m->pad) {
+        sys_machine_free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void _sys_bind(sys_machine *m) {
+    _sys_machine = m;
+    sm_bind(m ? m->cpu : NULL);
+    ppu_bind(m ? m->ppu : NULL);
+    apu_bind(m ? m->apu : NULL);
+    jp_bind(m ? m->pad : NULL);
+}
+
+static void _sys_service_interrupts() {
+    const uint8_t pending = sm_getmemaddr8(SM_ADDR_IF) & sm_getmemaddr8(SM_ADDR_IE) & 0x1F;
+    uint8_t bit = 0;
+
+    // a key press ends STOP, enabled or not
+    if (sm_getmemaddr8(SM_ADDR_IF) & INT_JOYPAD) sm_set_reg_stop(FALSE);
+    if (!pending) return;
+    sm_set_reg_halt(FALSE);     // any pending interrupt ends HALT
+    if (!sm_get_reg_intr()) return;
+    while (!(pending & (1 << bit))) bit++;
+
+    sm_setmemaddr8(SM_ADDR_IF, sm_getmemaddr8(SM_ADDR_IF) & ~(1 << bit));
+    sm_set_reg_intr(FALSE);
+    sm_inc_reg_sp(-HALFWORD);
+    sm_setmemaddr16(sm_get_reg_sp(), sm_get_reg_pc());
+    sm_set_reg_pc(0x40 + bit * 8);
+    sm_inc_clock(5);
+}
+
+///////**** Public ****///////
+
+void sys_init() {
+    if (!_sys_machine) {
+        _sys_own = _sys_new(NULL);
+        if (!_sys_own) {
+            fprintf(stderr, "Machine not allocated\n");
+            abort();
+        }
+        _sys_bind(_sys_own);
+    }
+    sm_init();
+    sys_reset();
+}
+
+// Post-boot DMG state, the boot ROM itself is not emulated
+void sys_reset() {
+    sm_set_reg16(REG_A, REG_F, 0x01B0);
+    sm_set_reg16(REG_B, REG_C, 0x0013);
+    sm_set_reg16(REG_D, REG_E, 0x00D8);
+    sm_set_reg16(REG_H, REG_L, 0x014D);
+    sm_set_reg_sp(0xFFFE);
+    sm_set_reg_pc(0x0100);
+    sm_set_reg_intr(FALSE);
+    sm_set_reg_halt(FALSE);
+    sm_set_reg_stop(FALSE);
+
+    sm_setmemaddr8(SM_ADDR_IF, 0xE1);
+    sm_setmemaddr8(SM_ADDR_IE, 0x00);
+    sm_setmemaddr8(PPU_REG_LCDC, 0x91);
+    sm_setmemaddr8(PPU_REG_STAT, 0x85);
+    sm_setmemaddr8(PPU_REG_BGP,  0xFC);
+    sm_setmemaddr8(PPU_REG_OBP0, 0xFF);
+    sm_setmemaddr8(PPU_REG_OBP1, 0xFF);
+    ppu_reset();
+    apu_reset();
+    jp_reset();
+}
+
+// Maps the first 32 KiB of the cartridge, no MBC yet
+int sys_load_rom_buffer(const uint8_t *rom, size_t size) {
+    if (size < 0x150) {
+        fprintf(stderr, "ROM is too small\n");
+        return -1;
+    }
+    sys_init();
+    sm_write_block(0, rom, size < SYS_ROM_SIZE ? size : SYS_ROM_SIZE);
+    return 0;
+}
+
+int sys_load_rom(const char *path) {
+    FILE *f = fopen(path, "rb");
+    uint8_t rom[SYS_ROM_SIZE];
+    size_t size;
+
+    if (!f) {
+        fprintf(stderr, "Could not open ROM %s\n", path);
+        return -1;
+    }
+    size = fread(rom, 1, SYS_ROM_SIZE, f);
+    fclose(f);
+    if (size < 0x150) {
+        fprintf(stderr, "ROM %s is too small\n", path);
+        return -1;
+    }
+    return sys_load_rom_buffer(rom, size);
+}
+
+// Runs one instruction (or one idle cycle while halted or stopped), returns T-cycles
+uint16_t sys_step() {
+    const uint16_t start = sm_get_tclock();
+    uint16_t cycles;
+
+    _sys_service_interrupts();
+    if (sm_get_reg_halt() || sm_get_reg_stop()) {
+        sm_inc_clock(1);
+    }
+    else {
+        const uint8_t opcode = sm_getmemaddr8(sm_get_reg_pc());
+        sm_inc_reg_pc(BYTE);
+        ip_execute(opcode);
+    }
+
+    // a few handlers do not account their time yet
+    cycles = sm_get_tclock() - start;
+    if (!cycles) {
+        sm_inc_clock(1);
+        cycles = 4;
+    }
+    return cycles;
+}
+
+// Runs until the PPU enters VBlank
+void sys_run_frame() {
+    while (!ppu_step(sys_step()));
+}
+
+void sys_run_cycles(uint32_t cycles) {
+    const uint64_t end = sm_get_cycles() + cycles;
+    while (sm_get_cycles() < end) ppu_step(sys_step());
+}
+
+/*
+ *  Run-ahead: shows what the machine draws `frames` frames from now with
+ *  the keys held at the moment, then puts it back as it was. Only the
+ *  last frame is drawn and the APU is muted meanwhile, so the sound
+ *  carries on from the machine's own frames as if nothing ran ahead.
+ *  The devices go back from a snapshot without memory and the address
+ *  space from the journal, which only copies the pages the frames wrote
+ *  and leaves the caller's dirty pages as they were.
+ */
+int sys_run_ahead(unsigned int frames) {
+    sys_machine *m = _sys_machine;
+    unsigned int i;
+    int rc;
+
+    if (!m->ahead) {
+        m->ahead_size = st_size(ST_NO_MEMORY);
+        m->ahead = malloc(m->ahead_size);
+        if (!m->ahead) return -1;
+    }
+    if (!frames) return -1;
+    if (!st_save(m->ahead, m->ahead_size, ST_NO_MEMORY)) return -1;
+    if (sm_journal_begin()) return -1;
+    apu_set_mute(1);
+    for (i = 0; i < frames; i++) {
+        ppu_set_skip(i + 1 < frames);
+        sys_run_frame();
+    }
+    sm_journal_rollback();
+    rc = st_load(m->ahead, m->ahead_size, ST_NO_MEMORY);
+    apu_set_mute(0);
+    return rc;
+}
+
+/*
+ *  Machines away from a thread. A machine is its contexts, so entering
+ *  one only points the thread at them and a thread can take turns
+ *  running thousands.
+ */
+sys_machine *sys_machine_new() {
+    sys_machine *from = _sys_machine, *m = _sys_new(NULL);
+
+    if (!m) return NULL;
+    _sys_bind(m);
+    sys_init();
+    _sys_bind(from);
+    return m;
+}
+
+sys_machine *sys_machine_copy() {
+    return _sys_machine ? _sys_new(_sys_machine) : sys_machine_new();
+}
+
+void sys_machine_free(sys_machine *m) {
+    if (!m) return;
+    if (m == _sys_own) _sys_own = NULL;
+    if (m == _sys_machine) _sys_bind(_sys_own);
+    sm_context_free(m->cpu);
+    ppu_context_free(m->ppu);
+    apu_context_free(m->apu);
+    jp_context_free(m->pad);
+    free(m->ahead);
+    free(m);
+}
+
+void sys_machine_enter(sys_machine *m, uint16_t *frame) {
+    _sys_bind(m);
+    ppu_target(frame);
+}
+
+void sys_machine_leave(sys_machine *m) {
+    (void)m;
+    _sys_bind(_sys_own);
+}
+
+uint8_t *sys_machine_memory(sys_machine *m) {
+    return sm_context_memory(m->cpu);
+}
@@ -0,0 +1,47 @@
+//
+//  system.h
+//  CGBA
+//
+
+/*
+ * Ties the interpreter, memory, PPU and APU together into a runnable machine
+ * - a machine is a sys_machine, run by whichever thread entered it last;
+ *   entering is a pointer swap, so machines can move between threads or
+ *   many of them take turns on one (see host/batch.h)
+ */
+
+#ifndef __CGBA__system__
+#define __CGBA__system__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Powers on the calling thread's machine with no cartridge; a thread that
+// has not entered one gets a machine of its own
+void sys_init();
+int  sys_load_rom(const char *path);
+int  sys_load_rom_buffer(const uint8_t *rom, size_t size);
+void sys_reset();
+uint16_t sys_step();
+void sys_run_frame();
+void sys_run_cycles(uint32_t cycles);   // at least `cycles` T-cycles
+// Draws the frame `frames` ahead, then restores the machine; leaves skipping off
+int  sys_run_ahead(unsigned int frames);
+
+// A machine: the CPU, memory, PPU, APU and joypad contexts (see sm_bind)
+typedef struct sys_machine sys_machine;
+sys_machine *sys_machine_new();                 // powered on, no cartridge
+sys_machine *sys_machine_copy();                // of the calling thread's machine, silent
+void     sys_machine_free(sys_machine *m);
+// The calling thread runs m until it enters another one or leaves. It
+// draws into frame (PPU_WIDTH * PPU_HEIGHT), NULL draws nothing; a buffer
+// given to the same machine again is only redrawn where it changed
+void     sys_machine_enter(sys_machine *m, uint16_t *frame);
+// The calling thread lets go of m, which can then move on; back to the
+// thread's own machine if sys_init gave it one
+void     sys_machine_leave(sys_machine *m);
+// SM_MEM_SIZE bytes, not while another thread runs m; pages a fork shares
+// are copied home first
+uint8_t *sys_machine_memory(sys_machine *m);
+
+#endif /* defined(__CGBA__system__) */
@@ -0,0 +1,161 @@
+//
+//  memorymodule.c
+//  CGBA
+//
+
+#include <string.h>
+#include "memorymodule.h"
+
+///////**** Private ****///////
+
+/*
+ *  Memory regions
+ */
+static uint8_t _gba_sm_bios [GBA_BIOS_SIZE];
+static uint8_t _gba_sm_ewram[GBA_EWRAM_SIZE];
+static uint8_t _gba_sm_iwram[GBA_IWRAM_SIZE];
+static uint8_t _gba_sm_io   [GBA_IO_SIZE];
+static uint8_t _gba_sm_pal  [GBA_PAL_SIZE];
+static uint8_t _gba_sm_vram [GBA_VRAM_SIZE];
+static uint8_t _gba_sm_oam  [GBA_OAM_SIZE];
+static uint8_t _gba_sm_sram [GBA_SRAM_SIZE];
+
+static const uint8_t *_gba_sm_rom = NULL;
+static size_t _gba_sm_rom_size = 0;
+
+static uint32_t _gba_sm_pal_writes = 0;
+static uint32_t _gba_sm_oam_writes = 0;
+
+// Host pointer for addr, NULL when unmapped or (for writes) read-only
+static uint8_t *_gba_sm_ptr(uint32_t addr, uint8_t write) {
+    uint32_t off;
+    switch (addr >> 24) {
+        case 0x00:
+            if (write || addr >= GBA_BIOS_SIZE) return NULL;
+            return &_gba_sm_bios[addr];
+        case 0x02: return &_gba_sm_ewram[addr & (GBA_EWRAM_SIZE - 1)];
+        case 0x03: return &_gba_sm_iwram[addr & (GBA_IWRAM_SIZE - 1)];
+        case 0x04:
+            off = addr & 0x00FFFFFF;
+            return off < GBA_IO_SIZE ? &_gba_sm_io[off] : NULL;
+        case 0x05: return &_gba_sm_pal[addr & (GBA_PAL_SIZE - 1)];
+        case 0x06:
+            // 128K window, the last 32K mirror the OBJ tiles
+            off = addr & 0x1FFFF;
+            if (off >= GBA_VRAM_SIZE) off -= 0x8000;
+            return &_gba_sm_vram[off];
+        case 0x07: return &_gba_sm_oam[addr & (GBA_OAM_SIZE - 1)];
+        case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+            off = addr & (GBA_ROM_MAX - 1);
+            if (write || off >= _gba_sm_rom_size) return NULL;
+            return (uint8_t *)&_gba_sm_rom[off];
+        case 0x0E: return &_gba_sm_sram[addr & (GBA_SRAM_SIZE - 1)];
+        default: return NULL;
+    }
+}
+
+///////**** Public ****///////
+
+void gba_sm_reset() {
+    memset(_gba_sm_ewram, 0, sizeof(_gba_sm_ewram));
+    memset(_gba_sm_iwram, 0, sizeof(_gba_sm_iwram));
+    memset(_gba_sm_io, 0, sizeof(_gba_sm_io));
+    memset(_gba_sm_pal, 0, sizeof(_gba_sm_pal));
+    memset(_gba_sm_vram, 0, sizeof(_gba_sm_vram));
+    memset(_gba_sm_oam, 0, sizeof(_gba_sm_oam));
+    _gba_sm_pal_writes++;
+    _gba_sm_oam_writes++;
+}
+
+// rom must outlive the machine
+void gba_sm_set_rom(const uint8_t *rom, size_t size) {
+    _gba_sm_rom = rom;
+    _gba_sm_rom_size = size > GBA_ROM_MAX ? GBA_ROM_MAX : size;
+}
+
+/*
+ *  Memory interfaces, halfword and word accesses are forced aligned
+ */
+uint8_t gba_sm_read8(uint32_t addr) {
+    const uint8_t *p = _gba_sm_ptr(addr, 0);
+    return p ? *p : 0;
+}
+
+uint16_t gba_sm_read16(uint32_t addr) {
+    const uint8_t *p = _gba_sm_ptr(addr & ~1u, 0);
+    return p ? *(const uint16_t *)p : 0;
+}
+
+uint32_t gba_sm_read32(uint32_t addr) {
+    const uint8_t *p = _gba_sm_ptr(addr & ~3u, 0);
+    return p ? *(const uint32_t *)p : 0;
+}
+
+void gba_sm_write8(uint32_t addr, uint8_t data) {
+    uint8_t *p;
+    switch (addr >> 24) {
+        case 0x04:
+            // I/O side effects live in the halfword path
+            p = _gba_sm_ptr(addr & ~1u, 1);
+            if (p == NULL) return;
+            if (addr & 1) gba_sm_write16(addr, (*(uint16_t *)p & 0x00FF) | (data << 8));
+            else gba_sm_write16(addr, (*(uint16_t *)p & 0xFF00) | data);
+            return;
+        case 0x05: case 0x06:
+            gba_sm_write16(addr, data * 0x0101);
+            return;
+        case 0x07:
+            return;
+        default:
+            p = _gba_sm_ptr(addr, 1);
+            if (p) *p = data;
+    }
+}
+
+void gba_sm_write16(uint32_t addr, uint16_t data) {
+    uint8_t *p = _gba_sm_ptr(addr & ~1u, 1);
+    if (p == NULL) return;
+    if ((addr & ~1u) == GBA_ADDR_IF) {
+        // writing 1 acknowledges a request
+        data = *(uint16_t *)p & ~data;
+    }
+    else if ((addr >> 24) == 0x05) {
+        _gba_sm_pal_writes++;
+    }
+    else if ((addr >> 24) == 0x07) {
+        _gba_sm_oam_writes++;
+    }
+    *(uint16_t *)p = data;
+}
+
+void gba_sm_write32(uint32_t addr, uint32_t data) {
+    gba_sm_write16(addr & ~3u, data & 0xFFFF);
+    gba_sm_write16((addr & ~3u) + 2, data >> 16);
+}
+
+void gba_sm_request_irq(uint16_t bits) {
+    *(uint16_t *)&_gba_sm_io[GBA_ADDR_IF - GBA_IO_BASE] |= bits;
+}
+
+uint8_t *gba_sm_region(uint32_t addr) {
+    uint8_t *p = _gba_sm_ptr(addr, 0);
+    switch (addr >> 24) {
+        case 0x00: return p ? _gba_sm_bios : NULL;
+        case 0x02: return _gba_sm_ewram;
+        case 0x03: return _gba_sm_iwram;
+        case 0x04: return p ? _gba_sm_io : NULL;
+        case 0x05: return _gba_sm_pal;
+        case 0x06: return _gba_sm_vram;
+        case 0x07: return _gba_sm_oam;
+        case 0x0E: return _gba_sm_sram;
+        default: return p ? (uint8_t *)_gba_sm_rom : NULL;
+    }
+}
+
+uint32_t gba_sm_pal_writes() {
+    return _gba_sm_pal_writes;
+}
+
+uint32_t gba_sm_oam_writes() {
+    return _gba_sm_oam_writes;
+}
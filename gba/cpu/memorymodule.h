@@ -0,0 +1,68 @@
+//
+//  memorymodule.h
+//  CGBA
+//
+
+/*
+ * GBA address space, laid out as in gb/cpu/memorymodule.h
+ * - each region is its own buffer, unused upper address bits mirror it
+ * - 8-bit writes to palette RAM and VRAM store the byte in both halves of
+ *   the halfword, 8-bit writes to OAM are ignored (as on hardware)
+ * - ROM is borrowed from the caller, never copied or written
+ */
+
+#ifndef __CGBA__gba_memorymodule__
+#define __CGBA__gba_memorymodule__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define GBA_BIOS_BASE  0x00000000
+#define GBA_EWRAM_BASE 0x02000000
+#define GBA_IWRAM_BASE 0x03000000
+#define GBA_IO_BASE    0x04000000
+#define GBA_PAL_BASE   0x05000000
+#define GBA_VRAM_BASE  0x06000000
+#define GBA_OAM_BASE   0x07000000
+#define GBA_ROM_BASE   0x08000000
+#define GBA_SRAM_BASE  0x0E000000
+
+#define GBA_BIOS_SIZE  0x4000
+#define GBA_EWRAM_SIZE 0x40000
+#define GBA_IWRAM_SIZE 0x8000
+#define GBA_IO_SIZE    0x400
+#define GBA_PAL_SIZE   0x400
+#define GBA_VRAM_SIZE  0x18000
+#define GBA_OAM_SIZE   0x400
+#define GBA_ROM_MAX    0x2000000
+#define GBA_SRAM_SIZE  0x10000
+
+// Interrupt registers and request bits
+#define GBA_ADDR_IE 0x04000200
+#define GBA_ADDR_IF 0x04000202
+
+#define GBA_INT_VBLANK 0x0001
+#define GBA_INT_HBLANK 0x0002
+#define GBA_INT_VCOUNT 0x0004
+
+void gba_sm_reset();
+void gba_sm_set_rom(const uint8_t *rom, size_t size);
+
+uint8_t  gba_sm_read8 (uint32_t addr);
+uint16_t gba_sm_read16(uint32_t addr);
+uint32_t gba_sm_read32(uint32_t addr);
+void gba_sm_write8 (uint32_t addr, uint8_t  data);
+void gba_sm_write16(uint32_t addr, uint16_t data);
+void gba_sm_write32(uint32_t addr, uint32_t data);
+
+// Sets IF bits from hardware, CPU writes to IF acknowledge instead
+void gba_sm_request_irq(uint16_t bits);
+
+// Direct access to a whole region for the PPU, NULL if addr is unmapped
+uint8_t *gba_sm_region(uint32_t addr);
+// Counts writes to palette RAM, a change means cached colors are stale
+uint32_t gba_sm_pal_writes();
+// Counts writes to OAM, a change means cached sprite lists are stale
+uint32_t gba_sm_oam_writes();
+
+#endif /* defined(__CGBA__gba_memorymodule__) */
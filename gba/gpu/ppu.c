@@ -0,0 +1,863 @@
+//
+//  ppu.c
+//  CGBA
+//
+
+#include <string.h>
+#include <time.h>
+#include "ppu.h"
+#include "../cpu/memorymodule.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GBA_PPU_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GBA_PPU_NEON
+#endif
+
+///////**** Private ****///////
+
+// bitmap layouts, pages are 0xA000 bytes apart
+#define BMP_PAGE   0xA000
+#define MODE5_W    160
+#define MODE5_H    128
+
+// text and affine tiles live in the first 64K
+#define BG_VRAM_SIZE 0x10000
+
+// layer pixels are BGR555, bit 15 set where the layer is transparent
+#define LAYER_CLEAR 0x8000
+
+// BGs present per mode, one nibble per mode
+#define BG_IN_MODE 0x444C7F
+
+// BLDCNT target bits
+#define TARGET_OBJ 0x10
+#define TARGET_BD  0x20
+
+// OBJ attributes
+#define OBJ_COUNT        128
+#define OBJ_TILES        0x10000
+#define OBJ_BMP_TILES    0x14000
+#define OBJ_NONE         0xFF
+#define ATTR0_AFFINE     0x0100
+#define ATTR0_DOUBLE     0x0200     // disables a non-affine sprite
+#define ATTR0_MODE       0x0C00
+#define ATTR0_SEMI       0x0400
+#define ATTR0_WINDOW     0x0800
+#define ATTR0_8BPP       0x2000
+#define ATTR1_HFLIP      0x1000
+#define ATTR1_VFLIP      0x2000
+
+// OBJ cycles per line, fewer when DISPCNT frees HBlank
+#define OBJ_BUDGET       1210
+#define OBJ_BUDGET_FREE  954
+
+// BLDCNT color effects
+#define BLEND_NONE    0
+#define BLEND_ALPHA   1
+#define BLEND_LIGHTEN 2
+#define BLEND_DARKEN  3
+
+// DISPSTAT bits
+#define DISPSTAT_VBLANK     0x0001
+#define DISPSTAT_HBLANK     0x0002
+#define DISPSTAT_VCOUNT     0x0004
+#define DISPSTAT_VBLANK_IRQ 0x0008
+#define DISPSTAT_HBLANK_IRQ 0x0010
+#define DISPSTAT_VCOUNT_IRQ 0x0020
+
+/*
+ *  Frames go to the caller's buffer when one is set, latched at line 0
+ */
+static uint16_t  _gba_ppu_own_fb[GBA_PPU_WIDTH * GBA_PPU_HEIGHT];
+static uint16_t *_gba_ppu_fb   = _gba_ppu_own_fb;
+static uint16_t *_gba_ppu_next = _gba_ppu_own_fb;
+
+/*
+ *  Palette RAM as display colors, 256 BG then 256 OBJ, rebuilt only
+ *  after palette writes
+ */
+static uint16_t _gba_ppu_lut[512];
+static uint32_t _gba_ppu_lut_gen = 0;
+static uint8_t  _gba_ppu_lut_valid = 0;
+
+/*
+ *  Layer lines for the compositor, and the BG2/BG3 internal reference
+ *  points (x, y) stepped once per line
+ */
+struct _gba_ppu_layer {
+    const uint16_t *px;
+    uint16_t target;            // this layer's BLDCNT bit
+    uint8_t semi;               // semi-transparent sprites
+};
+typedef struct _gba_ppu_layer _gba_ppu_layer;
+
+struct _gba_ppu_blend {
+    uint8_t mode;
+    uint16_t first, second;     // BLDCNT target masks
+    uint16_t eva, evb, evy;
+};
+typedef struct _gba_ppu_blend _gba_ppu_blend;
+
+static uint16_t _gba_ppu_bg[4][GBA_PPU_WIDTH];
+static uint16_t _gba_ppu_backdrop[GBA_PPU_WIDTH];
+static int32_t  _gba_ppu_ref[2][2];
+
+/*
+ *  Sprites on each line as OAM indices in OAM order, within the line's
+ *  cycle budget. Built lazily and only rebuilt after OAM writes or a
+ *  budget change; lines before _gba_ppu_obj_from are stale. Drawn
+ *  sprites land in one line tagged with priority * 2 + semi-transparent
+ *  and are split into a layer per tag for the compositor.
+ */
+static uint8_t  _gba_ppu_obj_line[GBA_PPU_HEIGHT][OBJ_COUNT];
+static uint8_t  _gba_ppu_obj_count[GBA_PPU_HEIGHT];
+static uint32_t _gba_ppu_obj_gen = 0;
+static uint16_t _gba_ppu_obj_budget = 0;
+static uint16_t _gba_ppu_obj_from = GBA_PPU_HEIGHT;
+static uint16_t _gba_ppu_obj_px[GBA_PPU_WIDTH];
+static uint8_t  _gba_ppu_obj_class[GBA_PPU_WIDTH];
+static uint16_t _gba_ppu_obj[8][GBA_PPU_WIDTH];
+
+static uint32_t _gba_ppu_dot = 0;
+static uint16_t _gba_ppu_vcount = 0;
+static uint8_t  _gba_ppu_skip = 0;
+static uint8_t  _gba_ppu_skipping = 0;     // _gba_ppu_skip latched at line 0
+static uint8_t  _gba_ppu_line_drawn = 0;
+
+static gba_ppu_stats _gba_ppu_stats;
+static uint8_t       _gba_ppu_profiling = 0;
+
+static inline uint64_t _gba_ppu_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void _gba_ppu_update_lut() {
+    const uint16_t *pal = (const uint16_t *)gba_sm_region(GBA_PAL_BASE);
+    const uint32_t gen = gba_sm_pal_writes();
+    int i;
+    if (_gba_ppu_lut_valid && gen == _gba_ppu_lut_gen) return;
+    for (i = 0; i < 512; i++) _gba_ppu_lut[i] = pal[i] & 0x7FFF;
+    _gba_ppu_lut_gen = gen;
+    _gba_ppu_lut_valid = 1;
+}
+
+static void _gba_ppu_fill(uint16_t *dst, int n, uint16_t color) {
+    int i;
+    for (i = 0; i < n; i++) dst[i] = color;
+}
+
+// Direct color pixels, bit 15 is unused and dropped
+static void _gba_ppu_copy15(uint16_t *dst, const uint16_t *src, int n) {
+    int i = 0;
+#if defined(GBA_PPU_SSE2)
+    const __m128i mask = _mm_set1_epi16(0x7FFF);
+    for (; i + 32 <= n; i += 32) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+        const __m128i b = _mm_loadu_si128((const __m128i *)&src[i + 8]);
+        const __m128i c = _mm_loadu_si128((const __m128i *)&src[i + 16]);
+        const __m128i d = _mm_loadu_si128((const __m128i *)&src[i + 24]);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_and_si128(a, mask));
+        _mm_storeu_si128((__m128i *)&dst[i + 8], _mm_and_si128(b, mask));
+        _mm_storeu_si128((__m128i *)&dst[i + 16], _mm_and_si128(c, mask));
+        _mm_storeu_si128((__m128i *)&dst[i + 24], _mm_and_si128(d, mask));
+    }
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_and_si128(a, mask));
+    }
+#elif defined(GBA_PPU_NEON)
+    const uint16x8_t mask = vdupq_n_u16(0x7FFF);
+    for (; i + 8 <= n; i += 8) {
+        vst1q_u16(&dst[i], vandq_u16(vld1q_u16(&src[i]), mask));
+    }
+#endif
+    for (; i < n; i++) dst[i] = src[i] & 0x7FFF;
+}
+
+// Paletted pixels, no gather on SSE2/NEON so the lookups are unrolled by 8
+static void _gba_ppu_lookup8(uint16_t *dst, const uint8_t *src, int n, const uint16_t *lut) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        dst[i + 0] = lut[src[i + 0]];
+        dst[i + 1] = lut[src[i + 1]];
+        dst[i + 2] = lut[src[i + 2]];
+        dst[i + 3] = lut[src[i + 3]];
+        dst[i + 4] = lut[src[i + 4]];
+        dst[i + 5] = lut[src[i + 5]];
+        dst[i + 6] = lut[src[i + 6]];
+        dst[i + 7] = lut[src[i + 7]];
+    }
+    for (; i < n; i++) dst[i] = lut[src[i]];
+}
+
+/*
+ *  Bitmap modes draw BG2 only. Drawn as a layer, pixels it does not
+ *  cover are transparent; drawn straight to the screen they show the
+ *  backdrop (BG color 0).
+ */
+static void _gba_ppu_render_bitmap(uint16_t *dst, uint16_t y, uint16_t dispcnt, uint8_t layer) {
+    const uint8_t *vram = gba_sm_region(GBA_VRAM_BASE);
+    const uint32_t page = (dispcnt & GBA_DISPCNT_PAGE) ? BMP_PAGE : 0;
+    const uint16_t backdrop = layer ? LAYER_CLEAR : _gba_ppu_lut[0];
+    int x;
+
+    if (!(dispcnt & GBA_DISPCNT_BG2)) {
+        _gba_ppu_fill(dst, GBA_PPU_WIDTH, backdrop);
+        return;
+    }
+    switch (dispcnt & GBA_DISPCNT_MODE) {
+        case 3:
+            _gba_ppu_copy15(dst, (const uint16_t *)&vram[y * GBA_PPU_WIDTH * 2], GBA_PPU_WIDTH);
+            break;
+        case 4:
+            _gba_ppu_lookup8(dst, &vram[page + y * GBA_PPU_WIDTH], GBA_PPU_WIDTH, _gba_ppu_lut);
+            if (layer) {
+                for (x = 0; x < GBA_PPU_WIDTH; x++) {
+                    if (!vram[page + y * GBA_PPU_WIDTH + x]) dst[x] = LAYER_CLEAR;
+                }
+            }
+            break;
+        case 5:
+            if (y < MODE5_H) {
+                _gba_ppu_copy15(dst, (const uint16_t *)&vram[page + y * MODE5_W * 2], MODE5_W);
+                _gba_ppu_fill(dst + MODE5_W, GBA_PPU_WIDTH - MODE5_W, backdrop);
+            }
+            else {
+                _gba_ppu_fill(dst, GBA_PPU_WIDTH, backdrop);
+            }
+            break;
+    }
+}
+
+// One 8 pixel tile row into out, color 0 is transparent
+static void _gba_ppu_tile_row(uint16_t *out, const uint8_t *vram, uint32_t addr,
+                              uint8_t bpp8, uint8_t hflip, const uint16_t *pal) {
+    int i;
+    // tiles past the BG half of VRAM read as transparent
+    if (addr + (bpp8 ? 8 : 4) > BG_VRAM_SIZE) {
+        _gba_ppu_fill(out, 8, LAYER_CLEAR);
+        return;
+    }
+    for (i = 0; i < 8; i++) {
+        const int sx = hflip ? 7 - i : i;
+        const uint8_t c = bpp8 ? vram[addr + sx] : (vram[addr + (sx >> 1)] >> ((sx & 1) * 4)) & 0x0F;
+        out[i] = c ? pal[c] : LAYER_CLEAR;
+    }
+}
+
+/*
+ *  Text background, maps are 32x32 entry screen blocks laid out
+ *  left to right then top to bottom for the larger sizes
+ */
+static void _gba_ppu_render_text(uint16_t *dst, int bg, uint16_t y) {
+    const uint8_t *vram = gba_sm_region(GBA_VRAM_BASE);
+    const uint16_t cnt = gba_sm_read16(GBA_REG_BG0CNT + 2 * bg);
+    const uint16_t hofs = gba_sm_read16(GBA_REG_BG0HOFS + 4 * bg) & 0x1FF;
+    const uint16_t vofs = gba_sm_read16(GBA_REG_BG0HOFS + 4 * bg + 2) & 0x1FF;
+    const uint32_t chars = ((cnt >> 2) & 3) * 0x4000;
+    const uint32_t screen = ((cnt >> 8) & 0x1F) * 0x800;
+    const uint8_t bpp8 = (cnt >> 7) & 1;
+    const uint8_t size = cnt >> 14;
+    const int w = (size & 1) ? 512 : 256, h = (size & 2) ? 512 : 256;
+    const int ty = (y + vofs) & (h - 1);
+    uint16_t line[GBA_PPU_WIDTH + 8];
+    int t;
+
+    for (t = 0; t <= GBA_PPU_WIDTH / 8; t++) {
+        const int tx = (hofs + t * 8) & (w - 1);
+        int block = tx >> 8;
+        uint16_t entry;
+        uint32_t addr;
+        int row;
+        if (ty >= 256) block += w == 512 ? 2 : 1;
+        entry = *(const uint16_t *)&vram[(screen + block * 0x800 +
+                                          ((ty & 255) >> 3) * 64 + ((tx & 255) >> 3) * 2) & 0xFFFF];
+        row = (entry & 0x0800) ? 7 - (ty & 7) : ty & 7;
+        if (bpp8) {
+            addr = chars + (entry & 0x3FF) * 64 + row * 8;
+            _gba_ppu_tile_row(&line[t * 8], vram, addr, 1, (entry >> 10) & 1, _gba_ppu_lut);
+        }
+        else {
+            addr = chars + (entry & 0x3FF) * 32 + row * 4;
+            _gba_ppu_tile_row(&line[t * 8], vram, addr, 0, (entry >> 10) & 1,
+                              &_gba_ppu_lut[(entry >> 12) * 16]);
+        }
+    }
+    memcpy(dst, &line[hofs & 7], GBA_PPU_WIDTH * sizeof(uint16_t));
+}
+
+/*
+ *  Affine background, 8bpp tiles and byte map entries, sampled along
+ *  (PA, PC) from the line's reference point
+ */
+static void _gba_ppu_render_affine(uint16_t *dst, int bg) {
+    const uint8_t *vram = gba_sm_region(GBA_VRAM_BASE);
+    const uint32_t regs = GBA_REG_BG2PA + (bg - 2) * 0x10;
+    const uint16_t cnt = gba_sm_read16(GBA_REG_BG0CNT + 2 * bg);
+    const int32_t pa = (int16_t)gba_sm_read16(regs), pc = (int16_t)gba_sm_read16(regs + 4);
+    const uint8_t *chars = &vram[((cnt >> 2) & 3) * 0x4000];
+    const uint8_t *map = &vram[((cnt >> 8) & 0x1F) * 0x800];
+    const int size = 128 << (cnt >> 14);
+    const uint8_t wrap = (cnt >> 13) & 1;
+    int32_t px = _gba_ppu_ref[bg - 2][0], py = _gba_ppu_ref[bg - 2][1];
+    int x;
+
+    for (x = 0; x < GBA_PPU_WIDTH; x++, px += pa, py += pc) {
+        int tx = px >> 8, ty = py >> 8;
+        uint8_t c;
+        if (wrap) {
+            tx &= size - 1;
+            ty &= size - 1;
+        }
+        else if (tx < 0 || ty < 0 || tx >= size || ty >= size) {
+            dst[x] = LAYER_CLEAR;
+            continue;
+        }
+        c = chars[map[(ty >> 3) * (size >> 3) + (tx >> 3)] * 64 + (ty & 7) * 8 + (tx & 7)];
+        dst[x] = c ? _gba_ppu_lut[c] : LAYER_CLEAR;
+    }
+}
+
+// Internal reference points load from BGxX/Y at the top of the frame
+static void _gba_ppu_latch_refs() {
+    int i;
+    for (i = 0; i < 2; i++) {
+        const uint32_t regs = GBA_REG_BG2PA + i * 0x10;
+        // 28-bit signed 20.8 fixed point
+        _gba_ppu_ref[i][0] = (int32_t)(gba_sm_read32(regs + 8) << 4) >> 4;
+        _gba_ppu_ref[i][1] = (int32_t)(gba_sm_read32(regs + 12) << 4) >> 4;
+    }
+}
+
+// and move by (PB, PD) every line
+static void _gba_ppu_advance_refs() {
+    int i;
+    for (i = 0; i < 2; i++) {
+        const uint32_t regs = GBA_REG_BG2PA + i * 0x10;
+        _gba_ppu_ref[i][0] += (int16_t)gba_sm_read16(regs + 2);
+        _gba_ppu_ref[i][1] += (int16_t)gba_sm_read16(regs + 6);
+    }
+}
+
+/*
+ *  OBJ sizes by shape (square, wide, tall) and size bits
+ */
+static const uint8_t _gba_ppu_obj_dims[3][4][2] = {
+    {{8, 8}, {16, 16}, {32, 32}, {64, 64}},
+    {{16, 8}, {32, 8}, {32, 16}, {64, 32}},
+    {{8, 16}, {8, 32}, {16, 32}, {32, 64}}
+};
+
+// Sprite size and on-screen box (double for double-size affine), 0 if hidden
+static uint8_t _gba_ppu_obj_box(uint16_t a0, uint16_t a1, int *w, int *h, int *bw, int *bh) {
+    const uint8_t shape = a0 >> 14;
+    if (shape == 3) return 0;
+    if (!(a0 & ATTR0_AFFINE) && (a0 & ATTR0_DOUBLE)) return 0;
+    *w = _gba_ppu_obj_dims[shape][a1 >> 14][0];
+    *h = _gba_ppu_obj_dims[shape][a1 >> 14][1];
+    *bw = (a0 & ATTR0_DOUBLE) ? *w * 2 : *w;
+    *bh = (a0 & ATTR0_DOUBLE) ? *h * 2 : *h;
+    return 1;
+}
+
+/*
+ *  Buckets sprites into the lines they cover, from line `from` down, in
+ *  OAM order until a line's cycle budget runs out: w cycles for a plain
+ *  sprite, 10 + 2 * box width for an affine one
+ */
+static void _gba_ppu_build_objs(uint16_t from, uint16_t budget) {
+    const uint16_t *oam = (const uint16_t *)gba_sm_region(GBA_OAM_BASE);
+    uint16_t spent[GBA_PPU_HEIGHT];
+    int i, r;
+
+    memset(&_gba_ppu_obj_count[from], 0, GBA_PPU_HEIGHT - from);
+    memset(spent, 0, sizeof(spent));
+    for (i = 0; i < OBJ_COUNT; i++) {
+        const uint16_t a0 = oam[i * 4], a1 = oam[i * 4 + 1];
+        int w, h, bw, bh, cost;
+        if (!_gba_ppu_obj_box(a0, a1, &w, &h, &bw, &bh)) continue;
+        cost = (a0 & ATTR0_AFFINE) ? 10 + 2 * bw : w;
+        for (r = 0; r < bh; r++) {
+            // Y is 8 bits, sprites near the bottom wrap to the top
+            const int ly = ((a0 & 0xFF) + r) & 0xFF;
+            if (ly < from || ly >= GBA_PPU_HEIGHT || spent[ly] > budget) continue;
+            if (spent[ly] + cost > budget) {
+                spent[ly] = budget + 1;     // out of cycles, later sprites drop
+                continue;
+            }
+            spent[ly] += cost;
+            _gba_ppu_obj_line[ly][_gba_ppu_obj_count[ly]++] = i;
+        }
+    }
+    _gba_ppu_obj_from = from;
+}
+
+// Palette index of a sprite texel, 0 for transparent
+static inline uint8_t _gba_ppu_obj_texel(const uint8_t *vram, uint16_t a0, uint16_t a2, int w,
+                                         int tx, int ty, uint8_t map1d, uint8_t bitmap) {
+    const uint8_t bpp8 = (a0 & ATTR0_8BPP) != 0;
+    const int step = bpp8 ? 2 : 1;
+    const int row = map1d ? (w >> 3) * step : 32;
+    const uint32_t tile = ((a2 & 0x3FF) + (ty >> 3) * row + (tx >> 3) * step) & 0x3FF;
+    const uint32_t addr = OBJ_TILES + tile * 32;
+    // bitmap modes keep the lower OBJ tiles for the frame
+    if (bitmap && addr < OBJ_BMP_TILES) return 0;
+    // 8bpp reads off the last tile wrap around OBJ VRAM
+    if (bpp8) return vram[OBJ_TILES + ((tile * 32 + (ty & 7) * 8 + (tx & 7)) & 0x7FFF)];
+    return (vram[addr + (ty & 7) * 4 + ((tx & 7) >> 1)] >> ((tx & 1) * 4)) & 0x0F;
+}
+
+/*
+ *  Draws the line's sprites into one OBJ line; per pixel the lowest
+ *  priority value wins, then the lower OAM index. Returns the set of
+ *  (priority, semi-transparent) classes that were drawn.
+ */
+static uint8_t _gba_ppu_render_objs(uint16_t y, uint16_t dispcnt) {
+    const uint8_t *vram = gba_sm_region(GBA_VRAM_BASE);
+    const uint16_t *oam = (const uint16_t *)gba_sm_region(GBA_OAM_BASE);
+    const uint16_t budget = (dispcnt & GBA_DISPCNT_HBLANK_FREE) ? OBJ_BUDGET_FREE : OBJ_BUDGET;
+    const uint32_t gen = gba_sm_oam_writes();
+    const uint8_t map1d = (dispcnt & GBA_DISPCNT_OBJ_1D) != 0;
+    const uint8_t bitmap = (dispcnt & GBA_DISPCNT_MODE) >= 3;
+    uint8_t used = 0;
+    int i, sx;
+
+    // OAM changed: lines already drawn this frame don't need the new lists
+    if (gen != _gba_ppu_obj_gen || budget != _gba_ppu_obj_budget) {
+        _gba_ppu_build_objs(y, budget);
+        _gba_ppu_obj_gen = gen;
+        _gba_ppu_obj_budget = budget;
+    }
+    else if (y < _gba_ppu_obj_from) {
+        _gba_ppu_build_objs(0, budget);
+    }
+
+    memset(_gba_ppu_obj_class, OBJ_NONE, sizeof(_gba_ppu_obj_class));
+    for (i = 0; i < _gba_ppu_obj_count[y]; i++) {
+        const uint16_t *attr = &oam[_gba_ppu_obj_line[y][i] * 4];
+        const uint16_t a0 = attr[0], a1 = attr[1], a2 = attr[2];
+        const uint8_t prio = (a2 >> 10) & 3;
+        const uint8_t cls = prio * 2 + ((a0 & ATTR0_MODE) == ATTR0_SEMI);
+        const uint16_t *pal = &_gba_ppu_lut[256 + ((a0 & ATTR0_8BPP) ? 0 : (a2 >> 12) * 16)];
+        const int row = (y - (a0 & 0xFF)) & 0xFF;
+        int x = a1 & 0x1FF, w, h, bw, bh;
+        int32_t pa = 0x100, pb = 0, pc = 0, pd = 0x100;
+
+        // OBJ window sprites only shape the window, which is not emulated
+        if ((a0 & ATTR0_MODE) >= ATTR0_WINDOW) continue;
+        _gba_ppu_obj_box(a0, a1, &w, &h, &bw, &bh);
+        if (x & 0x100) x -= 512;
+        if (a0 & ATTR0_AFFINE) {
+            // parameters are spread over the fourth halfword of 4 entries
+            const uint16_t *p = &oam[((a1 >> 9) & 0x1F) * 16 + 3];
+            pa = (int16_t)p[0];
+            pb = (int16_t)p[4];
+            pc = (int16_t)p[8];
+            pd = (int16_t)p[12];
+        }
+        for (sx = x < 0 ? -x : 0; sx < bw && x + sx < GBA_PPU_WIDTH; sx++) {
+            const int px = x + sx;
+            int tx, ty;
+            uint8_t c;
+            if (_gba_ppu_obj_class[px] != OBJ_NONE && (_gba_ppu_obj_class[px] >> 1) <= prio) continue;
+            if (a0 & ATTR0_AFFINE) {
+                const int dx = sx - bw / 2, dy = row - bh / 2;
+                tx = ((pa * dx + pb * dy) >> 8) + w / 2;
+                ty = ((pc * dx + pd * dy) >> 8) + h / 2;
+                if (tx < 0 || ty < 0 || tx >= w || ty >= h) continue;
+            }
+            else {
+                tx = (a1 & ATTR1_HFLIP) ? w - 1 - sx : sx;
+                ty = (a1 & ATTR1_VFLIP) ? h - 1 - row : row;
+            }
+            c = _gba_ppu_obj_texel(vram, a0, a2, w, tx, ty, map1d, bitmap);
+            if (!c) continue;
+            _gba_ppu_obj_px[px] = pal[c];
+            _gba_ppu_obj_class[px] = cls;
+            used |= 1 << cls;
+        }
+    }
+    return used;
+}
+
+// Splits the OBJ line into one layer per drawn class
+static void _gba_ppu_split_objs(uint8_t used) {
+    int cls, x;
+    for (cls = 0; cls < 8; cls++) {
+        if (!(used & (1 << cls))) continue;
+        for (x = 0; x < GBA_PPU_WIDTH; x++) {
+            _gba_ppu_obj[cls][x] = _gba_ppu_obj_class[x] == cls ? _gba_ppu_obj_px[x] : LAYER_CLEAR;
+        }
+    }
+}
+
+/*
+ *  Color effects on BGR555, channels stay within 0..31
+ */
+static inline uint16_t _gba_ppu_effect_px(const _gba_ppu_blend *bl, uint16_t a, uint16_t b, uint8_t mode) {
+    uint16_t out = 0;
+    int s;
+    for (s = 0; s < 15; s += 5) {
+        const int ca = (a >> s) & 31, cb = (b >> s) & 31;
+        int c;
+        if (mode == BLEND_ALPHA) c = (ca * bl->eva + cb * bl->evb) >> 4;
+        else if (mode == BLEND_LIGHTEN) c = ca + (((31 - ca) * bl->evy) >> 4);
+        else c = ca - ((ca * bl->evy) >> 4);
+        out |= (c > 31 ? 31 : c) << s;
+    }
+    return out;
+}
+
+/*
+ *  Semi-transparent sprites alpha blend onto any second target whatever
+ *  the BLDCNT effect, and then skip brighten/darken
+ */
+static void _gba_ppu_compose_px(uint16_t *dst, const _gba_ppu_layer *layers, int n,
+                                const _gba_ppu_blend *bl, int x0, int x1) {
+    int x, l;
+    for (x = x0; x < x1; x++) {
+        uint16_t top = 0, second = 0, top_t1 = 0, top_semi = 0, second_t2 = 0;
+        int found = 0;
+        for (l = 0; l < n && found < 2; l++) {
+            const uint16_t px = layers[l].px[x];
+            if (px & LAYER_CLEAR) continue;
+            if (found++ == 0) {
+                top = px;
+                top_t1 = layers[l].target & bl->first;
+                top_semi = layers[l].semi;
+            }
+            else {
+                second = px;
+                second_t2 = layers[l].target & bl->second;
+            }
+        }
+        if (second_t2 && (top_semi || (bl->mode == BLEND_ALPHA && top_t1))) top = _gba_ppu_effect_px(bl, top, second, BLEND_ALPHA);
+        else if (bl->mode >= BLEND_LIGHTEN && top_t1) top = _gba_ppu_effect_px(bl, top, 0, bl->mode);
+        dst[x] = top;
+    }
+}
+
+#if defined(GBA_PPU_SSE2)
+static inline __m128i _gba_ppu_alpha8(__m128i a, __m128i b, __m128i eva, __m128i evb) {
+    const __m128i ch = _mm_set1_epi16(31);
+    __m128i out = _mm_setzero_si128();
+    int s;
+    for (s = 0; s < 15; s += 5) {
+        const __m128i ca = _mm_and_si128(_mm_srli_epi16(a, s), ch);
+        const __m128i cb = _mm_and_si128(_mm_srli_epi16(b, s), ch);
+        const __m128i c = _mm_add_epi16(_mm_mullo_epi16(ca, eva), _mm_mullo_epi16(cb, evb));
+        out = _mm_or_si128(out, _mm_slli_epi16(_mm_min_epi16(_mm_srli_epi16(c, 4), ch), s));
+    }
+    return out;
+}
+
+static inline __m128i _gba_ppu_bright8(__m128i a, __m128i evy, uint8_t lighten) {
+    const __m128i ch = _mm_set1_epi16(31);
+    __m128i out = _mm_setzero_si128();
+    int s;
+    for (s = 0; s < 15; s += 5) {
+        const __m128i ca = _mm_and_si128(_mm_srli_epi16(a, s), ch);
+        const __m128i c = lighten ?
+            _mm_add_epi16(ca, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(ch, ca), evy), 4)) :
+            _mm_sub_epi16(ca, _mm_srli_epi16(_mm_mullo_epi16(ca, evy), 4));
+        out = _mm_or_si128(out, _mm_slli_epi16(c, s));
+    }
+    return out;
+}
+
+static inline __m128i _gba_ppu_select8(__m128i m, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+#elif defined(GBA_PPU_NEON)
+static inline uint16x8_t _gba_ppu_alpha8(uint16x8_t a, uint16x8_t b, uint16x8_t eva, uint16x8_t evb) {
+    const uint16x8_t ch = vdupq_n_u16(31);
+    const uint16x8_t r = vmlaq_u16(vmulq_u16(vandq_u16(a, ch), eva), vandq_u16(b, ch), evb);
+    const uint16x8_t g = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(a, 5), ch), eva),
+                                   vandq_u16(vshrq_n_u16(b, 5), ch), evb);
+    const uint16x8_t bl = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(a, 10), ch), eva),
+                                    vandq_u16(vshrq_n_u16(b, 10), ch), evb);
+    return vorrq_u16(vminq_u16(vshrq_n_u16(r, 4), ch),
+                     vorrq_u16(vshlq_n_u16(vminq_u16(vshrq_n_u16(g, 4), ch), 5),
+                               vshlq_n_u16(vminq_u16(vshrq_n_u16(bl, 4), ch), 10)));
+}
+
+static inline uint16x8_t _gba_ppu_bright8(uint16x8_t a, uint16x8_t evy, uint8_t lighten) {
+    const uint16x8_t ch = vdupq_n_u16(31);
+    const uint16x8_t r = vandq_u16(a, ch);
+    const uint16x8_t g = vandq_u16(vshrq_n_u16(a, 5), ch);
+    const uint16x8_t b = vandq_u16(vshrq_n_u16(a, 10), ch);
+    uint16x8_t r2, g2, b2;
+    if (lighten) {
+        r2 = vaddq_u16(r, vshrq_n_u16(vmulq_u16(vsubq_u16(ch, r), evy), 4));
+        g2 = vaddq_u16(g, vshrq_n_u16(vmulq_u16(vsubq_u16(ch, g), evy), 4));
+        b2 = vaddq_u16(b, vshrq_n_u16(vmulq_u16(vsubq_u16(ch, b), evy), 4));
+    }
+    else {
+        r2 = vsubq_u16(r, vshrq_n_u16(vmulq_u16(r, evy), 4));
+        g2 = vsubq_u16(g, vshrq_n_u16(vmulq_u16(g, evy), 4));
+        b2 = vsubq_u16(b, vshrq_n_u16(vmulq_u16(b, evy), 4));
+    }
+    return vorrq_u16(r2, vorrq_u16(vshlq_n_u16(g2, 5), vshlq_n_u16(b2, 10)));
+}
+#endif
+
+/*
+ *  Priority composition and color effects, 8 lanes at a time. Layers
+ *  come sorted front to back with the backdrop last, so every lane has a
+ *  top pixel; the second one only matters for alpha blending.
+ */
+static void _gba_ppu_compose(uint16_t *dst, const _gba_ppu_layer *layers, int n,
+                             const _gba_ppu_blend *bl) {
+    int x = 0, l, semi = 0;
+    for (l = 0; l < n; l++) semi |= layers[l].semi;
+#if defined(GBA_PPU_SSE2)
+    const __m128i clear = _mm_set1_epi16(LAYER_CLEAR), zero = _mm_setzero_si128();
+    const __m128i eva = _mm_set1_epi16(bl->eva), evb = _mm_set1_epi16(bl->evb), evy = _mm_set1_epi16(bl->evy);
+    for (; x + 8 <= GBA_PPU_WIDTH; x += 8) {
+        __m128i top = zero, second = zero, top_t1 = zero, top_semi = zero, second_t2 = zero;
+        __m128i top_set = zero, second_set = zero, m_alpha, out;
+        for (l = 0; l < n; l++) {
+            const __m128i px = _mm_loadu_si128((const __m128i *)&layers[l].px[x]);
+            const __m128i opaque = _mm_cmpeq_epi16(_mm_and_si128(px, clear), zero);
+            const __m128i take_top = _mm_andnot_si128(top_set, opaque);
+            const __m128i take_second = _mm_andnot_si128(second_set, _mm_and_si128(opaque, top_set));
+            top = _gba_ppu_select8(take_top, px, top);
+            second = _gba_ppu_select8(take_second, px, second);
+            if (layers[l].target & bl->first) top_t1 = _mm_or_si128(top_t1, take_top);
+            if (layers[l].semi) top_semi = _mm_or_si128(top_semi, take_top);
+            if (layers[l].target & bl->second) second_t2 = _mm_or_si128(second_t2, take_second);
+            top_set = _mm_or_si128(top_set, opaque);
+            second_set = _mm_or_si128(second_set, take_second);
+        }
+        out = top;
+        m_alpha = _mm_and_si128(bl->mode == BLEND_ALPHA ? _mm_or_si128(top_t1, top_semi) : top_semi, second_t2);
+        if (bl->mode >= BLEND_LIGHTEN) {
+            out = _gba_ppu_select8(_mm_andnot_si128(m_alpha, top_t1),
+                                   _gba_ppu_bright8(top, evy, bl->mode == BLEND_LIGHTEN), out);
+        }
+        if (bl->mode == BLEND_ALPHA || semi) {
+            out = _gba_ppu_select8(m_alpha, _gba_ppu_alpha8(top, second, eva, evb), out);
+        }
+        _mm_storeu_si128((__m128i *)&dst[x], out);
+    }
+#elif defined(GBA_PPU_NEON)
+    const uint16x8_t clear = vdupq_n_u16(LAYER_CLEAR), zero = vdupq_n_u16(0);
+    const uint16x8_t eva = vdupq_n_u16(bl->eva), evb = vdupq_n_u16(bl->evb), evy = vdupq_n_u16(bl->evy);
+    for (; x + 8 <= GBA_PPU_WIDTH; x += 8) {
+        uint16x8_t top = zero, second = zero, top_t1 = zero, top_semi = zero, second_t2 = zero;
+        uint16x8_t top_set = zero, second_set = zero, m_alpha, out;
+        for (l = 0; l < n; l++) {
+            const uint16x8_t px = vld1q_u16(&layers[l].px[x]);
+            const uint16x8_t opaque = vceqq_u16(vandq_u16(px, clear), zero);
+            const uint16x8_t take_top = vbicq_u16(opaque, top_set);
+            const uint16x8_t take_second = vbicq_u16(vandq_u16(opaque, top_set), second_set);
+            top = vbslq_u16(take_top, px, top);
+            second = vbslq_u16(take_second, px, second);
+            if (layers[l].target & bl->first) top_t1 = vorrq_u16(top_t1, take_top);
+            if (layers[l].semi) top_semi = vorrq_u16(top_semi, take_top);
+            if (layers[l].target & bl->second) second_t2 = vorrq_u16(second_t2, take_second);
+            top_set = vorrq_u16(top_set, opaque);
+            second_set = vorrq_u16(second_set, take_second);
+        }
+        out = top;
+        m_alpha = vandq_u16(bl->mode == BLEND_ALPHA ? vorrq_u16(top_t1, top_semi) : top_semi, second_t2);
+        if (bl->mode >= BLEND_LIGHTEN) {
+            out = vbslq_u16(vbicq_u16(top_t1, m_alpha),
+                            _gba_ppu_bright8(top, evy, bl->mode == BLEND_LIGHTEN), out);
+        }
+        if (bl->mode == BLEND_ALPHA || semi) {
+            out = vbslq_u16(m_alpha, _gba_ppu_alpha8(top, second, eva, evb), out);
+        }
+        vst1q_u16(&dst[x], out);
+    }
+#endif
+    _gba_ppu_compose_px(dst, layers, n, bl, x, GBA_PPU_WIDTH);
+}
+
+static void _gba_ppu_read_blend(_gba_ppu_blend *bl) {
+    const uint16_t cnt = gba_sm_read16(GBA_REG_BLDCNT);
+    const uint16_t alpha = gba_sm_read16(GBA_REG_BLDALPHA);
+    const uint16_t evy = gba_sm_read16(GBA_REG_BLDY) & 0x1F;
+    bl->mode = (cnt >> 6) & 3;
+    bl->first = cnt & 0x3F;
+    bl->second = (cnt >> 8) & 0x3F;
+    // coefficients are 1.4 fixed point, anything above 16 acts as 16
+    bl->eva = (alpha & 0x1F) > 16 ? 16 : alpha & 0x1F;
+    bl->evb = ((alpha >> 8) & 0x1F) > 16 ? 16 : (alpha >> 8) & 0x1F;
+    bl->evy = evy > 16 ? 16 : evy;
+}
+
+/*
+ *  Draws the line's backgrounds and sprites into layers, front to back:
+ *  per priority the sprites come first, then the BGs by number, and the
+ *  backdrop goes last
+ */
+static int _gba_ppu_gather_layers(uint16_t y, uint16_t dispcnt, _gba_ppu_layer *layers) {
+    const uint8_t mode = dispcnt & GBA_DISPCNT_MODE;
+    const uint8_t used = (dispcnt & GBA_DISPCNT_OBJ) ? _gba_ppu_render_objs(y, dispcnt) : 0;
+    uint8_t prio[4];
+    int n = 0, bg, p, cls;
+
+    _gba_ppu_split_objs(used);
+    for (bg = 0; bg < 4; bg++) {
+        prio[bg] = 0xFF;
+        if (!(dispcnt & (GBA_DISPCNT_BG0 << bg)) || !((BG_IN_MODE >> (mode * 4)) & (1 << bg))) continue;
+        if (mode >= 3) _gba_ppu_render_bitmap(_gba_ppu_bg[bg], y, dispcnt, 1);
+        else if (mode == 0 || bg < 2) _gba_ppu_render_text(_gba_ppu_bg[bg], bg, y);
+        else _gba_ppu_render_affine(_gba_ppu_bg[bg], bg);
+        prio[bg] = gba_sm_read16(GBA_REG_BG0CNT + 2 * bg) & 3;
+    }
+    for (p = 0; p < 4; p++) {
+        for (cls = p * 2; cls < p * 2 + 2; cls++) {
+            if (!(used & (1 << cls))) continue;
+            layers[n].px = _gba_ppu_obj[cls];
+            layers[n].target = TARGET_OBJ;
+            layers[n].semi = cls & 1;
+            n++;
+        }
+        for (bg = 0; bg < 4; bg++) {
+            if (prio[bg] != p) continue;
+            layers[n].px = _gba_ppu_bg[bg];
+            layers[n].target = 1 << bg;
+            layers[n].semi = 0;
+            n++;
+        }
+    }
+    _gba_ppu_fill(_gba_ppu_backdrop, GBA_PPU_WIDTH, _gba_ppu_lut[0]);
+    layers[n].px = _gba_ppu_backdrop;
+    layers[n].target = TARGET_BD;
+    layers[n].semi = 0;
+    return n + 1;
+}
+
+static void _gba_ppu_draw_line(uint16_t y) {
+    const uint64_t start = _gba_ppu_profiling ? _gba_ppu_now_ns() : 0;
+    const uint16_t dispcnt = gba_sm_read16(GBA_REG_DISPCNT);
+    _gba_ppu_layer layers[13];
+    _gba_ppu_blend blend;
+    uint16_t *dst;
+
+    if (y == 0) {
+        _gba_ppu_fb = _gba_ppu_next;
+        _gba_ppu_latch_refs();
+    }
+    dst = _gba_ppu_fb + y * GBA_PPU_WIDTH;
+
+    _gba_ppu_update_lut();
+    _gba_ppu_read_blend(&blend);
+    if (dispcnt & GBA_DISPCNT_BLANK) {
+        _gba_ppu_fill(dst, GBA_PPU_WIDTH, 0x7FFF);
+    }
+    else if ((dispcnt & GBA_DISPCNT_MODE) >= 3 && blend.mode == BLEND_NONE &&
+             !(dispcnt & GBA_DISPCNT_OBJ)) {
+        // a lone bitmap is just a copy
+        _gba_ppu_render_bitmap(dst, y, dispcnt, 0);
+    }
+    else {
+        _gba_ppu_compose(dst, layers, _gba_ppu_gather_layers(y, dispcnt, layers), &blend);
+    }
+    _gba_ppu_advance_refs();
+    _gba_ppu_stats.lines_rendered++;
+
+    if (_gba_ppu_profiling) {
+        _gba_ppu_stats.render_ns += _gba_ppu_now_ns() - start;
+    }
+}
+
+// Mirrors the line state into DISPSTAT/VCOUNT and raises the enabled IRQs
+static void _gba_ppu_set_stat(uint16_t flags) {
+    const uint16_t stat = gba_sm_read16(GBA_REG_DISPSTAT);
+    const uint16_t on = flags & ~stat;
+    uint16_t req = 0;
+
+    gba_sm_write16(GBA_REG_DISPSTAT, (stat & ~0x0007) | flags);
+    if ((on & DISPSTAT_VBLANK) && (stat & DISPSTAT_VBLANK_IRQ)) req |= GBA_INT_VBLANK;
+    if ((on & DISPSTAT_HBLANK) && (stat & DISPSTAT_HBLANK_IRQ)) req |= GBA_INT_HBLANK;
+    if ((on & DISPSTAT_VCOUNT) && (stat & DISPSTAT_VCOUNT_IRQ)) req |= GBA_INT_VCOUNT;
+    if (req) gba_sm_request_irq(req);
+}
+
+static uint16_t _gba_ppu_line_flags(uint8_t hblank) {
+    const uint16_t stat = gba_sm_read16(GBA_REG_DISPSTAT);
+    uint16_t flags = hblank ? DISPSTAT_HBLANK : 0;
+    // VBlank reads set on lines 160-226
+    if (_gba_ppu_vcount >= GBA_PPU_HEIGHT && _gba_ppu_vcount < GBA_PPU_LINES - 1) flags |= DISPSTAT_VBLANK;
+    if ((stat >> 8) == _gba_ppu_vcount) flags |= DISPSTAT_VCOUNT;
+    return flags;
+}
+
+///////**** Public ****///////
+
+void gba_ppu_reset() {
+    memset(_gba_ppu_next, 0xFF, GBA_PPU_WIDTH * GBA_PPU_HEIGHT * sizeof(uint16_t));
+    _gba_ppu_fb = _gba_ppu_next;
+    _gba_ppu_dot = 0;
+    _gba_ppu_vcount = 0;
+    _gba_ppu_line_drawn = 0;
+    _gba_ppu_lut_valid = 0;
+    _gba_ppu_obj_from = GBA_PPU_HEIGHT;
+    _gba_ppu_skipping = _gba_ppu_skip;
+    gba_sm_write16(GBA_REG_VCOUNT, 0);
+}
+
+uint8_t gba_ppu_step(uint32_t cycles) {
+    uint8_t vblank = 0;
+
+    _gba_ppu_dot += cycles;
+    for (;;) {
+        if (!_gba_ppu_line_drawn && _gba_ppu_dot >= GBA_PPU_HDRAW_CYCLES) {
+            if (_gba_ppu_vcount < GBA_PPU_HEIGHT && !_gba_ppu_skipping) {
+                _gba_ppu_draw_line(_gba_ppu_vcount);
+            }
+            _gba_ppu_line_drawn = 1;
+            _gba_ppu_set_stat(_gba_ppu_line_flags(1));
+        }
+        if (_gba_ppu_dot < GBA_PPU_LINE_CYCLES) break;
+
+        _gba_ppu_dot -= GBA_PPU_LINE_CYCLES;
+        _gba_ppu_line_drawn = 0;
+        if (++_gba_ppu_vcount == GBA_PPU_LINES) {
+            _gba_ppu_vcount = 0;
+            _gba_ppu_skipping = _gba_ppu_skip;
+            if (_gba_ppu_skipping) _gba_ppu_stats.frames_skipped++;
+        }
+        if (_gba_ppu_vcount == GBA_PPU_HEIGHT) {
+            vblank = 1;
+            _gba_ppu_stats.frames++;
+        }
+        gba_sm_write16(GBA_REG_VCOUNT, _gba_ppu_vcount);
+        _gba_ppu_set_stat(_gba_ppu_line_flags(0));
+    }
+    return vblank;
+}
+
+const uint16_t *gba_ppu_get_framebuffer() {
+    return _gba_ppu_fb;
+}
+
+// Renders following frames into fb (GBA_PPU_WIDTH * GBA_PPU_HEIGHT), NULL for the PPU's own
+void gba_ppu_set_framebuffer(uint16_t *fb) {
+    _gba_ppu_next = fb ? fb : _gba_ppu_own_fb;
+}
+
+// Frames starting while skip is set keep DISPSTAT, VCOUNT and IRQs but draw nothing
+void gba_ppu_set_skip(uint8_t skip) {
+    _gba_ppu_skip = skip;
+}
+
+void gba_ppu_set_profiling(uint8_t on) {
+    _gba_ppu_profiling = on;
+}
+
+void gba_ppu_get_stats(gba_ppu_stats *out) {
+    *out = _gba_ppu_stats;
+}
+
+void gba_ppu_reset_stats() {
+    memset(&_gba_ppu_stats, 0, sizeof(_gba_ppu_stats));
+}
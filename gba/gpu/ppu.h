@@ -0,0 +1,76 @@
+//
+//  ppu.h
+//  CGBA
+//
+
+/*
+ * GBA picture processing unit
+ * - scanline renderer, each visible line is drawn when it enters HBlank
+ * - output is a 240x160 BGR555 framebuffer, the format of palette RAM
+ * - bitmap modes 3-5 read VRAM directly, mode 3/5 lines are a masked
+ *   vector copy and mode 4 goes through a cached palette LUT
+ * - modes 0-2 draw text (4bpp/8bpp, all screen sizes) and affine
+ *   backgrounds into per-layer lines, bit 15 marking transparency
+ * - layers are composed by priority and blended (BLDCNT/BLDALPHA/BLDY)
+ *   8 pixels at a time with SSE2 or NEON
+ * - sprites (plain and affine, 1D/2D tile mapping, semi-transparent)
+ *   come from per-line lists rebuilt only after OAM writes, within the
+ *   hardware's per-line OBJ cycle budget
+ * - not emulated yet: windows, mosaic, mid-frame BGxX/Y reloads
+ */
+
+#ifndef __CGBA__gba_ppu__
+#define __CGBA__gba_ppu__
+
+#include <inttypes.h>
+
+#define GBA_PPU_WIDTH  240
+#define GBA_PPU_HEIGHT 160
+#define GBA_PPU_LINES  228
+
+// timing in CPU cycles
+#define GBA_PPU_HDRAW_CYCLES 960
+#define GBA_PPU_LINE_CYCLES  1232
+#define GBA_PPU_FRAME_CYCLES (GBA_PPU_LINE_CYCLES * GBA_PPU_LINES)
+
+// LCD registers
+#define GBA_REG_DISPCNT  0x04000000
+#define GBA_REG_DISPSTAT 0x04000004
+#define GBA_REG_VCOUNT   0x04000006
+#define GBA_REG_BG0CNT   0x04000008     // BGnCNT at +2n
+#define GBA_REG_BG0HOFS  0x04000010     // BGnHOFS/VOFS at +4n
+#define GBA_REG_BG2PA    0x04000020     // BG2 PA PB PC PD X Y, BG3 at +0x10
+#define GBA_REG_BLDCNT   0x04000050
+#define GBA_REG_BLDALPHA 0x04000052
+#define GBA_REG_BLDY     0x04000054
+
+// DISPCNT bits
+#define GBA_DISPCNT_MODE   0x0007
+#define GBA_DISPCNT_PAGE   0x0010
+#define GBA_DISPCNT_HBLANK_FREE 0x0020
+#define GBA_DISPCNT_OBJ_1D 0x0040
+#define GBA_DISPCNT_BLANK  0x0080
+#define GBA_DISPCNT_BG0    0x0100
+#define GBA_DISPCNT_BG2    0x0400
+#define GBA_DISPCNT_OBJ    0x1000
+
+struct gba_ppu_stats {
+    uint64_t frames;
+    uint64_t lines_rendered;
+    uint64_t frames_skipped;   // not drawn at all, see gba_ppu_set_skip
+    uint64_t render_ns;        // line work, only counted while profiling
+};
+typedef struct gba_ppu_stats gba_ppu_stats;
+
+void gba_ppu_reset();
+uint8_t gba_ppu_step(uint32_t cycles);   // returns TRUE when VBlank starts
+
+const uint16_t *gba_ppu_get_framebuffer();
+void gba_ppu_set_framebuffer(uint16_t *fb);
+void gba_ppu_set_skip(uint8_t skip);
+
+void gba_ppu_set_profiling(uint8_t on);
+void gba_ppu_get_stats(gba_ppu_stats *out);
+void gba_ppu_reset_stats();
+
+#endif /* defined(__CGBA__gba_ppu__) */
@@ -7,8 +7,15 @@
 //
 
 #include "sdl_server.h"
+#include "ppu.h"
+#include "../cpu/memorymodule.h"
+#include "../../host/triplebuffer.h"
+#include "../../host/pacer.h"
+#include "../../host/overlay.h"
+#include "../../host/scaler.h"
+#include "../../host/frameskip.h"
+#include <stdlib.h>
 #include <SDL2/SDL.h>
-#include <SDL2_ttf/SDL_ttf.h>
 
 // GBA screen ratio 3:2
 #define VP_WIDTH 536
@@ -18,67 +25,165 @@
 #define false 0
 typedef unsigned int bool;
 
-#define GBA_V_WIDTH   240
-#define GBA_V_HEIGHT  160
-#define GBA_V_FWIDTH  240.f
-#define GBA_V_FHEIGHT 160.f
-
 #define GBA_C_WHITE 0x7FFF
 
-// GBA 15-bit color scheme
-// BBBBBGGGGGRRRRR
-#define COLOR_MAP 255.f/31.f
-
-// GBA pixel array 240x160
-void gba_plot_pixel(SDL_Renderer *renderer, Uint32 x, Uint32 y, Uint16 color) {
-    const Uint8 red =   ((color >> 0 ) & 0b11111)* COLOR_MAP;
-    const Uint8 green = ((color >> 5 ) & 0b11111)* COLOR_MAP;
-    const Uint8 blue =  ((color >> 10) & 0b11111)* COLOR_MAP;
-    const float w_ratio = ((float)VP_WIDTH / GBA_V_FWIDTH);
-    const float h_ratio = ((float)VP_HEIGHT / GBA_V_FHEIGHT);
-    const Uint32 adjx = h_ratio*x;
-    const Uint32 adjy = w_ratio*y;
-    SDL_Rect r = {adjx,adjy,h_ratio,h_ratio};
-    SDL_SetRenderDrawColor(renderer, red, green, blue, 255);
-    SDL_RenderFillRect(renderer, &r);
-}
+// frames between frame-time percentile updates
+#define GBA_REPORT_FRAMES 30
+
+#define GBA_OVERLAY_PT 12
 
 void gba_screen_boilerplate(SDL_Renderer *renderer) {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
     SDL_RenderClear(renderer);
 }
 
-void gba_fps_render(SDL_Renderer *renderer, Uint32 proctimestart, SDL_Surface *m_surface, TTF_Font *sans) {
-    SDL_Color white = {255,255,255,255};
-    const Uint32 proctime = SDL_GetTicks() - proctimestart;
-    float delay = 16.666 - proctime;
-    if (delay < 0) {
-        delay = 0;
+/*
+ *  Emulation costs, per-frame averages over the report window
+ */
+struct gba_perf {
+    pacer_report timing;
+    float emu_ms;
+    float ppu_ms;
+    unsigned int every;     // fast-forward shows one frame in this many, 0 when off
+};
+typedef struct gba_perf gba_perf;
+
+/*
+ *  One published frame
+ */
+struct gba_frame {
+    uint16_t pixels[GBA_PPU_WIDTH * GBA_PPU_HEIGHT];
+    gba_perf perf;
+};
+typedef struct gba_frame gba_frame;
+
+/*
+ *  State shared by the SDL thread and the emulation thread
+ */
+struct gba_emu {
+    triplebuffer frames;
+    atomic_int done;
+    atomic_int fast;        // fast-forward while set
+};
+typedef struct gba_emu gba_emu;
+
+/*
+ *  Screen texture at the scaler's output size, drawn 1:1 in the middle
+ *  of the viewport
+ */
+struct gba_view {
+    scaler scale;
+    int fit;
+    SDL_Texture *screen;
+    SDL_Rect rect;
+    uint16_t scaled[GBA_PPU_WIDTH * GBA_PPU_HEIGHT * SC_MAX_FACTOR * SC_MAX_FACTOR];
+};
+typedef struct gba_view gba_view;
+
+// (Re)creates the screen texture for the view's scaler
+int gba_view_apply(gba_view *view, SDL_Renderer *renderer) {
+    const int w = GBA_PPU_WIDTH * view->scale.factor, h = GBA_PPU_HEIGHT * view->scale.factor;
+    if (view->screen) SDL_DestroyTexture(view->screen);
+    view->screen = SDL_CreateTexture(renderer,
+                                     SDL_PIXELFORMAT_BGR555,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     w,
+                                     h);
+    view->rect.x = (VP_WIDTH - w) / 2;
+    view->rect.y = (VP_HEIGHT - h) / 2;
+    view->rect.w = w;
+    view->rect.h = h;
+    return view->screen ? 0 : -1;
+}
+
+void gba_upload_frame(gba_view *view, const gba_frame *frame) {
+    sc_run(&view->scale, frame->pixels, GBA_PPU_WIDTH, GBA_PPU_HEIGHT, view->scaled, 0, GBA_PPU_HEIGHT);
+    SDL_UpdateTexture(view->screen, NULL, view->scaled,
+                      GBA_PPU_WIDTH * view->scale.factor * sizeof(Uint16));
+}
+
+void gba_fps_render(SDL_Renderer *renderer, const overlay *ov, const gba_frame *frame,
+                    const gba_view *view, float upload_ms) {
+    const pacer_report *t = &frame->perf.timing;
+    char displaystring[192], ff[32] = "";
+    if (frame->perf.every) snprintf(ff, sizeof(ff), "\nfast-forward 1/%u", frame->perf.every);
+    snprintf(displaystring, sizeof(displaystring),
+             "%.2f FPS %.0f%%\nframe %.2f p99 %.2f ms\nemu %.2f ppu %.2f upload %.2f ms\n%s %s%s",
+             t->fps, t->fps * 100 / PACER_GBA_HZ, t->p50_ms, t->p99_ms,
+             frame->perf.emu_ms, frame->perf.ppu_ms, upload_ms,
+             sc_name(&view->scale), sc_isa(), ff);
+    ov_text(ov, renderer, 4, 4, displaystring);
+}
+
+/*
+ *  Emulation runs here, never waiting on the renderer. Fast-forward drops
+ *  the frame cap and only draws and publishes the frames the frame skipper
+ *  picks, about one per refresh.
+ */
+int gba_emu_thread(void *data) {
+    gba_emu *emu = data;
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    pacer pace;
+    frameskip skip;
+    bool fast = false;
+    gba_perf perf = {{0}};
+    gba_ppu_stats ppu;
+    Uint64 emu_ticks = 0;
+    uint64_t render_ns = 0;
+    unsigned int frame = 0;
+    
+    gba_ppu_set_profiling(true);
+    gba_ppu_get_stats(&ppu);
+    render_ns = ppu.render_ns;
+    pacer_init(&pace, PACER_GBA_HZ);
+    while (!atomic_load(&emu->done)) {
+        const Uint64 start = SDL_GetPerformanceCounter();
+        gba_frame *slot = tb_back(&emu->frames);
+        bool show;
+        
+        if (atomic_load(&emu->fast) != (int)fast) {
+            fast = !fast;
+            fs_init(&skip, PACER_GBA_HZ);
+            if (!fast) pacer_resync(&pace);
+        }
+        show = !fast || fs_show_next(&skip);
+        
+        /* Emulate up to VBlank, the PPU draws straight into the slot */
+        gba_ppu_set_skip(!show);
+        gba_ppu_set_framebuffer(slot->pixels);
+        while (!gba_ppu_step(GBA_PPU_LINE_CYCLES));
+        
+        const Uint64 ticks = SDL_GetPerformanceCounter() - start;
+        emu_ticks += ticks;
+        if (show) {
+            perf.every = fast ? skip.every : 0;
+            slot->perf = perf;
+            tb_publish(&emu->frames);
+        }
+        
+        if (fast) {
+            fs_frame_done(&skip, ticks * ms);
+            pacer_mark(&pace);
+        }
+        else {
+            pacer_wait(&pace);
+        }
+        if (++frame % GBA_REPORT_FRAMES == 0) {
+            gba_ppu_get_stats(&ppu);
+            pacer_report_get(&pace, &perf.timing);
+            perf.ppu_ms = (ppu.render_ns - render_ns) / 1e6 / GBA_REPORT_FRAMES;
+            perf.emu_ms = emu_ticks * ms / GBA_REPORT_FRAMES - perf.ppu_ms;
+            render_ns = ppu.render_ns;
+            emu_ticks = 0;
+        }
     }
-    SDL_Delay(delay);
-    float fps = 1000/delay;
-    char displaystring[50];
-    snprintf(displaystring, 50, "%f FPS", fps);
-    m_surface = TTF_RenderText_Solid(sans, displaystring, white);
-    SDL_Texture *m = SDL_CreateTextureFromSurface(renderer, m_surface);
-    SDL_Rect m_r = {0,0,100,20};
-    SDL_RenderCopy(renderer, m, NULL, &m_r);
-    SDL_FreeSurface(m_surface);
-    SDL_DestroyTexture(m);
+    return 0;
 }
 
 void gba_srv_initialize() {
     // Init var decl
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
-    TTF_Init();
-    TTF_Font *sans = TTF_OpenFont("/Library/Fonts/Osaka.ttf", 24);
-    if (!sans) {
-        printf("TTF_OpenFont: %s\n", TTF_GetError());
-        return;
-    }
-    SDL_Surface *fps_surface;
-    
     // Init vars
     SDL_Init(SDL_INIT_VIDEO);
     window = SDL_CreateWindow(
@@ -92,26 +197,75 @@ void gba_srv_initialize() {
     
     printf("%i, %i", VP_HEIGHT, VP_WIDTH);
     
-    renderer = SDL_CreateRenderer(window, 0, 0);
+    // presents block on vsync, never on emulation
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
     
     if (window == NULL) {
         printf("SDL Renderer not created");
         return;
     }
     
-    // main loop
-    bool done = false;
+    overlay ov;
+    ov_init(&ov, renderer, GBA_OVERLAY_PT);
+    
+    // integer scaling in software, largest that fits unless CGBA_SCALER says otherwise
+    gba_view *view = calloc(1, sizeof(gba_view));
+    if (view == NULL) {
+        printf("Screen buffer not allocated");
+        return;
+    }
+    const char *scaler_env = getenv("CGBA_SCALER");
+    view->fit = sc_fit(GBA_PPU_WIDTH, GBA_PPU_HEIGHT, VP_WIDTH, VP_HEIGHT);
+    view->scale.kind = SC_NEAREST;
+    view->scale.factor = view->fit;
+    if (scaler_env && sc_parse(&view->scale, scaler_env) == 0 && view->scale.factor > view->fit) {
+        view->scale.kind = SC_NEAREST;
+        view->scale.factor = view->fit;
+    }
+    if (gba_view_apply(view, renderer)) {
+        printf("Screen texture not created");
+        return;
+    }
+    
+    gba_emu emu;
+    if (tb_init(&emu.frames, sizeof(gba_frame))) {
+        printf("Frame buffers not allocated");
+        return;
+    }
+    atomic_init(&emu.done, false);
+    atomic_init(&emu.fast, false);
+    gba_sm_reset();
+    gba_ppu_reset();
+    SDL_Thread *emu_thread = SDL_CreateThread(gba_emu_thread, "emulation", &emu);
+    
+    // main loop, presents the newest frame and handles input
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    float upload_ms = 0;
+    bool done = false, rescaled = false;
     while (!done) {
-        const Uint32 proctimestart = SDL_GetTicks();
+        const gba_frame *frame = tb_front(&emu.frames);
+        
+        /* Pick up the newest frame */
+        if (tb_acquire(&emu.frames) || rescaled) {
+            const Uint64 start = SDL_GetPerformanceCounter();
+            frame = tb_front(&emu.frames);
+            gba_upload_frame(view, frame);
+            rescaled = false;
+            upload_ms += ((SDL_GetPerformanceCounter() - start) * ms - upload_ms) / GBA_REPORT_FRAMES;
+        }
+        else {
+            // without vsync, do not spin while waiting on emulation
+            SDL_Delay(1);
+        }
         
         /* Render VBlank */
         gba_screen_boilerplate(renderer);
         
         /* Render space */
-        
+        SDL_RenderCopy(renderer, view->screen, NULL, &view->rect);
         
         /* FPS overlay */
-        gba_fps_render(renderer, proctimestart, fps_surface, sans);
+        gba_fps_render(renderer, &ov, frame, view, upload_ms);
         
         SDL_RenderPresent(renderer);
         
@@ -121,15 +275,37 @@ void gba_srv_initialize() {
                 case SDL_QUIT:
                     done = true;
                     break;
+                case SDL_KEYDOWN:
+                    // Tab cycles the scalers, holding Space fast-forwards
+                    if (event.key.keysym.sym == SDLK_TAB) {
+                        sc_next(&view->scale, view->fit);
+                        if (gba_view_apply(view, renderer)) done = true;
+                        rescaled = true;
+                    }
+                    else if (event.key.keysym.sym == SDLK_SPACE) {
+                        atomic_store(&emu.fast, true);
+                    }
+                    break;
+                case SDL_KEYUP:
+                    if (event.key.keysym.sym == SDLK_SPACE) {
+                        atomic_store(&emu.fast, false);
+                    }
+                    break;
                 default:
                     break;
             }
         }
     }
     
-    free(sans);
+    atomic_store(&emu.done, true);
+    SDL_WaitThread(emu_thread, NULL);
+    tb_free(&emu.frames);
+    
+    ov_free(&ov);
+    SDL_DestroyTexture(view->screen);
+    free(view);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     
     SDL_Quit();
-}
\ No newline at end of file
+}
@@ -0,0 +1,872 @@
+//
+//  headless.c
+//  CGBA
+//
+
+/*
+ * Headless frontend, runs the DMG core into its in-memory framebuffer
+ * with no display, audio or font dependencies
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include "gb/cpu/memorymodule.h"
+#include "gb/system.h"
+#include "gb/gpu/ppu.h"
+#include "gb/apu/apu.h"
+#include "gb/state.h"
+#include "gb/input/joypad.h"
+#include "host/videoout.h"
+#include "host/shmring.h"
+#include "host/scaler.h"
+#include "host/statefile.h"
+#include "host/rewind.h"
+#include "host/audioring.h"
+#include "host/batch.h"
+
+#define SHM_SLOTS 8
+
+// scaler benchmark iterations per kernel
+#define BENCH_REPS 2000
+// frames replayed across a save and load, and where the save is
+#define BENCH_REPLAY      1000
+#define BENCH_REPLAY_SAVE 400
+// children forked from one state
+#define BENCH_FORKS 1000
+// frames sent through a small ring between two threads
+#define BENCH_RING_FRAMES (1 << 22)
+#define BENCH_RING_SIZE   256
+// children scribbling over all of RAM, and the frames the parent runs after
+#define BENCH_SCRIBBLERS 50
+#define BENCH_SCRIBBLE_FRAMES 60
+// machines stepped together, and the frames they run
+#define BENCH_MACHINES 256
+#define BENCH_BATCHES  10
+// pool sizes checked, and the machines and steps each runs
+#define BENCH_SWEEP_WORKERS  7
+#define BENCH_SWEEP_MACHINES 24
+#define BENCH_SWEEP_STEPS    4
+
+// rewind history limit for --rewind
+#define REWIND_BYTES (64 << 20)
+
+#define AUDIO_HZ     48000
+#define AUDIO_FRAMES 1024
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [options] rom.gb\n"
+            "  -n, --frames N     frames to run (default 60)\n"
+            "  -o, --output FILE  write the last frame as PPM, - for stdout\n"
+            "  -v, --video FILE   stream every frame to a file, FIFO or - for stdout\n"
+            "  -f, --format FMT   video format, y4m (default) or rgb\n"
+            "  -s, --shm NAME     render into a POSIX shared-memory frame ring\n"
+            "  -x, --scale NAME   upscale PPM and video output, 1x-4x or scale2x\n"
+            "  -b, --bench        time every scaler on the last frame, snapshots and batches\n"
+            "  -d, --dot          dot-accurate PPU (pixel FIFO) instead of the fast one\n"
+            "  -a, --audio FILE   write the sound as a 48 kHz stereo WAV file\n"
+            "  -L, --load FILE    start from a snapshot, mapped ones run on the file's memory\n"
+            "  -S, --save FILE    write a snapshot after the last frame\n"
+            "  -M, --save-mapped FILE  same as a page-aligned file that loads by mmap\n"
+            "  -r, --rewind N     record a rewind history, step back N frames and check running them again ends the same\n"
+            "  -A, --run-ahead N  output the frame N ahead of the machine, which then steps back\n"
+            "  -q, --quiet        no summary on stderr\n",
+            argv0);
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// BGR555 framebuffer to binary PPM
+static int write_ppm(const char *path, const uint16_t *fb, int width, int height) {
+    FILE *f = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    uint8_t *row = malloc(width * 3);
+    int x, y;
+
+    if (!f || !row) {
+        fprintf(stderr, "Could not open %s\n", path);
+        if (f && f != stdout) fclose(f);
+        free(row);
+        return -1;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            const uint16_t c = fb[y * width + x];
+            const uint8_t r = c & 0x1F, g = (c >> 5) & 0x1F, b = (c >> 10) & 0x1F;
+            row[x * 3 + 0] = (r << 3) | (r >> 2);
+            row[x * 3 + 1] = (g << 3) | (g >> 2);
+            row[x * 3 + 2] = (b << 3) | (b >> 2);
+        }
+        fwrite(row, 1, width * 3, f);
+    }
+    if (f != stdout) fclose(f);
+    else fflush(f);
+    free(row);
+    return 0;
+}
+
+static void put_le(uint8_t *p, uint32_t v, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++) p[i] = v >> (8 * i);
+}
+
+// 16-bit stereo WAV header, sizes are patched once the length is known
+static void write_wav_header(FILE *f, uint32_t frames) {
+    uint8_t h[44];
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + frames * 4, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);              // format chunk size
+    put_le(h + 20, 1, 2);               // PCM
+    put_le(h + 22, 2, 2);               // channels
+    put_le(h + 24, AUDIO_HZ, 4);
+    put_le(h + 28, AUDIO_HZ * 4, 4);    // bytes per second
+    put_le(h + 32, 4, 2);               // bytes per frame
+    put_le(h + 34, 16, 2);              // bits per sample
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, frames * 4, 4);
+    fwrite(h, 1, sizeof(h), f);
+}
+
+// Appends the samples the APU has made up to now, returns the frames written
+static size_t write_audio(FILE *f) {
+    int16_t buf[AUDIO_FRAMES * 2];
+    size_t n, total = 0;
+    apu_run_to(sm_get_cycles());
+    while ((n = apu_read(buf, AUDIO_FRAMES)) > 0) {
+        total += fwrite(buf, 4, n, f);
+    }
+    return total;
+}
+
+static int load_state(const char *path) {
+    FILE *f = fopen(path, "rb");
+    const size_t size = st_size(ST_ALL);
+    uint8_t *buf = malloc(size + 1);
+    size_t got;
+    int rc;
+
+    if (!f || !buf) {
+        fprintf(stderr, "Could not open %s\n", path);
+        if (f) fclose(f);
+        free(buf);
+        return -1;
+    }
+    // one spare byte, sections from newer builds may follow
+    got = fread(buf, 1, size + 1, f);
+    fclose(f);
+    rc = st_load(buf, got, ST_ALL);
+    free(buf);
+    return rc;
+}
+
+static int save_state(const char *path) {
+    FILE *f = fopen(path, "wb");
+    const size_t size = st_size(ST_ALL);
+    uint8_t *buf = malloc(size);
+    int rc = -1;
+
+    if (f && buf && st_save(buf, size, ST_ALL) == size && fwrite(buf, 1, size, f) == size) rc = 0;
+    if (rc) fprintf(stderr, "Could not write %s\n", path);
+    if (f && fclose(f)) rc = -1;
+    free(buf);
+    return rc;
+}
+
+// Prints a bench line, flagged when bad, and gives the bench's result
+static int bench_report(int bad, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "%s\n", bad ? "  MISMATCH" : "");
+    return bad ? -1 : 0;
+}
+
+/*
+ *  A point the checks return to or expect the machine at: its whole
+ *  snapshot and its picture
+ */
+struct bench_mark {
+    size_t   size;
+    uint8_t *state, *scratch;
+    uint16_t fb[PPU_WIDTH * PPU_HEIGHT];
+};
+typedef struct bench_mark bench_mark;
+
+static bench_mark *mark_new() {
+    bench_mark *m = malloc(sizeof(bench_mark));
+    if (!m) return NULL;
+    m->size = st_size(ST_ALL);
+    m->state = malloc(m->size);
+    m->scratch = malloc(m->size);
+    if (!m->state || !m->scratch) {
+        free(m->state);
+        free(m->scratch);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void mark_free(bench_mark *m) {
+    if (!m) return;
+    free(m->state);
+    free(m->scratch);
+    free(m);
+}
+
+// Records the running machine
+static void mark_take(bench_mark *m) {
+    st_save(m->state, m->size, ST_ALL);
+    memcpy(m->fb, ppu_get_framebuffer(), sizeof(m->fb));
+}
+
+// Puts the running machine back where it was recorded, the picture aside
+static void mark_load(const bench_mark *m) {
+    st_load(m->state, m->size, ST_ALL);
+}
+
+// Whether the running machine is anywhere else than recorded
+static int mark_differs(bench_mark *m) {
+    st_save(m->scratch, m->size, ST_ALL);
+    return memcmp(m->state, m->scratch, m->size) || memcmp(m->fb, ppu_get_framebuffer(), sizeof(m->fb));
+}
+
+// Frame i of the ring check, the right sample differs so a swap shows
+static void ring_frame(int16_t *f, size_t i) {
+    f[0] = (int16_t)i;
+    f[1] = (int16_t)~(i * 3);
+}
+
+// Producer side, writes in uneven chunks and yields when the ring is full
+static void *ring_producer(void *arg) {
+    audioring *r = arg;
+    int16_t chunk[97 * 2];
+    size_t sent = 0, n, i;
+
+    while (sent < BENCH_RING_FRAMES) {
+        n = 1 + sent % 97;
+        if (n > BENCH_RING_FRAMES - sent) n = BENCH_RING_FRAMES - sent;
+        for (i = 0; i < n; i++) ring_frame(chunk + i * 2, sent + i);
+        n = ar_write(r, chunk, n);
+        if (!n) sched_yield();
+        sent += n;
+    }
+    return NULL;
+}
+
+/*
+ *  Streams frames through a ring much smaller than the stream, the
+ *  producer on its own thread, and checks every frame arrives once, in
+ *  order and whole
+ */
+static int bench_audioring() {
+    audioring r;
+    pthread_t producer;
+    int16_t chunk[61 * 2], want[2];
+    size_t got = 0, bad = 0, n, i;
+    double t0, t1;
+    int rc;
+
+    if (ar_init(&r, BENCH_RING_SIZE)) return -1;
+    t0 = now_s();
+    if (pthread_create(&producer, NULL, ring_producer, &r)) {
+        ar_free(&r);
+        return -1;
+    }
+    while (got < BENCH_RING_FRAMES) {
+        n = ar_read(&r, chunk, 1 + got % 61);
+        if (!n) sched_yield();
+        for (i = 0; i < n; i++) {
+            ring_frame(want, got + i);
+            bad += chunk[i * 2] != want[0] || chunk[i * 2 + 1] != want[1];
+        }
+        got += n;
+    }
+    pthread_join(producer, NULL);
+    t1 = now_s();
+    rc = bench_report(bad || ar_fill(&r), "audioring  %u frames through %u across threads, %.1f ns per frame",
+                      BENCH_RING_FRAMES, BENCH_RING_SIZE, (t1 - t0) * 1e9 / BENCH_RING_FRAMES);
+    ar_free(&r);
+    return rc;
+}
+
+// Times a snapshot round trip of the current machine, an incremental one
+// over the next frame and the dirty-page bit on the write path
+static int bench_state() {
+    const size_t size = st_size(ST_ALL);
+    uint8_t *buf = malloc(size), *inc = malloc(st_size(ST_INCREMENTAL));
+    size_t inc_size;
+    double t0, t1, t2;
+    unsigned int r, w;
+
+    if (!buf || !inc || !st_save(buf, size, ST_ALL)) {
+        free(buf);
+        free(inc);
+        return -1;
+    }
+    t0 = now_s();
+    for (r = 0; r < BENCH_REPS; r++) st_save(buf, size, ST_ALL);
+    t1 = now_s();
+    for (r = 0; r < BENCH_REPS; r++) st_load(buf, size, ST_ALL);
+    t2 = now_s();
+    fprintf(stderr, "snapshot   %zu bytes, save %.2f us, load %.2f us\n", size,
+            (t1 - t0) * 1e6 / BENCH_REPS, (t2 - t1) * 1e6 / BENCH_REPS);
+
+    st_checkpoint();
+    sys_run_frame();
+    t0 = now_s();
+    for (r = 0; r < BENCH_REPS; r++) inc_size = st_save(inc, st_size(ST_INCREMENTAL), ST_INCREMENTAL);
+    t1 = now_s();
+    fprintf(stderr, "increment  %zu bytes after a frame, save %.2f us\n", inc_size,
+            (t1 - t0) * 1e6 / BENCH_REPS);
+
+    // WRAM stores with and without the bit, the machine is restored from
+    // the snapshot afterwards
+    t0 = now_s();
+    for (r = 0; r < BENCH_REPS; r++) {
+        for (w = 0; w < 0x2000; w++) sm_setmemaddr8(0xC000 + w, w);
+    }
+    t1 = now_s();
+    for (r = 0; r < BENCH_REPS; r++) {
+        for (w = 0; w < 0x2000; w++) sm_setmemaddr8_unmarked(0xC000 + w, w);
+    }
+    t2 = now_s();
+    fprintf(stderr, "write path %.2f ns per byte with dirty tracking, %.2f without, %+.2f ns for the bit\n",
+            (t1 - t0) * 1e9 / BENCH_REPS / 0x2000, (t2 - t1) * 1e9 / BENCH_REPS / 0x2000,
+            ((t1 - t0) - (t2 - t1)) * 1e9 / BENCH_REPS / 0x2000);
+    st_load(buf, size, ST_ALL);
+    free(buf);
+    free(inc);
+    return 0;
+}
+
+/*
+ *  Runs BENCH_REPLAY frames straight, then again saved part way, off on
+ *  other keys for a while and loaded back, in both PPU tiers; snapshot
+ *  and picture have to end up the same
+ */
+static int bench_replay() {
+    const uint8_t tier = ppu_get_tier();
+    bench_mark *start = mark_new(), *mid = mark_new(), *end = mark_new();
+    unsigned int t, i, bad = 0;
+    int rc = -1;
+
+    if (start && mid && end) {
+        mark_take(start);
+        for (t = PPU_TIER_FAST; t <= PPU_TIER_DOT; t++) {
+            ppu_set_tier(t);
+            mark_load(start);
+            for (i = 0; i < BENCH_REPLAY; i++) sys_run_frame();
+            mark_take(end);
+
+            mark_load(start);
+            for (i = 0; i < BENCH_REPLAY_SAVE; i++) sys_run_frame();
+            mark_take(mid);
+            jp_set_keys(0xFF);
+            for (i = 0; i < 50; i++) sys_run_frame();
+            jp_set_keys(0);
+            mark_load(mid);
+            for (i = BENCH_REPLAY_SAVE; i < BENCH_REPLAY; i++) sys_run_frame();
+            bad |= mark_differs(end);
+        }
+        ppu_set_tier(tier);
+        mark_load(start);
+        rc = bench_report(bad, "replay     %u frames, saved and loaded at %u, both tiers",
+                          BENCH_REPLAY, BENCH_REPLAY_SAVE);
+    }
+    mark_free(start);
+    mark_free(mid);
+    mark_free(end);
+    return rc;
+}
+
+// Branches the machine into children that each run a frame on their own keys
+static int bench_forks() {
+    st_fork *parent = st_fork_new();
+    st_fork **child = calloc(BENCH_FORKS, sizeof(st_fork *));
+    double fork_s = 0, enter_s = 0, t;
+    size_t pages;
+    unsigned int i;
+    int rc = -1;
+
+    if (parent && child) {
+        pages = sm_live_pages();
+        for (i = 0; i < BENCH_FORKS; i++) {
+            t = now_s();
+            st_fork_enter(parent);
+            enter_s += now_s() - t;
+            jp_set_keys(i & 0xFF);
+            sys_run_frame();
+            t = now_s();
+            child[i] = st_fork_new();
+            fork_s += now_s() - t;
+            if (!child[i]) break;
+        }
+        if (i == BENCH_FORKS) {
+            pages = sm_live_pages() - pages;
+            fprintf(stderr, "fork       %u children, %.1f own pages (%.0f bytes) each, fork %.2f us, enter %.2f us\n",
+                    BENCH_FORKS, (double)pages / BENCH_FORKS, (double)pages * SM_PAGE_SIZE / BENCH_FORKS,
+                    fork_s * 1e6 / BENCH_FORKS, enter_s * 1e6 / BENCH_FORKS);
+            st_fork_enter(parent);
+            jp_set_keys(0);
+            rc = 0;
+        }
+    }
+    for (i = 0; child && i < BENCH_FORKS; i++) st_fork_free(child[i]);
+    free(child);
+    st_fork_free(parent);
+    return rc;
+}
+
+// Writes over VRAM, cartridge and work RAM, OAM and HRAM, in words and bytes
+static void scribble(unsigned int seed) {
+    unsigned int a;
+    for (a = 0x8000; a < 0xE000; a += 2) sm_setmemaddr16(a, a * 31 + seed);
+    for (a = SM_OAM_BASE; a < SM_OAM_END; a++) sm_setmemaddr8(a, a + seed);
+    for (a = SM_IO_END; a < SM_ADDR_IE; a++) sm_setmemaddr8(a, a ^ seed);
+}
+
+/*
+ *  Forks children that write over all of RAM, run on and are entered
+ *  again to write some more, all sharing pages with each other and the
+ *  parent. The parent has to carry on exactly as if they never ran, and
+ *  once they are freed only the machine's own pages are left.
+ */
+static int bench_fork_stress() {
+    bench_mark *ref = mark_new();
+    st_fork *parent = st_fork_new();
+    st_fork **child = calloc(BENCH_SCRIBBLERS, sizeof(st_fork *));
+    unsigned int i;
+    int bad, rc = -1;
+
+    if (ref && parent && child) {
+        for (i = 0; i < BENCH_SCRIBBLE_FRAMES; i++) sys_run_frame();
+        mark_take(ref);
+
+        for (i = 0; i < BENCH_SCRIBBLERS; i++) {
+            st_fork_enter(i ? child[i - 1] : parent);
+            scribble(i);
+            sys_run_cycles(PPU_FRAME_CYCLES);
+            child[i] = st_fork_new();
+            if (!child[i]) break;
+        }
+        for (i = 0; i < BENCH_SCRIBBLERS && child[i]; i++) {
+            st_fork_enter(child[i]);
+            scribble(~i);
+        }
+        st_fork_enter(parent);
+        for (i = 0; i < BENCH_SCRIBBLE_FRAMES; i++) sys_run_frame();
+        bad = mark_differs(ref);
+
+        st_fork_enter(parent);
+        for (i = 0; i < BENCH_SCRIBBLERS; i++) st_fork_free(child[i]);
+        st_fork_free(parent);
+        parent = NULL;
+        bad |= sm_live_pages() != (sm_memory() ? 0 : SM_PAGES);
+        rc = bench_report(bad, "fork       %u children over all of RAM, parent unchanged", BENCH_SCRIBBLERS);
+    }
+    free(child);
+    st_fork_free(parent);
+    mark_free(ref);
+    return rc;
+}
+
+/*
+ *  Steps copies of the machine on the batch pool, each on its own keys,
+ *  against the same frames run one by one here; the last copy has to
+ *  end up exactly where this thread's machine does
+ */
+static int bench_batch() {
+    sys_machine **m = calloc(BENCH_MACHINES, sizeof(sys_machine *));
+    uint16_t **frames = calloc(BENCH_MACHINES, sizeof(uint16_t *));
+    uint8_t keys[BENCH_MACHINES];
+    bench_mark *start = mark_new(), *ref = mark_new();
+    bt_pool pool = {0};
+    double t0, t1, t2;
+    unsigned int i = 0, b;
+    int bad, rc = -1;
+
+    if (m && frames && start && ref && bt_init(&pool, 0) == 0) {
+        mark_take(start);
+        for (i = 0; i < BENCH_MACHINES; i++) {
+            m[i] = sys_machine_copy();
+            frames[i] = malloc(PPU_WIDTH * PPU_HEIGHT * sizeof(uint16_t));
+            keys[i] = i & 0xFF;
+            if (!m[i] || !frames[i]) break;
+        }
+    }
+    if (m && i == BENCH_MACHINES) {
+        t0 = now_s();
+        for (b = 0; b < BENCH_BATCHES; b++) bt_run(&pool, m, keys, frames, BENCH_MACHINES, 0);
+        t1 = now_s();
+        jp_set_keys(keys[BENCH_MACHINES - 1]);
+        for (b = 0; b < BENCH_BATCHES; b++) sys_run_frame();
+        t2 = now_s();
+        mark_take(ref);
+
+        sys_machine_enter(m[BENCH_MACHINES - 1], frames[BENCH_MACHINES - 1]);
+        bad = mark_differs(ref);
+        sys_machine_leave(m[BENCH_MACHINES - 1]);
+        mark_load(start);
+        jp_set_keys(0);
+        rc = bench_report(bad, "batch      %u machines on %u workers, %.1f us per frame, one thread %.1f us",
+                          BENCH_MACHINES, pool.workers,
+                          (t1 - t0) * 1e6 / (BENCH_MACHINES * BENCH_BATCHES), (t2 - t1) * 1e6 / BENCH_BATCHES);
+    }
+    bt_free(&pool);
+    for (i = 0; m && frames && i < BENCH_MACHINES; i++) {
+        sys_machine_free(m[i]);
+        free(frames[i]);
+    }
+    free(m);
+    free(frames);
+    mark_free(start);
+    mark_free(ref);
+    return rc;
+}
+
+// Step s of the sweep, whole and half frames in turn; 0 is a frame for bt_run
+static uint32_t sweep_cycles(unsigned int s) {
+    return s & 1 ? PPU_FRAME_CYCLES / 2 : 0;
+}
+
+/*
+ *  Pools of 1 to BENCH_SWEEP_WORKERS workers step fresh copies of the
+ *  machine, each on its own keys; every copy has to end up in the state
+ *  and picture the same steps reach when run one after another on this
+ *  thread
+ */
+static int bench_batch_sweep() {
+    sys_machine *m[BENCH_SWEEP_MACHINES] = {NULL};
+    uint16_t *frames[BENCH_SWEEP_MACHINES] = {NULL};
+    bench_mark *ref[BENCH_SWEEP_MACHINES] = {NULL};
+    bench_mark *start = mark_new();
+    uint8_t keys[BENCH_SWEEP_MACHINES];
+    unsigned int i, s, w, bad = 0;
+    int rc = -1;
+
+    for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+        ref[i] = mark_new();
+        frames[i] = malloc(PPU_WIDTH * PPU_HEIGHT * sizeof(uint16_t));
+        if (!ref[i] || !frames[i]) break;
+    }
+    if (start && i == BENCH_SWEEP_MACHINES) {
+        mark_take(start);
+        for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+            // keys are not in snapshots, each copy presses its own from none
+            keys[i] = (i * 37) & 0xFF;
+            jp_set_keys(0);
+            mark_load(start);
+            jp_set_keys(keys[i]);
+            for (s = 0; s < BENCH_SWEEP_STEPS; s++) {
+                if (sweep_cycles(s)) sys_run_cycles(sweep_cycles(s));
+                else sys_run_frame();
+            }
+            mark_take(ref[i]);
+        }
+        mark_load(start);
+        jp_set_keys(0);
+
+        for (w = 1; w <= BENCH_SWEEP_WORKERS; w++) {
+            bt_pool pool = {0};
+            if (bt_init(&pool, w)) break;
+            for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+                m[i] = sys_machine_copy();
+                if (!m[i]) break;
+            }
+            if (i == BENCH_SWEEP_MACHINES) {
+                for (s = 0; s < BENCH_SWEEP_STEPS; s++) {
+                    bt_run(&pool, m, keys, frames, BENCH_SWEEP_MACHINES, sweep_cycles(s));
+                }
+                for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+                    sys_machine_enter(m[i], frames[i]);
+                    bad += mark_differs(ref[i]);
+                    sys_machine_leave(m[i]);
+                }
+            }
+            bt_free(&pool);
+            for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+                sys_machine_free(m[i]);
+                m[i] = NULL;
+            }
+        }
+        if (w > BENCH_SWEEP_WORKERS) {
+            rc = bench_report(bad, "batch      1-%u workers, %u machines in whole and half frames, %u differ from one thread",
+                              BENCH_SWEEP_WORKERS, BENCH_SWEEP_MACHINES, bad);
+        }
+    }
+    for (i = 0; i < BENCH_SWEEP_MACHINES; i++) {
+        mark_free(ref[i]);
+        free(frames[i]);
+    }
+    mark_free(start);
+    return rc;
+}
+
+// Times the SIMD and plain C path of every scaler on one frame
+static int bench_scalers(const uint16_t *fb) {
+    static const char *names[] = {"2x", "3x", "4x", "scale2x"};
+    const size_t size = PPU_WIDTH * PPU_HEIGHT * SC_MAX_FACTOR * SC_MAX_FACTOR;
+    uint16_t *fast = malloc(size * sizeof(uint16_t));
+    uint16_t *ref = malloc(size * sizeof(uint16_t));
+    unsigned int i, r;
+    int rc = 0;
+
+    if (!fast || !ref) {
+        free(fast);
+        free(ref);
+        return -1;
+    }
+    fprintf(stderr, "scaler     %-6s  ms/frame   c ms/frame  speedup\n", sc_isa());
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        scaler s;
+        size_t pixels;
+        double t0, t1, t2;
+        sc_parse(&s, names[i]);
+        pixels = (size_t)PPU_WIDTH * PPU_HEIGHT * s.factor * s.factor;
+        t0 = now_s();
+        for (r = 0; r < BENCH_REPS; r++) sc_run(&s, fb, PPU_WIDTH, PPU_HEIGHT, fast, 0, PPU_HEIGHT);
+        t1 = now_s();
+        for (r = 0; r < BENCH_REPS; r++) sc_run_reference(&s, fb, PPU_WIDTH, PPU_HEIGHT, ref, 0, PPU_HEIGHT);
+        t2 = now_s();
+        rc |= bench_report(memcmp(fast, ref, pixels * sizeof(uint16_t)) != 0, "%-10s %8.4f   %10.4f  %6.2fx",
+                           names[i], (t1 - t0) * 1e3 / BENCH_REPS, (t2 - t1) * 1e3 / BENCH_REPS,
+                           (t2 - t1) / (t1 - t0));
+    }
+    free(fast);
+    free(ref);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"frames", required_argument, NULL, 'n'},
+        {"output", required_argument, NULL, 'o'},
+        {"video",  required_argument, NULL, 'v'},
+        {"format", required_argument, NULL, 'f'},
+        {"shm",    required_argument, NULL, 's'},
+        {"scale",  required_argument, NULL, 'x'},
+        {"bench",  no_argument,       NULL, 'b'},
+        {"dot",    no_argument,       NULL, 'd'},
+        {"audio",  required_argument, NULL, 'a'},
+        {"load",   required_argument, NULL, 'L'},
+        {"save",   required_argument, NULL, 'S'},
+        {"save-mapped", required_argument, NULL, 'M'},
+        {"rewind", required_argument, NULL, 'r'},
+        {"run-ahead", required_argument, NULL, 'A'},
+        {"quiet",  no_argument,       NULL, 'q'},
+        {"help",   no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *output = NULL, *video = NULL, *shm = NULL, *audio = NULL;
+    const char *load = NULL, *save = NULL, *save_mapped = NULL;
+    statefile mapped = {NULL, 0};
+    rewinder history;
+    long rewind_frames = 0, ahead = 0;
+    double record_s = 0;
+    FILE *wav = NULL;
+    size_t audio_frames = 0;
+    vo_format format = VO_Y4M;
+    videoout vo;
+    shmring ring;
+    scaler scale = {SC_NEAREST, 1};
+    uint16_t *scaled = NULL;
+    const uint16_t *out;
+    long frames = 60, i;
+    int quiet = 0, bench = 0, opt, status = EXIT_SUCCESS;
+    double start, elapsed;
+    ppu_stats stats;
+
+    // the machine options set up, the ROM then loads into it
+    sys_init();
+    while ((opt = getopt_long(argc, argv, "n:o:v:f:s:x:a:L:S:M:r:A:bdqh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'n': frames = strtol(optarg, NULL, 10); break;
+            case 'o': output = optarg; break;
+            case 'v': video = optarg; break;
+            case 's': shm = optarg; break;
+            case 'b': bench = 1; break;
+            case 'd': ppu_set_tier(PPU_TIER_DOT); break;
+            case 'a': audio = optarg; break;
+            case 'L': load = optarg; break;
+            case 'S': save = optarg; break;
+            case 'M': save_mapped = optarg; break;
+            case 'r': rewind_frames = strtol(optarg, NULL, 10); break;
+            case 'A': ahead = strtol(optarg, NULL, 10); break;
+            case 'x':
+                if (sc_parse(&scale, optarg)) return EXIT_FAILURE;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "y4m")) format = VO_Y4M;
+                else if (!strcmp(optarg, "rgb")) format = VO_RGB24;
+                else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q': quiet = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || frames < 0 || rewind_frames < 0 || rewind_frames > frames || ahead < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (sys_load_rom(argv[optind])) {
+        return EXIT_FAILURE;
+    }
+    if (load && (sf_detect(load) ? sf_load(&mapped, load) : load_state(load))) {
+        return EXIT_FAILURE;
+    }
+
+    // a closed pipe shows up as a write error instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+    if (scale.factor > 1 || scale.kind != SC_NEAREST) {
+        scaled = malloc(sizeof(uint16_t) * PPU_WIDTH * PPU_HEIGHT * scale.factor * scale.factor);
+        if (!scaled) return EXIT_FAILURE;
+    }
+    if (video && vo_open(&vo, video, format, PPU_WIDTH * scale.factor, PPU_HEIGHT * scale.factor,
+                         4194304, PPU_FRAME_CYCLES)) {
+        return EXIT_FAILURE;
+    }
+    if (shm && shmr_create(&ring, shm, PPU_WIDTH, PPU_HEIGHT, SHM_SLOTS)) {
+        return EXIT_FAILURE;
+    }
+    if (audio) {
+        wav = fopen(audio, "wb");
+        if (!wav) {
+            fprintf(stderr, "Could not open %s\n", audio);
+            return EXIT_FAILURE;
+        }
+        write_wav_header(wav, 0);
+        apu_set_rate(AUDIO_HZ);
+    }
+    if (rewind_frames && rw_init(&history, frames + 1, REWIND_BYTES, RW_KEYFRAME)) {
+        return EXIT_FAILURE;
+    }
+
+    start = now_s();
+    for (i = 0; i < frames; i++) {
+        if (shm) ppu_set_framebuffer(shmr_begin(&ring));
+        // with run-ahead the machine's own frame is heard, the one ahead seen
+        ppu_set_skip(ahead > 0);
+        sys_run_frame();
+        if (wav) audio_frames += write_audio(wav);
+        if (ahead) sys_run_ahead(ahead);
+        if (shm) shmr_commit(&ring);
+        if (rewind_frames) {
+            const double t = now_s();
+            rw_record(&history);
+            record_s += now_s() - t;
+        }
+        if (video && scaled) sc_run(&scale, ppu_get_framebuffer(), PPU_WIDTH, PPU_HEIGHT, scaled, 0, PPU_HEIGHT);
+        if (video && vo_push(&vo, scaled ? scaled : ppu_get_framebuffer())) {
+            fprintf(stderr, "Video output failed after %ld frames\n", i);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    if (video && vo_close(&vo)) {
+        fprintf(stderr, "Video output incomplete\n");
+        status = EXIT_FAILURE;
+    }
+    elapsed = now_s() - start;
+    frames = i;
+
+    // step back a frame at a time, then the same frames again must end where the run did
+    if (rewind_frames) {
+        const unsigned int held = history.count;
+        const size_t used = history.used;
+        const long back = rewind_frames < held ? rewind_frames : (long)held - 1;
+        bench_mark *end = mark_new();
+        double t0, t1;
+        int bad;
+
+        if (!end) {
+            fprintf(stderr, "Could not allocate the rewind check\n");
+            return EXIT_FAILURE;
+        }
+        mark_take(end);
+        t0 = now_s();
+        for (i = 0; i < back; i++) rw_step_back(&history);
+        t1 = now_s();
+        // as the run went, so the picture is the one it ended on too
+        for (i = 0; i < back; i++) {
+            ppu_set_skip(ahead > 0);
+            sys_run_frame();
+            if (ahead) sys_run_ahead(ahead);
+        }
+        bad = mark_differs(end);
+        if (!quiet || bad) {
+            bench_report(bad, "rewind     %u frames in %zu bytes, record %.1f us, step back %.1f us, %ld replayed",
+                         held, used, frames ? record_s * 1e6 / frames : 0.0,
+                         back ? (t1 - t0) * 1e6 / back : 0.0, back);
+        }
+        if (bad) status = EXIT_FAILURE;
+        mark_free(end);
+        rw_free(&history);
+    }
+
+    out = ppu_get_framebuffer();
+    if (scaled) {
+        sc_run(&scale, out, PPU_WIDTH, PPU_HEIGHT, scaled, 0, PPU_HEIGHT);
+        out = scaled;
+    }
+    if (output && write_ppm(output, out, PPU_WIDTH * scale.factor, PPU_HEIGHT * scale.factor)) {
+        status = EXIT_FAILURE;
+    }
+    if (save && save_state(save)) {
+        status = EXIT_FAILURE;
+    }
+    if (save_mapped && sf_save(save_mapped)) {
+        status = EXIT_FAILURE;
+    }
+    // every bench runs, one that fails or mismatches fails the run
+    if (bench) {
+        int failed = bench_scalers(ppu_get_framebuffer());
+        failed |= bench_audioring();
+        failed |= bench_state();
+        failed |= bench_replay();
+        failed |= bench_forks();
+        failed |= bench_fork_stress();
+        failed |= bench_batch();
+        failed |= bench_batch_sweep();
+        if (failed) status = EXIT_FAILURE;
+    }
+    if (shm) {
+        shmr_close(&ring);
+    }
+    sf_close(&mapped);
+    if (wav) {
+        rewind(wav);
+        write_wav_header(wav, audio_frames);
+        if (fclose(wav)) {
+            fprintf(stderr, "Audio output incomplete\n");
+            status = EXIT_FAILURE;
+        }
+    }
+    free(scaled);
+    if (!quiet) {
+        ppu_get_stats(&stats);
+        fprintf(stderr, "%ld frames in %.3f s (%.1f fps), %.1f%% lines skipped\n",
+                frames, elapsed, elapsed > 0 ? frames / elapsed : 0.0,
+                stats.lines_rendered + stats.lines_skipped ?
+                100.0 * stats.lines_skipped / (stats.lines_rendered + stats.lines_skipped) : 0.0);
+    }
+    return status;
+}
@@ -0,0 +1,82 @@
+//
+//  audioring.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audioring.h"
+
+///////**** Private ****///////
+
+// Copies frames between the ring starting at index and a linear buffer
+static void _ar_copy(audioring *r, size_t index, int16_t *linear, size_t frames, int to_ring) {
+    const size_t start = index & r->mask;
+    const size_t first = frames < r->mask + 1 - start ? frames : r->mask + 1 - start;
+    int16_t *ring = &r->frames[start * 2];
+
+    if (to_ring) {
+        memcpy(ring, linear, first * 2 * sizeof(int16_t));
+        memcpy(r->frames, linear + first * 2, (frames - first) * 2 * sizeof(int16_t));
+    }
+    else {
+        memcpy(linear, ring, first * 2 * sizeof(int16_t));
+        memcpy(linear + first * 2, r->frames, (frames - first) * 2 * sizeof(int16_t));
+    }
+}
+
+///////**** Public ****///////
+
+int ar_init(audioring *r, size_t frames) {
+    size_t size = 1;
+    while (size < frames) size <<= 1;
+    r->frames = calloc(size * 2, sizeof(int16_t));
+    if (!r->frames) {
+        fprintf(stderr, "Could not allocate the audio ring\n");
+        return -1;
+    }
+    r->mask = size - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+void ar_free(audioring *r) {
+    free(r->frames);
+    r->frames = NULL;
+}
+
+// Frames waiting to be read, exact for the consumer, a lower bound for the producer
+size_t ar_fill(audioring *r) {
+    // tail first, it can never pass a head loaded after it
+    const size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    return atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+}
+
+size_t ar_space(audioring *r) {
+    return r->mask + 1 - ar_fill(r);
+}
+
+// Producer side, returns the frames that fit
+size_t ar_write(audioring *r, const int16_t *src, size_t frames) {
+    const size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    const size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    const size_t space = r->mask + 1 - (head - tail);
+
+    if (frames > space) frames = space;
+    _ar_copy(r, head, (int16_t *)src, frames, 1);
+    atomic_store_explicit(&r->head, head + frames, memory_order_release);
+    return frames;
+}
+
+// Consumer side, returns the frames read
+size_t ar_read(audioring *r, int16_t *dst, size_t frames) {
+    const size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (frames > head - tail) frames = head - tail;
+    _ar_copy(r, tail, dst, frames, 0);
+    atomic_store_explicit(&r->tail, tail + frames, memory_order_release);
+    return frames;
+}
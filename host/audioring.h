@@ -0,0 +1,37 @@
+//
+//  audioring.h
+//  CGBA
+//
+
+/*
+ * Lock-free ring of interleaved stereo int16 frames
+ * - one producer (emulation) and one consumer (the audio callback)
+ * - head and tail only ever grow; each side owns one of them and reads
+ *   the other with acquire ordering, so no locks and no waiting
+ * - capacity is rounded up to a power of two
+ */
+
+#ifndef __CGBA__audioring__
+#define __CGBA__audioring__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct audioring {
+    int16_t *frames;        // 2 samples per frame
+    size_t   mask;
+    atomic_size_t head;     // frames written, producer only
+    atomic_size_t tail;     // frames read, consumer only
+};
+typedef struct audioring audioring;
+
+int  ar_init(audioring *r, size_t frames);
+void ar_free(audioring *r);
+
+size_t ar_fill(audioring *r);
+size_t ar_space(audioring *r);
+size_t ar_write(audioring *r, const int16_t *src, size_t frames);
+size_t ar_read(audioring *r, int16_t *dst, size_t frames);
+
+#endif /* defined(__CGBA__audioring__) */
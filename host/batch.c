@@ -0,0 +1,168 @@
+//
+//  batch.c
+//  CGBA
+//
+
+#define _GNU_SOURCE     // CPU affinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "batch.h"
+#include "../gb/input/joypad.h"
+
+///////**** Private ****///////
+
+#define BT_MAX_CPUS 1024
+
+// CPUs the process may run on, none when that is not known
+static unsigned int _bt_cpus(int *cpus, unsigned int max) {
+    unsigned int n = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    int c;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (c = 0; c < CPU_SETSIZE && n < max; c++) {
+            if (CPU_ISSET(c, &set)) cpus[n++] = c;
+        }
+    }
+#endif
+    return n;
+}
+
+// Pinned from creation on, so its stack is first touched there
+static void _bt_pin(pthread_attr_t *attr, int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+#endif
+}
+
+static void _bt_step(bt_pool *p, size_t i) {
+    sys_machine *m = p->machines[i];
+
+    sys_machine_enter(m, p->frames ? p->frames[i] : NULL);
+    if (p->keys) jp_set_keys(p->keys[i]);
+    if (p->cycles) sys_run_cycles(p->cycles);
+    else sys_run_frame();
+    sys_machine_leave(m);
+}
+
+// Its own group first, then what the others have left
+static void _bt_drain(bt_worker *w) {
+    bt_pool *p = w->pool;
+    unsigned int k;
+
+    for (k = 0; k < p->workers; k++) {
+        bt_worker *g = &p->worker[(w->index + k) % p->workers];
+        size_t i;
+        while ((i = atomic_fetch_add_explicit(&g->next, 1, memory_order_relaxed)) < g->end) {
+            _bt_step(p, i);
+        }
+    }
+}
+
+static void *_bt_worker_main(void *arg) {
+    bt_worker *w = arg;
+    bt_pool *p = w->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->generation == seen && !p->stop) pthread_cond_wait(&p->go, &p->lock);
+        if (p->stop) break;
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+        _bt_drain(w);
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0) pthread_cond_signal(&p->idle);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+///////**** Public ****///////
+
+int bt_init(bt_pool *p, unsigned int workers) {
+    int cpus[BT_MAX_CPUS];
+    const unsigned int n = _bt_cpus(cpus, BT_MAX_CPUS);
+    unsigned int i;
+
+    memset(p, 0, sizeof(*p));
+    if (!workers) workers = n ? n : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (!workers) workers = 1;
+    p->worker = aligned_alloc(_Alignof(bt_worker), workers * sizeof(bt_worker));
+    if (!p->worker) {
+        fprintf(stderr, "Batch workers not allocated\n");
+        return -1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->go, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    for (i = 0; i < workers; i++) {
+        bt_worker *w = &p->worker[i];
+        pthread_attr_t attr;
+        int rc;
+
+        atomic_init(&w->next, 0);
+        w->end = 0;
+        w->pool = p;
+        w->index = i;
+        w->cpu = n ? cpus[i % n] : -1;
+        pthread_attr_init(&attr);
+        _bt_pin(&attr, w->cpu);
+        rc = pthread_create(&w->thread, &attr, _bt_worker_main, w);
+        pthread_attr_destroy(&attr);
+        if (rc) break;
+        p->workers++;
+    }
+    if (!p->workers) {
+        fprintf(stderr, "Batch workers not started\n");
+        bt_free(p);
+        return -1;
+    }
+    return 0;
+}
+
+void bt_free(bt_pool *p) {
+    unsigned int i;
+
+    if (!p->worker) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->go);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->workers; i++) pthread_join(p->worker[i].thread, NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->go);
+    pthread_cond_destroy(&p->idle);
+    free(p->worker);
+    memset(p, 0, sizeof(*p));
+}
+
+void bt_run(bt_pool *p, sys_machine **machines, const uint8_t *keys, uint16_t **frames,
+            size_t count, uint32_t cycles) {
+    unsigned int i;
+
+    if (!count) return;
+    p->machines = machines;
+    p->keys = keys;
+    p->frames = frames;
+    p->cycles = cycles;
+    for (i = 0; i < p->workers; i++) {
+        atomic_store_explicit(&p->worker[i].next, count * i / p->workers, memory_order_relaxed);
+        p->worker[i].end = count * (i + 1) / p->workers;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->busy = p->workers;
+    p->generation++;
+    pthread_cond_broadcast(&p->go);
+    while (p->busy) pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,71 @@
+//
+//  batch.h
+//  CGBA
+//
+
+/*
+ * Steps many independent machines per call on a pool of worker threads
+ * - each worker runs sys_machines in turn: enter, set keys, one frame or
+ *   a number of cycles, leave
+ * - the machines are split into one contiguous group per worker, the
+ *   same split every call, and workers are pinned to a CPU each, so a
+ *   machine keeps landing on the core whose caches hold it; a worker
+ *   that runs out takes machines from the other groups
+ * - machines are claimed with an atomic counter per group, nothing is
+ *   locked while they run; the calling thread waits and its own machine
+ *   is left alone
+ * - no sound is drained, copies (sys_machine_copy) have no sample rate
+ */
+
+#ifndef __CGBA__batch__
+#define __CGBA__batch__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../gb/system.h"
+
+typedef struct bt_pool bt_pool;
+
+// One worker and the machines left in its group, a cache line each
+struct bt_worker {
+    _Alignas(64) atomic_size_t next;
+    size_t   end;
+    bt_pool *pool;
+    unsigned int index;
+    int      cpu;               // pinned to, -1 when not
+    pthread_t thread;
+};
+typedef struct bt_worker bt_worker;
+
+struct bt_pool {
+    bt_worker *worker;
+    unsigned int workers;
+    pthread_mutex_t lock;       // taken to start and finish a batch, not per machine
+    pthread_cond_t go, idle;
+    unsigned long generation;   // batches started
+    unsigned int busy;          // workers not done with the current one
+    int stop;
+    // the batch being run
+    sys_machine **machines;
+    const uint8_t *keys;
+    uint16_t **frames;
+    uint32_t cycles;
+};
+
+// workers 0 starts one per CPU the process may run on
+int  bt_init(bt_pool *p, unsigned int workers);
+void bt_free(bt_pool *p);
+/*
+ *  Advances count machines by a frame each, or by `cycles` T-cycles when
+ *  not 0, and returns once all are done. keys[i] (JP_ bits) are held by
+ *  machine i from the start, NULL keeps what each held; frames[i] gets
+ *  its picture (PPU_WIDTH * PPU_HEIGHT), NULL or a NULL entry draws none.
+ *  Give each machine the same buffer every call and only changed lines
+ *  are drawn, see sys_machine_enter.
+ */
+void bt_run(bt_pool *p, sys_machine **machines, const uint8_t *keys, uint16_t **frames,
+            size_t count, uint32_t cycles);
+
+#endif /* defined(__CGBA__batch__) */
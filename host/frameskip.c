@@ -0,0 +1,51 @@
+//
+//  frameskip.c
+//  CGBA
+//
+
+#include <string.h>
+#include "frameskip.h"
+
+///////**** Private ****///////
+
+#define FS_SMOOTHING 0.125      // weight of the newest cost in the averages
+
+static void _fs_average(double *avg, double ms) {
+    *avg = *avg > 0 ? *avg + (ms - *avg) * FS_SMOOTHING : ms;
+}
+
+/*
+ *  A cycle is one shown frame plus every - 1 skipped ones, pick the
+ *  longest cycle that still fits in one refresh interval
+ */
+static void _fs_adapt(frameskip *fs) {
+    const double skipped = fs->skipped_ms > 0 ? fs->skipped_ms : fs->shown_ms;
+    double every = 1;
+
+    if (skipped > 0 && fs->interval_ms > fs->shown_ms) {
+        every += (fs->interval_ms - fs->shown_ms) / skipped;
+    }
+    fs->every = every > FS_MAX_EVERY ? FS_MAX_EVERY : (unsigned int)every;
+}
+
+///////**** Public ****///////
+
+void fs_init(frameskip *fs, double hz) {
+    memset(fs, 0, sizeof(*fs));
+    fs->interval_ms = 1000.0 / hz;
+    fs->every = 1;
+}
+
+// Whether the coming frame is shown, decided before it is emulated
+uint8_t fs_show_next(const frameskip *fs) {
+    return fs->phase == 0;
+}
+
+// Feeds the cost of the frame just emulated
+void fs_frame_done(frameskip *fs, double ms) {
+    _fs_average(fs->phase == 0 ? &fs->shown_ms : &fs->skipped_ms, ms);
+    if (++fs->phase >= fs->every) {
+        fs->phase = 0;
+        _fs_adapt(fs);
+    }
+}
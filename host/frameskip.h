@@ -0,0 +1,36 @@
+//
+//  frameskip.h
+//  CGBA
+//
+
+/*
+ * Adaptive frame skipping for fast-forward
+ * - one frame in `every` is shown (rendered and published), the others
+ *   only run the parts of the machine a game can observe
+ * - `every` is recomputed after each shown frame from the average cost
+ *   of shown and skipped frames, so shown frames keep arriving at the
+ *   target refresh however fast the host emulates
+ * - costs are passed in by the caller, no clock or SDL dependency
+ */
+
+#ifndef __CGBA__frameskip__
+#define __CGBA__frameskip__
+
+#include <inttypes.h>
+
+#define FS_MAX_EVERY 64
+
+struct frameskip {
+    double interval_ms;     // wall time between shown frames
+    double shown_ms;        // average cost of a shown frame
+    double skipped_ms;      // average cost of a skipped frame
+    unsigned int every;
+    unsigned int phase;     // frames since the last shown one
+};
+typedef struct frameskip frameskip;
+
+void fs_init(frameskip *fs, double hz);
+uint8_t fs_show_next(const frameskip *fs);
+void fs_frame_done(frameskip *fs, double ms);
+
+#endif /* defined(__CGBA__frameskip__) */
@@ -0,0 +1,120 @@
+//
+//  overlay.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "overlay.h"
+#include <SDL2_ttf/SDL_ttf.h>
+
+///////**** Private ****///////
+
+/*
+ *  Fonts tried in order when CGBA_FONT is not set
+ */
+static const char *_ov_fonts[] = {
+    "/Library/Fonts/Osaka.ttf",
+    "/System/Library/Fonts/Menlo.ttc",
+    "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf",
+    "/usr/share/fonts/TTF/DejaVuSansMono.ttf",
+    "C:\\Windows\\Fonts\\consola.ttf",
+    NULL
+};
+
+static TTF_Font *_ov_open_font(int ptsize) {
+    const char *env = getenv("CGBA_FONT");
+    TTF_Font *font = NULL;
+    int i;
+
+    if (env) {
+        font = TTF_OpenFont(env, ptsize);
+        if (font) return font;
+        printf("TTF_OpenFont: %s\n", TTF_GetError());
+    }
+    for (i = 0; _ov_fonts[i] && !font; i++) {
+        font = TTF_OpenFont(_ov_fonts[i], ptsize);
+    }
+    return font;
+}
+
+///////**** Public ****///////
+
+// Builds the glyph atlas, returns -1 when no font could be loaded
+int ov_init(overlay *ov, SDL_Renderer *renderer, int ptsize) {
+    SDL_Color white = {255,255,255,255};
+    SDL_Surface *glyphs[OV_GLYPHS] = {NULL};
+    SDL_Surface *sheet;
+    TTF_Font *font;
+    int i, width = 0, height = 0, x = 0;
+
+    memset(ov, 0, sizeof(*ov));
+    if (TTF_Init()) {
+        printf("TTF_Init: %s\n", TTF_GetError());
+        return -1;
+    }
+    font = _ov_open_font(ptsize);
+    if (!font) {
+        printf("No overlay font found, set CGBA_FONT\n");
+        TTF_Quit();
+        return -1;
+    }
+
+    for (i = 0; i < OV_GLYPHS; i++) {
+        int minx, maxx, miny, maxy;
+        glyphs[i] = TTF_RenderGlyph_Blended(font, OV_FIRST_GLYPH + i, white);
+        TTF_GlyphMetrics(font, OV_FIRST_GLYPH + i, &minx, &maxx, &miny, &maxy, &ov->advance[i]);
+        if (!glyphs[i]) continue;
+        width += glyphs[i]->w;
+        if (glyphs[i]->h > height) height = glyphs[i]->h;
+    }
+    ov->line_height = TTF_FontHeight(font);
+    TTF_CloseFont(font);
+    TTF_Quit();
+
+    sheet = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+    for (i = 0; i < OV_GLYPHS; i++) {
+        if (!glyphs[i]) continue;
+        SDL_Rect r = {x, 0, glyphs[i]->w, glyphs[i]->h};
+        if (sheet) {
+            SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+            SDL_BlitSurface(glyphs[i], NULL, sheet, &r);
+        }
+        ov->glyph[i] = r;
+        x += glyphs[i]->w;
+        SDL_FreeSurface(glyphs[i]);
+    }
+    if (!sheet) return -1;
+
+    ov->atlas = SDL_CreateTextureFromSurface(renderer, sheet);
+    SDL_FreeSurface(sheet);
+    if (!ov->atlas) return -1;
+    SDL_SetTextureBlendMode(ov->atlas, SDL_BLENDMODE_BLEND);
+    return 0;
+}
+
+void ov_free(overlay *ov) {
+    if (ov->atlas) SDL_DestroyTexture(ov->atlas);
+    ov->atlas = NULL;
+}
+
+// Draws text at (x, y), '\n' starts a new line
+void ov_text(const overlay *ov, SDL_Renderer *renderer, int x, int y, const char *text) {
+    int pen = x;
+    if (!ov->atlas) return;
+    for (; *text; text++) {
+        const int i = (unsigned char)*text - OV_FIRST_GLYPH;
+        if (*text == '\n') {
+            pen = x;
+            y += ov->line_height;
+            continue;
+        }
+        if (i < 0 || i >= OV_GLYPHS) continue;
+        if (ov->glyph[i].w) {
+            SDL_Rect dst = {pen, y, ov->glyph[i].w, ov->glyph[i].h};
+            SDL_RenderCopy(renderer, ov->atlas, &ov->glyph[i], &dst);
+        }
+        pen += ov->advance[i];
+    }
+}
@@ -0,0 +1,34 @@
+//
+//  overlay.h
+//  CGBA
+//
+
+/*
+ * On-screen text overlay
+ * - printable ASCII is rasterized once into a single atlas texture
+ * - text is drawn as one textured quad per glyph, nothing is allocated
+ *   per frame and SDL_ttf is shut down once the atlas is built
+ */
+
+#ifndef __CGBA__overlay__
+#define __CGBA__overlay__
+
+#include <SDL2/SDL.h>
+
+#define OV_FIRST_GLYPH ' '
+#define OV_LAST_GLYPH  '~'
+#define OV_GLYPHS      (OV_LAST_GLYPH - OV_FIRST_GLYPH + 1)
+
+struct overlay {
+    SDL_Texture *atlas;
+    SDL_Rect glyph[OV_GLYPHS];
+    int advance[OV_GLYPHS];
+    int line_height;
+};
+typedef struct overlay overlay;
+
+int  ov_init(overlay *ov, SDL_Renderer *renderer, int ptsize);
+void ov_free(overlay *ov);
+void ov_text(const overlay *ov, SDL_Renderer *renderer, int x, int y, const char *text);
+
+#endif /* defined(__CGBA__overlay__) */
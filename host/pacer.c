@@ -0,0 +1,91 @@
+//
+//  pacer.c
+//  CGBA
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "pacer.h"
+
+///////**** Private ****///////
+
+#define PACER_SPIN_US  1500     // SDL_Delay may overshoot by about a millisecond
+#define PACER_MAX_LAG  3        // frames behind before giving up on catching up
+
+static int _pacer_cmp(const void *a, const void *b) {
+    const float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static void _pacer_record(pacer *p, Uint64 now) {
+    p->history[p->head] = (float)((double)(now - p->last) * 1000.0 / (double)p->freq);
+    p->head = (p->head + 1) % PACER_HISTORY;
+    if (p->count < PACER_HISTORY) p->count++;
+    p->last = now;
+}
+
+///////**** Public ****///////
+
+void pacer_init(pacer *p, double hz) {
+    memset(p, 0, sizeof(*p));
+    p->freq = SDL_GetPerformanceFrequency();
+    p->period = (Uint64)((double)p->freq / hz + 0.5);
+    p->spin = p->freq * PACER_SPIN_US / 1000000;
+    pacer_resync(p);
+}
+
+// Restarts the deadline chain from now, e.g. after a pause
+void pacer_resync(pacer *p) {
+    p->last = SDL_GetPerformanceCounter();
+    p->deadline = p->last + p->period;
+}
+
+// Waits for the current frame's deadline and schedules the next one
+void pacer_wait(pacer *p) {
+    Uint64 now = SDL_GetPerformanceCounter();
+
+    if (now < p->deadline) {
+        const Uint64 remaining = p->deadline - now;
+        if (remaining > p->spin) {
+            SDL_Delay((Uint32)((remaining - p->spin) * 1000 / p->freq));
+        }
+        do {
+            now = SDL_GetPerformanceCounter();
+        } while (now < p->deadline);
+        p->deadline += p->period;
+    }
+    else if (now - p->deadline > p->period * PACER_MAX_LAG) {
+        p->deadline = now + p->period;
+    }
+    else {
+        p->deadline += p->period;
+    }
+    _pacer_record(p, now);
+}
+
+// Records a frame without waiting (fast-forward), deadlines restart from now
+void pacer_mark(pacer *p) {
+    const Uint64 now = SDL_GetPerformanceCounter();
+    _pacer_record(p, now);
+    p->deadline = now + p->period;
+}
+
+void pacer_report_get(const pacer *p, pacer_report *out) {
+    float sorted[PACER_HISTORY];
+    float sum = 0;
+    unsigned int i;
+
+    memset(out, 0, sizeof(*out));
+    if (!p->count) return;
+
+    memcpy(sorted, p->history, p->count * sizeof(float));
+    qsort(sorted, p->count, sizeof(float), _pacer_cmp);
+    for (i = 0; i < p->count; i++) sum += sorted[i];
+
+    out->mean_ms = sum / p->count;
+    out->fps = out->mean_ms > 0 ? 1000.f / out->mean_ms : 0;
+    out->p50_ms = sorted[p->count * 50 / 100];
+    out->p95_ms = sorted[p->count * 95 / 100];
+    out->p99_ms = sorted[p->count * 99 / 100];
+    out->max_ms = sorted[p->count - 1];
+}
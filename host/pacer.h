@@ -0,0 +1,52 @@
+//
+//  pacer.h
+//  CGBA
+//
+
+/*
+ * Frame pacing against absolute deadlines
+ * - deadlines advance by exactly one period, so rounding never accumulates
+ * - the bulk of the wait is slept, the last stretch is spun on the
+ *   performance counter since SDL_Delay only has millisecond granularity
+ * - falling more than a few frames behind resyncs instead of bursting
+ */
+
+#ifndef __CGBA__pacer__
+#define __CGBA__pacer__
+
+#include <SDL2/SDL.h>
+
+// both systems refresh at ~59.73 Hz
+#define PACER_DMG_HZ (4194304.0 / 70224.0)
+#define PACER_GBA_HZ (16777216.0 / 280896.0)
+
+#define PACER_HISTORY 256
+
+struct pacer {
+    Uint64 freq;
+    Uint64 period;
+    Uint64 spin;            // counts spun rather than slept
+    Uint64 deadline;
+    Uint64 last;
+    float  history[PACER_HISTORY];  // frame times in ms
+    unsigned int head, count;
+};
+typedef struct pacer pacer;
+
+struct pacer_report {
+    float fps;
+    float mean_ms;
+    float p50_ms;
+    float p95_ms;
+    float p99_ms;
+    float max_ms;
+};
+typedef struct pacer_report pacer_report;
+
+void pacer_init(pacer *p, double hz);
+void pacer_wait(pacer *p);
+void pacer_resync(pacer *p);
+void pacer_mark(pacer *p);
+void pacer_report_get(const pacer *p, pacer_report *out);
+
+#endif /* defined(__CGBA__pacer__) */
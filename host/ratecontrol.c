@@ -0,0 +1,46 @@
+//
+//  ratecontrol.c
+//  CGBA
+//
+
+#include <string.h>
+#include "ratecontrol.h"
+
+///////**** Private ****///////
+
+// weight of the newest fill, the callback drains in bursts
+#define RC_SMOOTHING 0.0625
+// share of the error accumulated per update, removes the steady-state offset
+#define RC_INTEGRAL  0.002
+
+///////**** Public ****///////
+
+void rc_init(ratecontrol *rc, size_t target, double base) {
+    memset(rc, 0, sizeof(*rc));
+    rc->target = target;
+    rc->base = base;
+    rc->max_delta = RC_MAX_DELTA;
+    rc->fill = target;
+    rc->ratio = base;
+}
+
+/*
+ *  Feeds the fill after a frame's samples went in, returns the ratio for
+ *  the next frame. The proportional part asks for max_delta more samples
+ *  from an empty ring and max_delta fewer at twice the target; a slow
+ *  integral part learns the clocks' drift so the fill settles on target.
+ */
+double rc_update(ratecontrol *rc, size_t fill) {
+    double error, delta;
+
+    rc->fill += (fill - rc->fill) * RC_SMOOTHING;
+    error = (rc->target - rc->fill) / rc->target;
+    rc->drift += error * RC_INTEGRAL;
+    if (rc->drift > 1) rc->drift = 1;
+    if (rc->drift < -1) rc->drift = -1;
+    delta = (error + rc->drift) * rc->max_delta;
+    if (delta > rc->max_delta) delta = rc->max_delta;
+    if (delta < -rc->max_delta) delta = -rc->max_delta;
+    rc->ratio = rc->base * (1 + delta);
+    return rc->ratio;
+}
@@ -0,0 +1,38 @@
+//
+//  ratecontrol.h
+//  CGBA
+//
+
+/*
+ * Dynamic rate control for audio
+ * - the emulated machine and the audio device run on different clocks,
+ *   so a fixed resampling ratio slowly drains or floods the audio ring
+ * - after each emulated frame the ring's fill level nudges the ratio:
+ *   a little above 1 (more samples per emulated second) below the target
+ *   fill, a little below 1 above it, never more than `max_delta` away
+ * - `base` absorbs a known rate mismatch, e.g. a 60 Hz vsync pacing a
+ *   59.73 Hz machine, so only the unknown drift is left to the control
+ * - fill is passed in by the caller, no clock or SDL dependency
+ */
+
+#ifndef __CGBA__ratecontrol__
+#define __CGBA__ratecontrol__
+
+#include <stddef.h>
+
+#define RC_MAX_DELTA 0.005      // +-0.5%, about 8 cents of pitch
+
+struct ratecontrol {
+    double target;          // fill the control steers to, in frames
+    double base;
+    double max_delta;
+    double fill;            // smoothed fill
+    double drift;           // integral term, in units of max_delta
+    double ratio;
+};
+typedef struct ratecontrol ratecontrol;
+
+void rc_init(ratecontrol *rc, size_t target, double base);
+double rc_update(ratecontrol *rc, size_t fill);
+
+#endif /* defined(__CGBA__ratecontrol__) */
@@ -0,0 +1,230 @@
+//
+//  rewind.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rewind.h"
+#include "../gb/state.h"
+
+///////**** Private ****///////
+
+// Unchanged bytes shorter than this stay inside a literal
+#define RW_MIN_RUN 4
+// Coder overhead beyond the input, two varints for the first token
+#define RW_CODE_SLACK 32
+
+/*
+ *  Code of a XOR b (of a alone when b is NULL) as tokens: a varint count
+ *  of zero bytes to skip, a varint count of literal bytes, the literals.
+ *  Later tokens skip at least RW_MIN_RUN bytes, more than their header,
+ *  so the code never grows past the input plus one token header.
+ */
+static inline uint8_t _rw_xor(const uint8_t *a, const uint8_t *b, size_t i) {
+    return b ? a[i] ^ b[i] : a[i];
+}
+
+static uint8_t *_rw_put_varint(uint8_t *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static const uint8_t *_rw_get_varint(const uint8_t *p, size_t *v) {
+    unsigned int shift = 0;
+    *v = 0;
+    do {
+        *v |= (size_t)(*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return p;
+}
+
+static size_t _rw_encode(uint8_t *out, const uint8_t *a, const uint8_t *b, size_t n) {
+    uint8_t *p = out;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t run = i, lit, zeros = 0, k;
+
+        // skip whole words while they match, then bytes
+        if (b) {
+            while (run + 8 <= n && !memcmp(a + run, b + run, 8)) run += 8;
+        }
+        while (run < n && !_rw_xor(a, b, run)) run++;
+
+        // the literal ends before RW_MIN_RUN unchanged bytes
+        lit = run;
+        while (lit + zeros < n) {
+            if (_rw_xor(a, b, lit + zeros)) {
+                lit += zeros + 1;
+                zeros = 0;
+            }
+            else if (++zeros == RW_MIN_RUN) {
+                break;
+            }
+        }
+
+        p = _rw_put_varint(p, run - i);
+        p = _rw_put_varint(p, lit - run);
+        for (k = run; k < lit; k++) *p++ = _rw_xor(a, b, k);
+        i = lit;
+    }
+    return p - out;
+}
+
+// XORs a code into state, a keyframe decodes onto zeros
+static void _rw_apply(uint8_t *state, const uint8_t *code, size_t length) {
+    const uint8_t *p = code, *end = code + length;
+    size_t i = 0;
+
+    while (p < end) {
+        size_t skip, lit, k;
+        p = _rw_get_varint(p, &skip);
+        p = _rw_get_varint(p, &lit);
+        i += skip;
+        for (k = 0; k < lit; k++) state[i + k] ^= p[k];
+        p += lit;
+        i += lit;
+    }
+}
+
+static inline rw_entry *_rw_entry(const rewinder *rw, unsigned int i) {
+    return &rw->entries[(rw->first + i) % rw->capacity];
+}
+
+static void _rw_evict(rewinder *rw) {
+    const rw_entry *e = _rw_entry(rw, 0);
+    rw->used -= e->delta + e->key;
+    rw->first = (rw->first + 1) % rw->capacity;
+    rw->count--;
+}
+
+static inline int _rw_overlaps(const rw_entry *e, size_t start, size_t len) {
+    return e->offset < start + len && start < e->offset + e->delta + e->key;
+}
+
+/*
+ *  Entries sit in the arena in recording order, wrapping to the start
+ *  when the end is too short. Room comes from the oldest entries, which
+ *  are always the ones just past the write position.
+ */
+static uint8_t *_rw_alloc(rewinder *rw, size_t len) {
+    size_t start = rw->write;
+
+    if (len > rw->arena_size) return NULL;
+    if (rw->count == rw->capacity) _rw_evict(rw);
+    if (start + len > rw->arena_size) {
+        while (rw->count && _rw_entry(rw, 0)->offset >= start) _rw_evict(rw);
+        start = 0;
+    }
+    while (rw->count && _rw_overlaps(_rw_entry(rw, 0), start, len)) _rw_evict(rw);
+    rw->write = start + len;
+    return rw->arena + start;
+}
+
+///////**** Public ****///////
+
+int rw_init(rewinder *rw, unsigned int frames, size_t bytes, unsigned int keyframe) {
+    memset(rw, 0, sizeof(*rw));
+    rw->size = st_size(ST_ALL);
+    rw->capacity = frames;
+    rw->keyframe = keyframe ? keyframe : RW_KEYFRAME;
+    rw->arena_size = bytes;
+    rw->arena = malloc(bytes);
+    rw->entries = malloc(frames * sizeof(rw_entry));
+    rw->state = calloc(1, rw->size);
+    rw->scratch = malloc(rw->size);
+    rw->code = malloc(2 * (rw->size + RW_CODE_SLACK));
+    if (!frames || !rw->arena || !rw->entries || !rw->state || !rw->scratch || !rw->code) {
+        fprintf(stderr, "Rewind history not allocated\n");
+        rw_free(rw);
+        return -1;
+    }
+    return 0;
+}
+
+void rw_free(rewinder *rw) {
+    free(rw->arena);
+    free(rw->entries);
+    free(rw->state);
+    free(rw->scratch);
+    free(rw->code);
+    memset(rw, 0, sizeof(*rw));
+}
+
+int rw_record(rewinder *rw) {
+    const int key = rw->since_key == 0;
+    size_t delta, length = 0;
+    rw_entry *e;
+    uint8_t *blob, *swap;
+
+    if (!st_save(rw->scratch, rw->size, ST_ALL)) return -1;
+    delta = _rw_encode(rw->code, rw->scratch, rw->state, rw->size);
+    if (key) length = _rw_encode(rw->code + delta, rw->scratch, NULL, rw->size);
+    blob = _rw_alloc(rw, delta + length);
+    if (!blob) return -1;
+    memcpy(blob, rw->code, delta + length);
+
+    e = _rw_entry(rw, rw->count++);
+    e->offset = blob - rw->arena;
+    e->delta = (uint32_t)delta;
+    e->key = (uint32_t)length;
+    rw->used += delta + length;
+    rw->since_key = (rw->since_key + 1) % rw->keyframe;
+
+    swap = rw->state;
+    rw->state = rw->scratch;
+    rw->scratch = swap;
+    return 0;
+}
+
+/*
+ *  Goes back through the deltas from the newest snapshot, or forward from
+ *  the nearest keyframe at or before the target when that decodes less
+ */
+int rw_seek_back(rewinder *rw, unsigned int frames) {
+    unsigned int target, i, k;
+    size_t back = 0, forward = 0;
+    const rw_entry *e;
+
+    if (!rw->count) return -1;
+    if (frames > rw->count - 1) frames = rw->count - 1;
+    target = rw->count - 1 - frames;
+
+    for (i = target + 1; i < rw->count; i++) back += _rw_entry(rw, i)->delta;
+    for (k = target; k > 0 && !_rw_entry(rw, k)->key; k--) forward += _rw_entry(rw, k)->delta;
+    e = _rw_entry(rw, k);
+    if (e->key && e->key + forward < back) {
+        memset(rw->state, 0, rw->size);
+        _rw_apply(rw->state, rw->arena + e->offset + e->delta, e->key);
+        for (i = k + 1; i <= target; i++) {
+            e = _rw_entry(rw, i);
+            _rw_apply(rw->state, rw->arena + e->offset, e->delta);
+        }
+    }
+    else {
+        for (i = rw->count - 1; i > target; i--) {
+            e = _rw_entry(rw, i);
+            _rw_apply(rw->state, rw->arena + e->offset, e->delta);
+        }
+    }
+
+    // the frames after the target are gone, recording resumes from it
+    while (rw->count > target + 1) {
+        e = _rw_entry(rw, --rw->count);
+        rw->used -= e->delta + e->key;
+    }
+    e = _rw_entry(rw, target);
+    rw->write = e->offset + e->delta + e->key;
+    return st_load(rw->state, rw->size, ST_ALL);
+}
+
+int rw_step_back(rewinder *rw) {
+    return rw_seek_back(rw, 1);
+}
@@ -0,0 +1,61 @@
+//
+//  rewind.h
+//  CGBA
+//
+
+/*
+ * Rewind history, a ring of recent machine snapshots
+ * - every recorded frame keeps the XOR of its snapshot with the previous
+ *   one, run-length coded: a frame typically changes a few hundred bytes
+ *   of a 32 KiB snapshot, so it costs a few hundred bytes to keep
+ * - XOR works both ways, so stepping back applies the newest frame's
+ *   delta to the newest snapshot; one keyframe (the whole snapshot, coded
+ *   the same way) every `keyframe` frames lets long jumps start nearer
+ * - bounded by both a frame count and the bytes held in a fixed arena,
+ *   the oldest frames are dropped to make room
+ * - built on gb/state.h, no clock or SDL dependency
+ */
+
+#ifndef __CGBA__rewind__
+#define __CGBA__rewind__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define RW_KEYFRAME 60          // default frames between keyframes, one a second
+
+// One recorded frame: its delta then, on keyframes, the whole snapshot
+struct rw_entry {
+    size_t   offset;            // into the arena
+    uint32_t delta;
+    uint32_t key;               // 0 when not a keyframe
+};
+typedef struct rw_entry rw_entry;
+
+struct rewinder {
+    uint8_t  *arena;
+    size_t    arena_size;
+    size_t    write;            // end of the newest entry
+    size_t    used;             // bytes held by entries
+    rw_entry *entries;
+    unsigned int capacity;      // most frames held
+    unsigned int first;         // oldest entry
+    unsigned int count;
+    unsigned int keyframe;
+    unsigned int since_key;     // frames recorded since the last keyframe
+    size_t    size;             // snapshot bytes
+    uint8_t  *state;            // snapshot of the newest frame
+    uint8_t  *scratch;
+    uint8_t  *code;             // coder output, worst case for a keyframe entry
+};
+typedef struct rewinder rewinder;
+
+int  rw_init(rewinder *rw, unsigned int frames, size_t bytes, unsigned int keyframe);
+void rw_free(rewinder *rw);
+// Snapshots the machine as the newest frame
+int  rw_record(rewinder *rw);
+// Drops the newest `frames` frames and loads the one before them, stops at the oldest
+int  rw_seek_back(rewinder *rw, unsigned int frames);
+int  rw_step_back(rewinder *rw);
+
+#endif /* defined(__CGBA__rewind__) */
@@ -0,0 +1,243 @@
+//
+//  scaler.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "scaler.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SC_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SC_NEON
+#endif
+
+///////**** Private ****///////
+
+// Repeats each pixel factor times into one output row
+static void _sc_widen(const uint16_t *src, int w, int factor, uint16_t *out) {
+    int x, i;
+    for (x = 0; x < w; x++) {
+        for (i = 0; i < factor; i++) out[x * factor + i] = src[x];
+    }
+}
+
+static void _sc_widen_simd(const uint16_t *src, int w, int factor, uint16_t *out) {
+    int x = 0;
+#if defined(SC_SSE2)
+    if (factor == 2 || factor == 4) {
+        for (; x + 8 <= w; x += 8) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)&src[x]);
+            const __m128i lo = _mm_unpacklo_epi16(v, v);
+            const __m128i hi = _mm_unpackhi_epi16(v, v);
+            __m128i *o = (__m128i *)&out[x * factor];
+            if (factor == 2) {
+                _mm_storeu_si128(o + 0, lo);
+                _mm_storeu_si128(o + 1, hi);
+            }
+            else {
+                _mm_storeu_si128(o + 0, _mm_unpacklo_epi32(lo, lo));
+                _mm_storeu_si128(o + 1, _mm_unpackhi_epi32(lo, lo));
+                _mm_storeu_si128(o + 2, _mm_unpacklo_epi32(hi, hi));
+                _mm_storeu_si128(o + 3, _mm_unpackhi_epi32(hi, hi));
+            }
+        }
+    }
+#elif defined(SC_NEON)
+    // interleaving stores of the same register repeat every lane
+    for (; x + 8 <= w && factor > 1; x += 8) {
+        const uint16x8_t v = vld1q_u16(&src[x]);
+        if (factor == 2) {
+            const uint16x8x2_t r = {{v, v}};
+            vst2q_u16(&out[x * 2], r);
+        }
+        else if (factor == 3) {
+            const uint16x8x3_t r = {{v, v, v}};
+            vst3q_u16(&out[x * 3], r);
+        }
+        else {
+            const uint16x8x4_t r = {{v, v, v, v}};
+            vst4q_u16(&out[x * 4], r);
+        }
+    }
+#endif
+    _sc_widen(src + x, w - x, factor, out + x * factor);
+}
+
+static void _sc_nearest(const uint16_t *src, int w, int factor, uint16_t *dst,
+                        int y0, int y1, uint8_t simd) {
+    const int dw = w * factor;
+    int y, i;
+    for (y = y0; y < y1; y++) {
+        uint16_t *row = &dst[(size_t)y * factor * dw];
+        if (simd) _sc_widen_simd(&src[y * w], w, factor, row);
+        else _sc_widen(&src[y * w], w, factor, row);
+        for (i = 1; i < factor; i++) {
+            memcpy(row + i * dw, row, dw * sizeof(uint16_t));
+        }
+    }
+}
+
+/*
+ *  Scale2x around E, with B above, H below, D left and F right
+ *  E0 E1
+ *  E2 E3
+ */
+static void _sc_scale2x_px(uint16_t *d0, uint16_t *d1, uint16_t b, uint16_t d,
+                           uint16_t e, uint16_t f, uint16_t h) {
+    d0[0] = (d == b && b != f && d != h) ? d : e;
+    d0[1] = (b == f && b != d && f != h) ? f : e;
+    d1[0] = (d == h && d != b && h != f) ? d : e;
+    d1[1] = (h == f && d != h && b != f) ? f : e;
+}
+
+// Edge pixels repeat themselves as their missing neighbours
+static void _sc_scale2x_span(const uint16_t *up, const uint16_t *row, const uint16_t *down,
+                             int w, int x0, int x1, uint16_t *d0, uint16_t *d1) {
+    int x;
+    for (x = x0; x < x1; x++) {
+        const uint16_t d = row[x > 0 ? x - 1 : x];
+        const uint16_t f = row[x < w - 1 ? x + 1 : x];
+        _sc_scale2x_px(&d0[x * 2], &d1[x * 2], up[x], d, row[x], f, down[x]);
+    }
+}
+
+static void _sc_scale2x(const uint16_t *src, int w, int h, uint16_t *dst,
+                        int y0, int y1, uint8_t simd) {
+    int y;
+    for (y = y0; y < y1; y++) {
+        const uint16_t *row = &src[y * w];
+        const uint16_t *up = y > 0 ? row - w : row;
+        const uint16_t *down = y < h - 1 ? row + w : row;
+        uint16_t *d0 = &dst[(size_t)y * 4 * w];
+        uint16_t *d1 = d0 + 2 * w;
+        int x = 0;
+        if (simd && w > 9) {
+            // x = 0 needs a clamped left neighbour, so vectors start at 1
+            _sc_scale2x_span(up, row, down, w, 0, 1, d0, d1);
+            x = 1;
+#if defined(SC_SSE2)
+            for (; x + 9 <= w; x += 8) {
+                const __m128i b = _mm_loadu_si128((const __m128i *)&up[x]);
+                const __m128i d = _mm_loadu_si128((const __m128i *)&row[x - 1]);
+                const __m128i e = _mm_loadu_si128((const __m128i *)&row[x]);
+                const __m128i f = _mm_loadu_si128((const __m128i *)&row[x + 1]);
+                const __m128i hh = _mm_loadu_si128((const __m128i *)&down[x]);
+                const __m128i db = _mm_cmpeq_epi16(d, b), bf = _mm_cmpeq_epi16(b, f);
+                const __m128i dh = _mm_cmpeq_epi16(d, hh), hf = _mm_cmpeq_epi16(hh, f);
+                const __m128i m0 = _mm_andnot_si128(dh, _mm_andnot_si128(bf, db));
+                const __m128i m1 = _mm_andnot_si128(hf, _mm_andnot_si128(db, bf));
+                const __m128i m2 = _mm_andnot_si128(hf, _mm_andnot_si128(db, dh));
+                const __m128i m3 = _mm_andnot_si128(bf, _mm_andnot_si128(dh, hf));
+                const __m128i e0 = _mm_or_si128(_mm_and_si128(m0, d), _mm_andnot_si128(m0, e));
+                const __m128i e1 = _mm_or_si128(_mm_and_si128(m1, f), _mm_andnot_si128(m1, e));
+                const __m128i e2 = _mm_or_si128(_mm_and_si128(m2, d), _mm_andnot_si128(m2, e));
+                const __m128i e3 = _mm_or_si128(_mm_and_si128(m3, f), _mm_andnot_si128(m3, e));
+                _mm_storeu_si128((__m128i *)&d0[x * 2], _mm_unpacklo_epi16(e0, e1));
+                _mm_storeu_si128((__m128i *)&d0[x * 2 + 8], _mm_unpackhi_epi16(e0, e1));
+                _mm_storeu_si128((__m128i *)&d1[x * 2], _mm_unpacklo_epi16(e2, e3));
+                _mm_storeu_si128((__m128i *)&d1[x * 2 + 8], _mm_unpackhi_epi16(e2, e3));
+            }
+#elif defined(SC_NEON)
+            for (; x + 9 <= w; x += 8) {
+                const uint16x8_t b = vld1q_u16(&up[x]);
+                const uint16x8_t d = vld1q_u16(&row[x - 1]);
+                const uint16x8_t e = vld1q_u16(&row[x]);
+                const uint16x8_t f = vld1q_u16(&row[x + 1]);
+                const uint16x8_t hh = vld1q_u16(&down[x]);
+                const uint16x8_t db = vceqq_u16(d, b), bf = vceqq_u16(b, f);
+                const uint16x8_t dh = vceqq_u16(d, hh), hf = vceqq_u16(hh, f);
+                const uint16x8x2_t top = {{
+                    vbslq_u16(vbicq_u16(vbicq_u16(db, bf), dh), d, e),
+                    vbslq_u16(vbicq_u16(vbicq_u16(bf, db), hf), f, e)
+                }};
+                const uint16x8x2_t bottom = {{
+                    vbslq_u16(vbicq_u16(vbicq_u16(dh, db), hf), d, e),
+                    vbslq_u16(vbicq_u16(vbicq_u16(hf, dh), bf), f, e)
+                }};
+                vst2q_u16(&d0[x * 2], top);
+                vst2q_u16(&d1[x * 2], bottom);
+            }
+#endif
+        }
+        _sc_scale2x_span(up, row, down, w, x, w, d0, d1);
+    }
+}
+
+static void _sc_run(const scaler *s, const uint16_t *src, int w, int h,
+                    uint16_t *dst, int y0, int y1, uint8_t simd) {
+    if (y0 < 0) y0 = 0;
+    if (y1 > h) y1 = h;
+    if (s->kind == SC_SCALE2X) _sc_scale2x(src, w, h, dst, y0, y1, simd);
+    else _sc_nearest(src, w, s->factor, dst, y0, y1, simd);
+}
+
+///////**** Public ****///////
+
+int sc_parse(scaler *s, const char *name) {
+    if (!strcmp(name, "scale2x")) {
+        s->kind = SC_SCALE2X;
+        s->factor = 2;
+        return 0;
+    }
+    if (name[0] >= '1' && name[0] <= '0' + SC_MAX_FACTOR && !strcmp(name + 1, "x")) {
+        s->kind = SC_NEAREST;
+        s->factor = name[0] - '0';
+        return 0;
+    }
+    fprintf(stderr, "Unknown scaler %s, use 1x-%dx or scale2x\n", name, SC_MAX_FACTOR);
+    return -1;
+}
+
+const char *sc_name(const scaler *s) {
+    static const char *nearest[SC_MAX_FACTOR] = {"1x", "2x", "3x", "4x"};
+    if (s->kind == SC_SCALE2X) return "scale2x";
+    return nearest[s->factor - 1];
+}
+
+const char *sc_isa() {
+#if defined(SC_SSE2)
+    return "sse2";
+#elif defined(SC_NEON)
+    return "neon";
+#else
+    return "c";
+#endif
+}
+
+int sc_fit(int w, int h, int max_w, int max_h) {
+    int factor = SC_MAX_FACTOR;
+    while (factor > 1 && (w * factor > max_w || h * factor > max_h)) factor--;
+    return factor;
+}
+
+void sc_next(scaler *s, int fit) {
+    if (s->kind == SC_NEAREST && s->factor < fit) {
+        s->factor++;
+    }
+    else if (s->kind == SC_NEAREST && fit >= 2) {
+        s->kind = SC_SCALE2X;
+        s->factor = 2;
+    }
+    else {
+        s->kind = SC_NEAREST;
+        s->factor = 1;
+    }
+}
+
+int sc_halo(const scaler *s) {
+    return s->kind == SC_SCALE2X ? 1 : 0;
+}
+
+void sc_run(const scaler *s, const uint16_t *src, int w, int h,
+            uint16_t *dst, int y0, int y1) {
+    _sc_run(s, src, w, h, dst, y0, y1, 1);
+}
+
+void sc_run_reference(const scaler *s, const uint16_t *src, int w, int h,
+                      uint16_t *dst, int y0, int y1) {
+    _sc_run(s, src, w, h, dst, y0, y1, 0);
+}
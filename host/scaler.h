@@ -0,0 +1,51 @@
+//
+//  scaler.h
+//  CGBA
+//
+
+/*
+ * Software upscalers for BGR555 framebuffers
+ * - nearest: every pixel becomes an exact factor x factor block, 1x to 4x
+ * - scale2x: edge-aware 2x (AdvMAME2x), smooths diagonals without blurring
+ * - SSE2 or NEON when the compiler targets them, plain C otherwise;
+ *   sc_run_reference is always the plain C path, for checks and benchmarks
+ * - a call scales source rows [y0, y1), so only changed lines need work
+ */
+
+#ifndef __CGBA__scaler__
+#define __CGBA__scaler__
+
+#include <inttypes.h>
+
+#define SC_MAX_FACTOR 4
+
+enum sc_kind {
+    SC_NEAREST,
+    SC_SCALE2X
+};
+typedef enum sc_kind sc_kind;
+
+struct scaler {
+    sc_kind kind;
+    int factor;
+};
+typedef struct scaler scaler;
+
+int  sc_parse(scaler *s, const char *name);   // "1x".."4x" or "scale2x"
+const char *sc_name(const scaler *s);
+const char *sc_isa();
+
+// largest factor that fits w x h into max_w x max_h, at least 1
+int  sc_fit(int w, int h, int max_w, int max_h);
+// steps 1x, 2x .. fit, then scale2x if it fits, then back to 1x
+void sc_next(scaler *s, int fit);
+// source rows around a changed row whose output also changes
+int  sc_halo(const scaler *s);
+
+// dst is (w * factor) x (h * factor), rows packed
+void sc_run(const scaler *s, const uint16_t *src, int w, int h,
+            uint16_t *dst, int y0, int y1);
+void sc_run_reference(const scaler *s, const uint16_t *src, int w, int h,
+                      uint16_t *dst, int y0, int y1);
+
+#endif /* defined(__CGBA__scaler__) */
@@ -0,0 +1,158 @@
+//
+//  shmring.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+///////**** Private ****///////
+
+#define SHMR_ALIGN 64
+
+static inline size_t _shmr_align(size_t n) {
+    return (n + SHMR_ALIGN - 1) & ~(size_t)(SHMR_ALIGN - 1);
+}
+
+static inline shmr_slot *_shmr_slot(const shmring *r, uint64_t frame) {
+    const shmr_header *h = r->header;
+    return (shmr_slot *)((uint8_t *)r->header + h->slot_offset + (frame % h->slot_count) * h->slot_size);
+}
+
+static inline uint16_t *_shmr_pixels(const shmring *r, shmr_slot *slot) {
+    return (uint16_t *)((uint8_t *)slot + r->header->pixel_offset);
+}
+
+///////**** Public ****///////
+
+// Creates (or replaces) the named ring, the caller becomes its writer
+int shmr_create(shmring *r, const char *name, uint32_t width, uint32_t height, uint32_t slots) {
+    const size_t pixel_offset = _shmr_align(sizeof(shmr_slot));
+    const size_t slot_size = _shmr_align(pixel_offset + (size_t)width * height * sizeof(uint16_t));
+    const size_t slot_offset = _shmr_align(sizeof(shmr_header));
+    shmr_header *h;
+    uint32_t i;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->size = slot_offset + slot_size * slots;
+    r->owner = 1;
+
+    fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0 || ftruncate(fd, r->size)) {
+        fprintf(stderr, "Could not create shared memory %s: %s\n", name, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(name);
+        }
+        return -1;
+    }
+    h = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared memory %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return -1;
+    }
+
+    h->version = SHMR_VERSION;
+    h->format = SHMR_BGR555;
+    h->width = width;
+    h->height = height;
+    h->stride = width * sizeof(uint16_t);
+    h->slot_count = slots;
+    h->slot_size = (uint32_t)slot_size;
+    h->slot_offset = (uint32_t)slot_offset;
+    h->pixel_offset = (uint32_t)pixel_offset;
+    atomic_init(&h->latest, 0);
+    r->header = h;
+    for (i = 0; i < slots; i++) {
+        atomic_init(&_shmr_slot(r, i)->seq, 0);
+    }
+
+    // readers only trust the layout once the magic is published
+    atomic_thread_fence(memory_order_release);
+    h->magic = SHMR_MAGIC;
+    return 0;
+}
+
+// Maps an existing ring read-only
+int shmr_attach(shmring *r, const char *name) {
+    struct stat st;
+    shmr_header *h;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(shmr_header)) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    r->size = st.st_size;
+    h = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return -1;
+
+    if (h->magic != SHMR_MAGIC || h->version != SHMR_VERSION ||
+        (size_t)h->slot_offset + (size_t)h->slot_size * h->slot_count > r->size) {
+        munmap(h, r->size);
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    r->header = h;
+    return 0;
+}
+
+void shmr_close(shmring *r) {
+    if (!r->header) return;
+    munmap(r->header, r->size);
+    if (r->owner) shm_unlink(r->name);
+    r->header = NULL;
+}
+
+// Marks the next slot as being written and returns its pixels
+uint16_t *shmr_begin(shmring *r) {
+    shmr_slot *slot = _shmr_slot(r, r->frame);
+    atomic_store_explicit(&slot->seq, 2 * r->frame + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->frame = r->frame;
+    return _shmr_pixels(r, slot);
+}
+
+// Publishes the slot handed out by shmr_begin
+void shmr_commit(shmring *r) {
+    shmr_slot *slot = _shmr_slot(r, r->frame);
+    r->frame++;
+    atomic_store_explicit(&slot->seq, 2 * r->frame, memory_order_release);
+    atomic_store_explicit(&r->header->latest, r->frame, memory_order_release);
+}
+
+// Newest complete frame, -1 if there is none yet
+int shmr_latest(const shmring *r, shmr_view *v) {
+    const uint64_t latest = atomic_load_explicit(&r->header->latest, memory_order_acquire);
+    shmr_slot *slot;
+
+    if (!latest) return -1;
+    slot = _shmr_slot(r, latest - 1);
+    v->seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (v->seq & 1) return -1;
+    v->slot = slot;
+    v->frame = v->seq / 2 - 1;
+    v->pixels = _shmr_pixels(r, slot);
+    return 0;
+}
+
+// TRUE if the writer has not started reusing the view's slot
+int shmr_view_valid(const shmr_view *v) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&v->slot->seq, memory_order_relaxed) == v->seq;
+}
@@ -0,0 +1,75 @@
+//
+//  shmring.h
+//  CGBA
+//
+
+/*
+ * POSIX shared-memory frame ring for local consumers
+ * - a header describes the pixel format, dimensions and slot layout
+ * - the core renders straight into the slot being written
+ * - each slot has a sequence counter, odd while the slot is being written
+ *   and 2 * (frame + 1) once frame is complete; readers check it before and
+ *   after reading to detect an overwrite, so nothing is ever copied
+ */
+
+#ifndef __CGBA__shmring__
+#define __CGBA__shmring__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SHMR_MAGIC   0x41424743    // "CGBA"
+#define SHMR_VERSION 1
+#define SHMR_BGR555  1             // 15-bit, little-endian uint16 per pixel
+
+struct shmr_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;               // bytes per line
+    uint32_t slot_count;
+    uint32_t slot_size;            // bytes from one slot to the next
+    uint32_t slot_offset;          // first slot, from the start of the mapping
+    uint32_t pixel_offset;         // pixels, from the start of a slot
+    atomic_uint_fast64_t latest;   // frames completed so far
+};
+typedef struct shmr_header shmr_header;
+
+struct shmr_slot {
+    atomic_uint_fast64_t seq;
+    uint64_t frame;
+};
+typedef struct shmr_slot shmr_slot;
+
+struct shmring {
+    shmr_header *header;
+    size_t size;
+    uint64_t frame;                // writer only, frame being written
+    char name[64];
+    int owner;
+};
+typedef struct shmring shmring;
+
+// Frame as seen by a reader, valid until its slot is rewritten
+struct shmr_view {
+    const uint16_t *pixels;
+    const shmr_slot *slot;
+    uint64_t frame;
+    uint64_t seq;
+};
+typedef struct shmr_view shmr_view;
+
+int  shmr_create(shmring *r, const char *name, uint32_t width, uint32_t height, uint32_t slots);
+int  shmr_attach(shmring *r, const char *name);
+void shmr_close(shmring *r);
+
+uint16_t *shmr_begin(shmring *r);
+void      shmr_commit(shmring *r);
+
+int  shmr_latest(const shmring *r, shmr_view *v);
+int  shmr_view_valid(const shmr_view *v);
+
+#endif /* defined(__CGBA__shmring__) */
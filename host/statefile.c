@@ -0,0 +1,145 @@
+//
+//  statefile.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statefile.h"
+#include "../gb/state.h"
+#include "../gb/cpu/memorymodule.h"
+
+///////**** Private ****///////
+
+// ROM header identity, a file only loads over its own cartridge
+#define SF_CART_ID      0x0134
+#define SF_CART_ID_SIZE 0x1C
+
+static inline size_t _sf_align(size_t n) {
+    return (n + SF_BLOCK - 1) & ~(size_t)(SF_BLOCK - 1);
+}
+
+static int _sf_write_all(int fd, const uint8_t *p, size_t n) {
+    while (n) {
+        const ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+///////**** Public ****///////
+
+int sf_save(const char *path) {
+    const size_t state_size = st_size(ST_NO_MEMORY);
+    const size_t mem_offset = _sf_align(sizeof(sf_header) + state_size);
+    uint8_t *head = calloc(1, mem_offset + SM_MEM_SIZE);
+    sf_header *h = (sf_header *)head;
+    int fd, rc = -1;
+
+    if (!head) return -1;
+    h->magic = SF_MAGIC;
+    h->version = SF_VERSION;
+    h->state_offset = sizeof(sf_header);
+    h->state_size = (uint32_t)state_size;
+    h->mem_offset = (uint32_t)mem_offset;
+    h->mem_size = SM_MEM_SIZE;
+    st_save(head + h->state_offset, state_size, ST_NO_MEMORY);
+    sm_read_block(0, head + mem_offset, SM_MEM_SIZE);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && !_sf_write_all(fd, head, mem_offset + SM_MEM_SIZE)) {
+        rc = 0;
+    }
+    if (fd < 0 || rc) fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+    if (fd >= 0 && close(fd)) rc = -1;
+    free(head);
+    return rc;
+}
+
+// Whether path starts like a mapped snapshot file
+int sf_detect(const char *path) {
+    FILE *f = fopen(path, "rb");
+    uint32_t magic = 0;
+    if (!f) return 0;
+    if (fread(&magic, sizeof(magic), 1, f) != 1) magic = 0;
+    fclose(f);
+    return magic == SF_MAGIC;
+}
+
+/*
+ *  Switches the machine onto the file's address space. Nothing is read
+ *  up front beyond the first block; a rejected file leaves the machine
+ *  and any earlier mapping in f as they were.
+ */
+int sf_load(statefile *f, const char *path) {
+    const long page = sysconf(_SC_PAGESIZE);
+    uint8_t *map, *mem;
+    const sf_header *h;
+    struct stat st;
+    uint8_t id[SF_CART_ID_SIZE];
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    h = (const sf_header *)map;
+    if ((size_t)st.st_size < sizeof(*h) || h->magic != SF_MAGIC || h->version > SF_VERSION ||
+        h->mem_size != SM_MEM_SIZE || h->mem_offset % page ||
+        (size_t)h->state_offset + h->state_size > (size_t)st.st_size ||
+        (size_t)h->mem_offset + h->mem_size > (size_t)st.st_size) {
+        fprintf(stderr, "%s is not a mapped snapshot\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    mem = map + h->mem_offset;
+    sm_read_block(SF_CART_ID, id, SF_CART_ID_SIZE);
+    if (memcmp(id, mem + SF_CART_ID, SF_CART_ID_SIZE)) {
+        fprintf(stderr, "Snapshot is for another cartridge\n");
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    if (st_check(map + h->state_offset, h->state_size, ST_NO_MEMORY)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // devices reload against the new memory
+    sm_use_memory(mem);
+    st_load(map + h->state_offset, h->state_size, ST_NO_MEMORY);
+    if (f->map) munmap(f->map, f->size);
+    f->map = map;
+    f->size = st.st_size;
+    return 0;
+}
+
+// Moves the machine back to its own memory if it runs on this file
+void sf_close(statefile *f) {
+    const uint8_t *mem = sm_memory();
+    if (!f->map) return;
+    if (mem >= f->map && mem < f->map + f->size) sm_use_memory(NULL);
+    munmap(f->map, f->size);
+    f->map = NULL;
+    f->size = 0;
+}
@@ -0,0 +1,50 @@
+//
+//  statefile.h
+//  CGBA
+//
+
+/*
+ * Snapshot files that load by mapping rather than reading
+ * - a header and the snapshot's small sections (gb/state.h with
+ *   ST_NO_MEMORY) fill the first block, the whole 64 KiB address space
+ *   follows at a page-aligned offset
+ * - loading maps the file MAP_PRIVATE and runs the machine straight on
+ *   the mapped address space: pages are only read when the game touches
+ *   them and only copied when it writes them, the file never changes
+ * - blocks are 16 KiB so offsets stay aligned on 4 KiB and 16 KiB pages
+ * - POSIX only, like shmring
+ */
+
+#ifndef __CGBA__statefile__
+#define __CGBA__statefile__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define SF_MAGIC   0x46424743      // "CGBF"
+#define SF_VERSION 1
+#define SF_BLOCK   0x4000
+
+struct sf_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_offset;          // gb/state.h snapshot without memory
+    uint32_t state_size;
+    uint32_t mem_offset;            // address space image, SF_BLOCK aligned
+    uint32_t mem_size;
+};
+typedef struct sf_header sf_header;
+
+// One mapped file, the machine may be running on its memory
+struct statefile {
+    uint8_t *map;
+    size_t size;
+};
+typedef struct statefile statefile;
+
+int  sf_save(const char *path);
+int  sf_detect(const char *path);
+int  sf_load(statefile *f, const char *path);
+void sf_close(statefile *f);
+
+#endif /* defined(__CGBA__statefile__) */
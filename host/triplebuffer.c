@@ -0,0 +1,59 @@
+//
+//  triplebuffer.c
+//  CGBA
+//
+
+#include <stdlib.h>
+#include "triplebuffer.h"
+
+///////**** Private ****///////
+
+#define TB_INDEX 0x3
+#define TB_FRESH 0x4
+
+///////**** Public ****///////
+
+int tb_init(triplebuffer *tb, size_t slot_size) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        tb->slots[i] = calloc(1, slot_size);
+        if (!tb->slots[i]) {
+            tb_free(tb);
+            return -1;
+        }
+    }
+    tb->back = 0;
+    atomic_init(&tb->middle, 1);
+    tb->front = 2;
+    return 0;
+}
+
+void tb_free(triplebuffer *tb) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        free(tb->slots[i]);
+        tb->slots[i] = NULL;
+    }
+}
+
+void *tb_back(triplebuffer *tb) {
+    return tb->slots[tb->back];
+}
+
+void tb_publish(triplebuffer *tb) {
+    tb->back = atomic_exchange_explicit(&tb->middle, tb->back | TB_FRESH,
+                                        memory_order_acq_rel) & TB_INDEX;
+}
+
+int tb_acquire(triplebuffer *tb) {
+    if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TB_FRESH)) {
+        return 0;
+    }
+    tb->front = atomic_exchange_explicit(&tb->middle, tb->front,
+                                         memory_order_acq_rel) & TB_INDEX;
+    return 1;
+}
+
+void *tb_front(triplebuffer *tb) {
+    return tb->slots[tb->front];
+}
@@ -0,0 +1,37 @@
+//
+//  triplebuffer.h
+//  CGBA
+//
+
+/*
+ * Lock-free triple buffer between one producer and one consumer
+ * - the producer always owns a back slot it can fill without waiting
+ * - publishing swaps the back slot with the shared middle slot
+ * - the consumer swaps its front slot with the middle one when it is fresh
+ * Neither side ever blocks, the consumer simply sees the newest frame.
+ */
+
+#ifndef __CGBA__triplebuffer__
+#define __CGBA__triplebuffer__
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct triplebuffer {
+    void *slots[3];
+    atomic_uint middle;     // slot index, TB_FRESH when unread
+    unsigned int back;      // producer only
+    unsigned int front;     // consumer only
+};
+typedef struct triplebuffer triplebuffer;
+
+int  tb_init(triplebuffer *tb, size_t slot_size);
+void tb_free(triplebuffer *tb);
+
+void *tb_back(triplebuffer *tb);
+void  tb_publish(triplebuffer *tb);
+
+int   tb_acquire(triplebuffer *tb);   // TRUE when a new slot was taken
+void *tb_front(triplebuffer *tb);
+
+#endif /* defined(__CGBA__triplebuffer__) */
@@ -0,0 +1,206 @@
+//
+//  videoout.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "videoout.h"
+
+///////**** Private ****///////
+
+/*
+ *  BGR555 to Y'CbCr (BT.601, limited range) and to RGB24, shared by all
+ *  outputs and built once
+ */
+static uint8_t _vo_lut_yuv[0x8000][3];
+static uint8_t _vo_lut_rgb[0x8000][3];
+static pthread_once_t _vo_lut_once = PTHREAD_ONCE_INIT;
+
+static void _vo_build_luts() {
+    int c;
+    for (c = 0; c < 0x8000; c++) {
+        const int r5 = c & 0x1F, g5 = (c >> 5) & 0x1F, b5 = (c >> 10) & 0x1F;
+        const int r = (r5 << 3) | (r5 >> 2);
+        const int g = (g5 << 3) | (g5 >> 2);
+        const int b = (b5 << 3) | (b5 >> 2);
+        _vo_lut_rgb[c][0] = r;
+        _vo_lut_rgb[c][1] = g;
+        _vo_lut_rgb[c][2] = b;
+        _vo_lut_yuv[c][0] = (uint8_t)(( 66 * r + 129 * g +  25 * b + 128) / 256 + 16);
+        _vo_lut_yuv[c][1] = (uint8_t)((-38 * r -  74 * g + 112 * b + 128) / 256 + 128);
+        _vo_lut_yuv[c][2] = (uint8_t)((112 * r -  94 * g -  18 * b + 128) / 256 + 128);
+    }
+}
+
+static int _vo_write(int fd, const void *data, size_t size) {
+    const uint8_t *p = data;
+    while (size) {
+        const ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Converts one frame into vo->out, returns its size in bytes
+static size_t _vo_convert(videoout *vo, const uint16_t *src) {
+    const size_t pixels = (size_t)vo->width * vo->height;
+    uint8_t *out = vo->out;
+    size_t i;
+
+    if (vo->format == VO_RGB24) {
+        for (i = 0; i < pixels; i++) {
+            memcpy(out + i * 3, _vo_lut_rgb[src[i] & 0x7FFF], 3);
+        }
+        return pixels * 3;
+    }
+
+    // Y4M frames are a marker followed by full Y, Cb and Cr planes
+    memcpy(out, "FRAME\n", 6);
+    out += 6;
+    for (i = 0; i < pixels; i++) {
+        const uint8_t *yuv = _vo_lut_yuv[src[i] & 0x7FFF];
+        out[i]              = yuv[0];
+        out[i + pixels]     = yuv[1];
+        out[i + pixels * 2] = yuv[2];
+    }
+    return 6 + pixels * 3;
+}
+
+static void *_vo_writer(void *data) {
+    videoout *vo = data;
+
+    pthread_mutex_lock(&vo->lock);
+    for (;;) {
+        uint16_t *frame;
+        size_t size;
+
+        while (!vo->count && !vo->closing) {
+            pthread_cond_wait(&vo->not_empty, &vo->lock);
+        }
+        if (!vo->count) break;
+        frame = vo->queue[vo->tail];
+        pthread_mutex_unlock(&vo->lock);
+
+        size = _vo_convert(vo, frame);
+        const int failed = !vo->error && _vo_write(vo->fd, vo->out, size);
+
+        pthread_mutex_lock(&vo->lock);
+        if (failed) vo->error = errno ? errno : EIO;
+        vo->tail = (vo->tail + 1) % VO_QUEUE_DEPTH;
+        vo->count--;
+        pthread_cond_signal(&vo->not_full);
+    }
+    pthread_mutex_unlock(&vo->lock);
+    return NULL;
+}
+
+///////**** Public ****///////
+
+int vo_open(videoout *vo, const char *path, vo_format format,
+            int width, int height, int fps_num, int fps_den) {
+    char header[96];
+    int i, len;
+
+    memset(vo, 0, sizeof(*vo));
+    pthread_once(&_vo_lut_once, _vo_build_luts);
+    vo->format = format;
+    vo->width = width;
+    vo->height = height;
+    vo->frame_size = (size_t)width * height * sizeof(uint16_t);
+
+    vo->fd = strcmp(path, "-") ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+    if (vo->fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    vo->out = malloc(6 + (size_t)width * height * 3);
+    for (i = 0; i < VO_QUEUE_DEPTH; i++) {
+        vo->queue[i] = malloc(vo->frame_size);
+    }
+    for (i = 0; i < VO_QUEUE_DEPTH && vo->out; i++) {
+        if (!vo->queue[i]) break;
+    }
+    if (!vo->out || i < VO_QUEUE_DEPTH) {
+        fprintf(stderr, "Could not allocate video queue\n");
+        vo->closing = 1;
+        vo_close(vo);
+        return -1;
+    }
+
+    if (format == VO_Y4M) {
+        len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n",
+                       width, height, fps_num, fps_den);
+        if (_vo_write(vo->fd, header, len)) {
+            fprintf(stderr, "Could not write to %s: %s\n", path, strerror(errno));
+            vo->closing = 1;
+            vo_close(vo);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&vo->lock, NULL);
+    pthread_cond_init(&vo->not_empty, NULL);
+    pthread_cond_init(&vo->not_full, NULL);
+    pthread_create(&vo->writer, NULL, _vo_writer, vo);
+    return 0;
+}
+
+// Queues a frame, waits only while the queue is full
+int vo_push(videoout *vo, const uint16_t *pixels) {
+    int error;
+
+    pthread_mutex_lock(&vo->lock);
+    while (vo->count == VO_QUEUE_DEPTH && !vo->error) {
+        pthread_cond_wait(&vo->not_full, &vo->lock);
+    }
+    error = vo->error;
+    if (!error) {
+        memcpy(vo->queue[vo->head], pixels, vo->frame_size);
+        vo->head = (vo->head + 1) % VO_QUEUE_DEPTH;
+        vo->count++;
+        pthread_cond_signal(&vo->not_empty);
+    }
+    pthread_mutex_unlock(&vo->lock);
+    return error ? -1 : 0;
+}
+
+// Drains the queue and closes the output, -1 if any write failed
+int vo_close(videoout *vo) {
+    int i, error;
+
+    // a failed vo_open already marked closing and never started the writer
+    if (!vo->closing) {
+        pthread_mutex_lock(&vo->lock);
+        vo->closing = 1;
+        pthread_cond_signal(&vo->not_empty);
+        pthread_mutex_unlock(&vo->lock);
+        pthread_join(vo->writer, NULL);
+        pthread_mutex_destroy(&vo->lock);
+        pthread_cond_destroy(&vo->not_empty);
+        pthread_cond_destroy(&vo->not_full);
+    }
+
+    error = vo->error;
+    if (vo->fd > STDOUT_FILENO) {
+        if (close(vo->fd)) error = errno;
+    }
+    vo->fd = -1;
+    for (i = 0; i < VO_QUEUE_DEPTH; i++) {
+        free(vo->queue[i]);
+        vo->queue[i] = NULL;
+    }
+    free(vo->out);
+    vo->out = NULL;
+    return error ? -1 : 0;
+}
@@ -0,0 +1,48 @@
+//
+//  videoout.h
+//  CGBA
+//
+
+/*
+ * Streams BGR555 frames as Y4M (4:4:4) or raw RGB24
+ * - vo_push only copies the frame into a bounded queue
+ * - a writer thread converts and writes, a full queue makes vo_push wait,
+ *   so a slow consumer throttles emulation instead of dropping frames
+ * - the target is a file, a FIFO or stdout ("-")
+ */
+
+#ifndef __CGBA__videoout__
+#define __CGBA__videoout__
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define VO_QUEUE_DEPTH 8
+
+enum vo_format {
+    VO_Y4M,
+    VO_RGB24
+};
+typedef enum vo_format vo_format;
+
+struct videoout {
+    int fd;
+    vo_format format;
+    int width, height;
+    size_t frame_size;
+    uint16_t *queue[VO_QUEUE_DEPTH];
+    unsigned int head, tail, count;
+    int closing, error;
+    uint8_t *out;               // converted frame, writer thread only
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+typedef struct videoout videoout;
+
+int  vo_open(videoout *vo, const char *path, vo_format format,
+             int width, int height, int fps_num, int fps_den);
+int  vo_push(videoout *vo, const uint16_t *pixels);
+int  vo_close(videoout *vo);
+
+#endif /* defined(__CGBA__videoout__) */
@@ -0,0 +1,182 @@
+//
+//  cgb.c
+//  CGBA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cgb.h"
+#include "../gb/system.h"
+#include "../gb/state.h"
+#include "../gb/cpu/memorymodule.h"
+#include "../gb/gpu/ppu.h"
+#include "../gb/apu/apu.h"
+#include "../gb/input/joypad.h"
+
+///////**** Private ****///////
+
+// Sound is drained at least this often, well inside what blip buffers hold
+#define CGB_AUDIO_SLICE PPU_FRAME_CYCLES
+
+struct cgb {
+    sys_machine *machine;
+    uint8_t  keys;
+    uint8_t  draw;
+    int16_t *samples;       // of the last run, interleaved stereo
+    size_t   frames, room;  // sample pairs in it and it can hold
+    uint16_t fb[PPU_WIDTH * PPU_HEIGHT];
+};
+
+static void _cgb_enter(cgb *g) {
+    sys_machine_enter(g->machine, g->draw ? g->fb : NULL);
+}
+
+static void _cgb_leave(cgb *g) {
+    sys_machine_leave(g->machine);
+}
+
+// Appends what the APU made so far, growing the buffer as needed
+static void _cgb_drain(cgb *g) {
+    size_t avail;
+
+    if (!apu_get_rate()) return;
+    apu_run_to(sm_get_cycles());
+    avail = apu_avail();
+    if (g->frames + avail > g->room) {
+        const size_t room = (g->frames + avail) * 2;
+        int16_t *samples = realloc(g->samples, room * 2 * sizeof(int16_t));
+        if (!samples) {
+            fprintf(stderr, "Sound buffer not allocated\n");
+            return;
+        }
+        g->samples = samples;
+        g->room = room;
+    }
+    g->frames += apu_read(g->samples + g->frames * 2, avail);
+}
+
+///////**** Public ****///////
+
+unsigned int cgb_version() {
+    return CGB_API_VERSION;
+}
+
+cgb *cgb_new() {
+    cgb *g = calloc(1, sizeof(cgb));
+
+    if (!g) {
+        fprintf(stderr, "Machine not allocated\n");
+        return NULL;
+    }
+    g->draw = 1;
+    memset(g->fb, 0xFF, sizeof(g->fb));
+    g->machine = sys_machine_new();
+    if (!g->machine) {
+        fprintf(stderr, "Machine not allocated\n");
+        free(g);
+        return NULL;
+    }
+    return g;
+}
+
+void cgb_free(cgb *g) {
+    if (!g) return;
+    sys_machine_free(g->machine);
+    free(g->samples);
+    free(g);
+}
+
+int cgb_load_rom(cgb *g, const void *rom, size_t size) {
+    int rc;
+
+    _cgb_enter(g);
+    rc = sys_load_rom_buffer(rom, size);
+    _cgb_leave(g);
+    return rc;
+}
+
+int cgb_load_rom_file(cgb *g, const char *path) {
+    int rc;
+
+    _cgb_enter(g);
+    rc = sys_load_rom(path);
+    _cgb_leave(g);
+    return rc;
+}
+
+void cgb_run_frame(cgb *g) {
+    _cgb_enter(g);
+    jp_set_keys(g->keys);
+    g->frames = 0;
+    sys_run_frame();
+    _cgb_drain(g);
+    _cgb_leave(g);
+}
+
+// Run in slices towards the same end, so sound fits the blip buffers and
+// the machine stops where one sys_run_cycles would have
+void cgb_run_cycles(cgb *g, uint32_t cycles) {
+    uint64_t end;
+
+    _cgb_enter(g);
+    jp_set_keys(g->keys);
+    g->frames = 0;
+    end = sm_get_cycles() + cycles;
+    while (sm_get_cycles() < end) {
+        const uint64_t left = end - sm_get_cycles();
+        sys_run_cycles(apu_get_rate() && left > CGB_AUDIO_SLICE ? CGB_AUDIO_SLICE : (uint32_t)left);
+        _cgb_drain(g);
+    }
+    _cgb_leave(g);
+}
+
+void cgb_set_keys(cgb *g, uint8_t keys) {
+    g->keys = keys;
+}
+
+size_t cgb_state_size() {
+    return st_size(ST_ALL);
+}
+
+size_t cgb_save_state(cgb *g, void *buf, size_t size) {
+    size_t n;
+
+    _cgb_enter(g);
+    n = st_save(buf, size, ST_ALL);
+    _cgb_leave(g);
+    return n;
+}
+
+int cgb_load_state(cgb *g, const void *buf, size_t size) {
+    int rc;
+
+    _cgb_enter(g);
+    rc = st_load(buf, size, ST_ALL);
+    _cgb_leave(g);
+    return rc;
+}
+
+const uint16_t *cgb_framebuffer(const cgb *g) {
+    return g->fb;
+}
+
+void cgb_set_draw(cgb *g, int on) {
+    g->draw = on != 0;
+}
+
+void cgb_set_audio_rate(cgb *g, uint32_t hz) {
+    _cgb_enter(g);
+    apu_set_rate(hz);
+    g->frames = 0;
+    _cgb_leave(g);
+}
+
+const int16_t *cgb_audio(const cgb *g, size_t *frames) {
+    *frames = g->frames;
+    return g->samples;
+}
+
+uint8_t *cgb_memory(cgb *g) {
+    return sys_machine_memory(g->machine);
+}
@@ -0,0 +1,97 @@
+//
+//  cgb.h
+//  CGBA
+//
+
+/*
+ * libcgb: the DMG core as a library, to drive machines in-process
+ * - a small C API over an opaque handle; nothing else of the tree shows
+ *   through it, and CGB_API_VERSION only goes up when a call changes
+ * - a handle is a sys_machine (gb/system.h), which carries its own sound
+ *   output, plus a frame buffer. Each call enters it on the calling
+ *   thread and leaves it again, a pointer swap, so handles work from any
+ *   thread, each from one thread at a time, many at once from different
+ *   threads
+ * - the PPU draws straight into the handle's frame buffer, which
+ *   cgb_framebuffer hands out; sound is read out of the machine's APU
+ *   into the handle's sample buffer as the run goes, cgb_audio hands that
+ *   out
+ * - errors are reported on stderr and returned as -1 (or NULL)
+ */
+
+#ifndef __CGBA__cgb__
+#define __CGBA__cgb__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define CGB_API __attribute__((visibility("default")))
+#else
+#define CGB_API
+#endif
+
+#define CGB_API_VERSION 1
+
+// Frame buffer, BGR555 pixels in rows
+#define CGB_WIDTH  160
+#define CGB_HEIGHT 144
+
+// Keys, a mask of them is held until the next cgb_set_keys
+#define CGB_KEY_RIGHT  0x01
+#define CGB_KEY_LEFT   0x02
+#define CGB_KEY_UP     0x04
+#define CGB_KEY_DOWN   0x08
+#define CGB_KEY_A      0x10
+#define CGB_KEY_B      0x20
+#define CGB_KEY_SELECT 0x40
+#define CGB_KEY_START  0x80
+
+typedef struct cgb cgb;
+
+CGB_API unsigned int cgb_version();     // CGB_API_VERSION of the library
+
+CGB_API cgb *cgb_new();                 // powered on, no cartridge
+CGB_API void cgb_free(cgb *g);
+CGB_API int  cgb_load_rom(cgb *g, const void *rom, size_t size);
+CGB_API int  cgb_load_rom_file(cgb *g, const char *path);
+
+CGB_API void cgb_run_frame(cgb *g);                    // until the next VBlank
+CGB_API void cgb_run_cycles(cgb *g, uint32_t cycles);  // at least `cycles` T-cycles
+CGB_API void cgb_set_keys(cgb *g, uint8_t keys);       // CGB_KEY_ bits, from the next run
+
+// Snapshots of the whole machine, see gb/state.h
+CGB_API size_t cgb_state_size();
+CGB_API size_t cgb_save_state(cgb *g, void *buf, size_t size);      // bytes written, 0 if too small
+CGB_API int    cgb_load_state(cgb *g, const void *buf, size_t size);
+
+/*
+ *  The picture, CGB_WIDTH * CGB_HEIGHT, drawn in place by each run and
+ *  valid for the handle's life. Lines that did not change since the last
+ *  frame are not redrawn; with drawing off runs keep time and interrupts
+ *  but leave the picture as it was, which is cheaper.
+ */
+CGB_API const uint16_t *cgb_framebuffer(const cgb *g);
+CGB_API void cgb_set_draw(cgb *g, int on);              // on from cgb_new
+
+/*
+ *  Sound of the last run, `frames` interleaved stereo pairs of signed
+ *  16-bit samples, valid until the next call on the handle. No sound is
+ *  made until a rate is set, 0 turns it off again.
+ */
+CGB_API void cgb_set_audio_rate(cgb *g, uint32_t hz);
+CGB_API const int16_t *cgb_audio(const cgb *g, size_t *frames);
+
+// The 64 KiB address space as of the last call, writes take effect on the
+// next; loading a ROM moves it
+CGB_API uint8_t *cgb_memory(cgb *g);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__CGBA__cgb__) */
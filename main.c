@@ -7,8 +7,19 @@
 #include <stdlib.h>
 #include "gb/cpu/memorymodule.h"
 #include "gb/cpu/interpreter.h"
+#include "gb/system.h"
+#include "gb/gpu/sdl_server.h"
 #include "gba/gpu/sdl_server.h"
 
-int main(void) {
-    gba_srv_initialize();
+int main(int argc, char **argv) {
+    // a ROM path runs the DMG core, otherwise the GBA screen
+    if (argc > 1) {
+        if (sys_load_rom(argv[1])) {
+            return EXIT_FAILURE;
+        }
+        gb_srv_initialize();
+    }
+    else {
+        gba_srv_initialize();
+    }
 }
\ No newline at end of file